@@ -0,0 +1,75 @@
+#!/bin/sh
+# Optimized builds of aeval and synthlib2parser, and their speedup
+#
+# usage: bench/release.sh <source dir> <work dir> [<base build dir>]
+#
+# Builds, in <work dir>,
+#
+#   lto/  Release with AEVAL_LTO
+#   pgo/  the same, first with AEVAL_PGO=gen, which then solves every
+#         TRAIN_EVERY-th task of bench/tasks (default 5) in batch mode,
+#         and then with AEVAL_PGO=use on the profiles of that run
+#
+# and runs aebench over bench/tasks with the base build if given and
+# with each of them, writing <name>.jsonl and comparing the others with
+# the first one (see tools/aebench). `make release` runs it with the
+# build directory as the base.
+#
+# Environment: CMAKE_ARGS (more arguments of cmake, e.g. -DZ3_ROOT=...),
+# JOBS (of the builds, default 1), TRAIN_EVERY.
+
+src=${1:?usage: $0 <source dir> <work dir> [<base build dir>]}
+work=${2:?usage: $0 <source dir> <work dir> [<base build dir>]}
+base=$3
+every=${TRAIN_EVERY:-5}
+set -e
+mkdir -p $work
+# -- absolute, since aeval --batch reads the paths of train.txt relative
+# -- to its directory
+src=$(cd $src && pwd)
+work=$(cd $work && pwd)
+
+build () {
+  dir=$1; shift
+  cmake -S $src -B $work/$dir -DCMAKE_BUILD_TYPE=Release -DAEVAL_LTO=ON $CMAKE_ARGS "$@"
+  cmake --build $work/$dir --target aeval aebench -- -j${JOBS:-1}
+}
+
+# -- the parser of the PGO builds is rebuilt by each phase (its Makefile
+# -- does not see the change of the flags)
+cleanParser () {
+  rm -rf $src/synthlib2parser/obj/pgo $src/synthlib2parser/lib/pgo $src/synthlib2parser/bin/pgo
+}
+
+build lto
+
+# -- both phases in the same directory, so that the profiles of the
+# -- objects are found under the same paths
+prof=$work/pgo/profiles
+rm -rf $prof
+cleanParser
+build pgo -DAEVAL_PGO=gen -DAEVAL_PGO_DIR=$prof
+ls $src/bench/tasks/*_s_part.smt2 | sort | awk "NR % $every == 1" | sed 's/_s_part.smt2$//' |
+  while read t; do echo "${t}_s_part.smt2 ${t}_t_part.smt2"; done > $work/train.txt
+# -- a task out of its budget or failing still leaves its profile
+$work/pgo/tools/aeval/aeval --batch $work/train.txt --skol --budget 20000 > $work/train.out ||
+  echo "training run exited with $?"
+tail -1 $work/train.out
+# -- Clang writes raw profiles, to be merged
+if ls $prof/*.profraw > /dev/null 2>&1; then
+  llvm-profdata merge -o $prof/default.profdata $prof/*.profraw
+fi
+cleanParser
+build pgo -DAEVAL_PGO=use
+
+# -- all compared with the first one; regressions are reported, not fatal
+set +e
+ref=
+for b in ${base:+base} lto pgo; do
+  dir=$work/$b
+  [ $b = base ] && dir=$base
+  echo "== $b"
+  $dir/tools/aebench/aebench $src/bench/tasks --out $work/$b.jsonl \
+    ${ref:+--baseline $work/$ref.jsonl} | sed -n '/^tasks:/,$p'
+  ref=${ref:-$b}
+done
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Scaling curves of aeval over the generated families of tools/aegen
+#
+# usage: bench/scaling.sh <build dir> [family ...]
+#
+# For each family (default: chain maxmin cases counter) and each value
+# of PARAM (vars, partitions or depth; default vars) in SIZES, generates
+# a formula with aegen and solves it with aeval FLAGS --stats=json.
+# Prints a line of CSV per run:
+#
+#   family,param,size,verdict,wall_ms,iterations,solve_ms,skolem_ms,compact_ms,print_ms
+#
+# Environment: SIZES (default "1 2 4 8 16 32"), PARAM, ARITH (int, real
+# or mixed), FLAGS (default "--skol"; add --compact for compaction),
+# GENFLAGS (more options of aegen), TIMEOUT (s, default 60).
+#
+# example: SIZES="2 3 4 5" PARAM=partitions FLAGS="--skol --compact" \
+#            bench/scaling.sh build maxmin cases
+
+build=${1:?usage: $0 <build dir> [family ...]}
+shift
+families=${*:-chain maxmin cases counter}
+sizes=${SIZES:-1 2 4 8 16 32}
+param=${PARAM:-vars}
+flags=${FLAGS:---skol}
+limit=${TIMEOUT:-60}
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+# -- ms of a timer in the --stats=json line, 0 if it did not run
+timer() {
+  ms=$(grep -o "\"$1\": {\"count\": [0-9]*, \"ms\": [0-9.e+-]*}" $tmp/out |
+    sed 's/.*"ms": \([0-9.e+-]*\)}/\1/')
+  awk "BEGIN { printf \"%d\", ${ms:-0} }"
+}
+
+echo "family,param,size,verdict,wall_ms,iterations,solve_ms,skolem_ms,compact_ms,print_ms"
+for f in $families; do
+  for n in $sizes; do
+    $build/tools/aegen/aegen --family $f --$param $n --arith ${ARITH:-int} $GENFLAGS \
+      --out $tmp/task || exit 1
+    start=$(date +%s%N)
+    timeout $limit $build/tools/aeval/aeval $tmp/task_s_part.smt2 $tmp/task_t_part.smt2 \
+      $flags --stats=json > $tmp/out 2>&1
+    rc=$?
+    wall=$(( ($(date +%s%N) - start) / 1000000 ))
+    verdict=$(sed -n 's/.*{"result": "\([a-z]*\)".*/\1/p' $tmp/out)
+    [ $rc -eq 124 ] && verdict=timeout
+    iter=$(sed -n 's/.*"iterations": \([0-9]*\).*/\1/p' $tmp/out)
+    echo "$f,$param,$n,${verdict:-error},$wall,${iter:-0},$(timer solve),$(timer skolem),$(timer skolem.compact),$(timer serialize)"
+  done
+done
@@ -0,0 +1,155 @@
+#ifndef AEVAL__HPP__
+#define AEVAL__HPP__
+
+#include <algorithm>
+#include <string>
+#include "ufo/Smt/EZ3.hh"
+#include "ufo/Stats.hpp"
+
+/**
+ * Embeddable API of AE-VAL (the libaeval library): decides validity of
+ * \forall x . S(x) => \exists y . T(x, y), and synthesizes a Skolem
+ * function for y if it is valid. Results are returned as expressions
+ * of the factory of S and T; nothing is printed unless debug is set.
+ *
+ * A run also records its phase timers and counters in the Stats that
+ * is current in its thread, see ufo/Stats.hpp.
+ */
+namespace ufo
+{
+  /**
+   * Resource limits of a run; 0 means no limit
+   */
+  struct AeValLimits
+  {
+    unsigned timeout;     // per SMT query, in ms
+    unsigned rlimit;      // per SMT query, in Z3 resource units
+    ZCancelToken *cancel; // cancels the whole run
+    bool nativeMbp;       // see AeValSolver::setNativeMbp
+
+    AeValLimits () : timeout(0), rlimit(0), cancel(NULL), nativeMbp(false) {}
+  };
+
+  struct AeValOptions
+  {
+    bool skol;            // extract a Skolem function if valid
+    bool allInclusive;    // the all-inclusive one, which covers all models of T
+    bool compact;         // a smaller Skolem function, at the cost of more SMT queries
+    bool debug;           // print more info on outs () and perform sanity checks
+    AeValLimits lim;
+
+    AeValOptions () : skol(false), allInclusive(false), compact(false), debug(false) {}
+  };
+
+  enum AeValVerdict { AEVAL_VALID, AEVAL_INVALID, AEVAL_UNKNOWN };
+
+  inline const char *verdictName (AeValVerdict v)
+  {
+    return v == AEVAL_VALID ? "valid" : v == AEVAL_INVALID ? "invalid" : "unknown";
+  }
+
+  /**
+   * Statistics of a run; the ones of all runs in the all-inclusive mode
+   */
+  struct AeValStats
+  {
+    unsigned iterations;         // number of partitions found
+    unsigned mbpNative;          // projections by MBPUtils
+    unsigned mbpFallback;        // projections by Z3
+    double mbpTime;              // ms
+    unsigned implies;            // implication checks for the Skolem
+    unsigned impliesSimplex;     // ... of them answered by LRASimplex
+    double impliesSimplexTime;   // ms
+    double impliesZ3Time;        // ms
+    ZTransCache::Stats cache;    // of the Z3 context of the run
+    double solveTime;            // ms, deciding validity
+    double skolemTime;           // ms, extracting the Skolem function
+    unsigned nodes;              // Expr nodes created by the run
+
+    AeValStats () : iterations(0), mbpNative(0), mbpFallback(0), mbpTime(0),
+                    implies(0), impliesSimplex(0), impliesSimplexTime(0),
+                    impliesZ3Time(0), solveTime(0), skolemTime(0), nodes(0) {}
+
+    template <typename OutputStream>
+    void print (OutputStream &out) const
+    {
+      cache.print (out);
+      out << "mbp: native " << mbpNative << ", z3 " << mbpFallback
+          << ", time " << (long)(1000 * mbpTime) << " us\n";
+
+      // -- the time saved by simplex, estimated by the average time of
+      // -- the implications answered by Z3 (none if simplex was slower)
+      unsigned z3Cnt = implies - impliesSimplex;
+      double saved = z3Cnt == 0 ? 0 : std::max (0.0,
+        impliesSimplex * (impliesZ3Time / z3Cnt) - impliesSimplexTime);
+      out << "implies: " << implies << ", simplex " << impliesSimplex
+          << " (" << (implies == 0 ? 0 : 100 * impliesSimplex / implies)
+          << "%), simplex time " << (long)(1000 * impliesSimplexTime)
+          << " us, z3 time " << (long)(1000 * impliesZ3Time)
+          << " us, saved ~" << (long)(1000 * saved) << " us\n";
+    }
+  };
+
+  struct AeValResult
+  {
+    AeValVerdict verdict;
+    std::string reasonUnknown;   // if unknown
+
+    /**
+     * Projections of T found by the (first) run; if valid, they cover S,
+     * and the i-th of them guards the i-th case of the Skolem function
+     */
+    ExprVector partitions;
+
+    Expr skolem;                 // if valid, and skol or allInclusive
+    ExprVector model;            // if invalid: (= x v) for each x of S, in S /\ \neg T
+    Expr validSubset;            // if invalid: the part of S where it is valid
+    AeValStats stats;
+
+    AeValResult () : verdict(AEVAL_UNKNOWN) {}
+  };
+
+  /**
+   * Decides \forall x . s => \exists y . t, where y are the constants of
+   * t that are not in s. If z3 is given, the run uses that context (and
+   * its translation cache), which the caller keeps alive.
+   */
+  AeValResult aeSolve (Expr s, Expr t, const AeValOptions &opts = AeValOptions (),
+                       EZ3 *z3 = NULL);
+
+  /**
+   * Decides \forall x . \exists v . t, where x are the constants of t
+   * that are not in v; allInclusive is not supported
+   */
+  AeValResult aeSolve (Expr t, const ExprSet &v, const AeValOptions &opts = AeValOptions (),
+                       EZ3 *z3 = NULL);
+
+  /** Same for s and t in SMT-LIB, parsed into efac */
+  AeValResult aeSolve (ExprFactory &efac, const std::string &s, const std::string &t,
+                       const AeValOptions &opts = AeValOptions ());
+
+  /**
+   * Prints res in the format of the aeval tool: the verdict, the model
+   * and the valid subset if invalid, and the Skolem function if there
+   * is one. Formulas are printed in SMT-LIB by z3, or by a context of
+   * its own if it is not given.
+   */
+  void printResult (const AeValResult &res, const AeValOptions &opts,
+                    raw_ostream &out = outs (), EZ3 *z3 = NULL);
+
+  /** aeSolve followed by printResult */
+  void aeSolveAndSkolemize (Expr s, Expr t, bool skol, bool debug, bool compact,
+                            const AeValLimits &lim = AeValLimits (),
+                            raw_ostream &out = outs ());
+
+  void aeSolveAndSkolemize (Expr t, ExprSet &var_exist_quantified, bool skol,
+                            bool debug, bool compact,
+                            const AeValLimits &lim = AeValLimits (),
+                            raw_ostream &out = outs ());
+
+  void getAllInclusiveSkolem (Expr s, Expr t, bool debug, bool compact,
+                              const AeValLimits &lim = AeValLimits (),
+                              raw_ostream &out = outs ());
+}
+
+#endif
@@ -2,7 +2,10 @@
 #define AEVALSOLVER__HPP__
 #include <assert.h>
 
+#include <chrono>
 #include "ae/SMTUtils.hpp"
+#include "ae/MBPUtils.hpp"
+#include "ae/AeVal.hpp"
 #include "ufo/Smt/EZ3.hh"
 
 using namespace std;
@@ -28,7 +31,8 @@ namespace ufo
     ExprMap modelInvalid;
 
     ExprFactory &efac;
-    EZ3 z3;
+    std::unique_ptr<EZ3> ownZ3;
+    EZ3 &z3;
     ZSolver<EZ3> smt;
     SMTUtils u;
 
@@ -45,22 +49,57 @@ namespace ufo
     bool skol;
     bool debug;
     unsigned fresh_var_ind;
+    std::string reasonUnknown;
+
+    bool nativeMbp;       // project with MBPUtils, falling back to Z3
+    unsigned mbpNative;
+    unsigned mbpFallback;
+    double mbpTime;       // ms spent in projections
+
+    /**
+     * SMT check of the current assertions. A query that runs out of its
+     * limits is retried once with doubled limits before unknown is
+     * reported.
+     */
+    boost::tribool check ()
+    {
+      boost::tribool res = smt.solve ();
+      if (boost::indeterminate (res) && !z3.isCancelled () &&
+          (smt.getTimeout () > 0 || smt.getRlimit () > 0))
+      {
+        if (debug) outs () << "retrying: " << smt.reasonUnknown () << "\n";
+        AE_COUNT ("smt.retry");
+        res = smt.solve (2 * smt.getTimeout (), 2 * smt.getRlimit ());
+      }
+      if (boost::indeterminate (res))
+        reasonUnknown = z3.isCancelled () ? "canceled" : smt.reasonUnknown ();
+      return res;
+    }
 
   public:
 
-    AeValSolver (Expr _s, Expr _t, ExprSet &_v, bool _debug, bool _skol) :
+    AeValSolver (Expr _s, Expr _t, ExprSet &_v, bool _debug, bool _skol,
+                 EZ3 *_z3 = NULL) :
       s(_s), t(_t), v(_v),
       efac(s->getFactory()),
-      z3(efac),
+      ownZ3(_z3 ? NULL : new EZ3(efac)),
+      z3(_z3 ? *_z3 : *ownZ3),
       smt (z3),
-      u(efac),
+      u(efac, &z3),
       fresh_var_ind(0),
       partitioning_size(0),
       skol(_skol),
-      debug(_debug)
+      debug(_debug),
+      nativeMbp(false),
+      mbpNative(0),
+      mbpFallback(0),
+      mbpTime(0)
     {
-      filter (s, bind::IsConst (), back_inserter (sVars));
-      filter (boolop::land(s,t), bind::IsConst (), back_inserter (stVars));
+      filterConsts (s, back_inserter (sVars));
+      filterConsts (boolop::land(s,t), back_inserter (stVars));
+
+      // -- definition mining
+      AE_TIMER ("defs");
       getConj(t, tConjs);
 
       for (auto &exp: v) {
@@ -79,27 +118,35 @@ namespace ufo
       skolSkope = mk<TRUE>(efac);
     }
 
-    AeValSolver ( Expr _st, ExprSet &_v, bool _debug, bool _skol) :
+    AeValSolver ( Expr _st, ExprSet &_v, bool _debug, bool _skol,
+                  EZ3 *_z3 = NULL) :
       t(_st), v(_v),
       efac(_st->getFactory()),
-      z3(efac),
+      ownZ3(_z3 ? NULL : new EZ3(efac)),
+      z3(_z3 ? *_z3 : *ownZ3),
       smt (z3),
-      u(efac),
+      u(efac, &z3),
       fresh_var_ind(0),
       partitioning_size(0),
       skol(_skol),
-      debug(_debug)
+      debug(_debug),
+      nativeMbp(false),
+      mbpNative(0),
+      mbpFallback(0),
+      mbpTime(0)
     {
-      outs() << "vars preinitialized "<<"\n";
+      if (debug) outs() << "vars preinitialized "<<"\n";
       s = mk<TRUE>(efac);// TODO
     
-      filter (_st, bind::IsConst (), back_inserter (stVars));
+      filterConsts (_st, back_inserter (stVars));
 
       ExprSet stVars_set(stVars.begin(), stVars.end());
       ExprSet sVars_set  = minusSets(stVars_set, _v);
       for (auto &exp: sVars_set) 
         sVars.emplace_back(exp);
-      outs() << "vars initialized "<<"\n";
+      if (debug) outs() << "vars initialized "<<"\n";
+
+      AE_TIMER ("defs");
       getConj(t, tConjs);
 
       for (auto &exp: v) {
@@ -142,6 +189,8 @@ namespace ufo
 
       for (auto & a : m3)
       {
+        // -- the solver reports unknown right away then, so stop here
+        if (z3.isCancelled()) return;
         for (auto & b : m1)
         {
           if (b.second == NULL) continue;
@@ -159,24 +208,28 @@ namespace ufo
      */
     boost::tribool solve ()
     {
+      AE_TIMER ("solve");
       smt.reset();
       smt.assertExpr (s);
 
-      if (!smt.solve ()) {
+      AE_COUNT ("smt.solve.s");
+      boost::tribool sat = check ();
+      if (boost::indeterminate (sat)) {
+        return sat;
+      } else if (!sat) {
         return false;
       } else {
         ZSolver<EZ3>::Model m = smt.getModel();
 
-        for (auto &e: sVars)
-          // keep a model in case the formula is invalid
-          modelInvalid[e] = m.eval(e);
+        // keep a model in case the formula is invalid
+        m.evalAll(sVars, modelInvalid);
       }
 
       if (v.size () == 0)
       {
         smt.assertExpr (boolop::lneg (t));
-        boost::tribool res = smt.solve ();
-        return res;
+        AE_COUNT ("smt.solve.neg_t");
+        return check ();
       }
 
       smt.push ();
@@ -184,34 +237,47 @@ namespace ufo
 
       boost::tribool res = true;
 
-      while (smt.solve ())
+      while (true)
       {
-        outs().flush ();
+        AE_COUNT ("smt.solve.t");
+        sat = check ();
+        if (boost::indeterminate (sat)) return sat;
+        if (!sat) break;
+        AE_COUNT ("iterations");
 
         ZSolver<EZ3>::Model m = smt.getModel();
 
         if (debug && false)
         {
           outs() << "\nmodel " << partitioning_size << ":\n";
+          ExprMap vals;
+          m.evalAll(stVars, vals);
           for (auto &exp: stVars)
           {
-            if (exp != m.eval(exp))
-              outs() << "[" << *exp << "=" << *m.eval(exp) << "],";
+            if (exp != vals[exp])
+              outs() << "[" << *exp << "=" << *vals[exp] << "],";
           }
           outs() <<"\n";
         }
 
-        getMBPandSkolem(m, t, v, ExprMap());
+        if (!getMBPandSkolem(m, t, v, ExprMap()))
+        {
+          reasonUnknown = "canceled";
+          return boost::indeterminate;
+        }
 
         smt.pop();
         smt.assertExpr(boolop::lneg(projections.back()));
-        if (!smt.solve()) {
+        AE_COUNT ("smt.solve.block");
+        sat = check ();
+        if (boost::indeterminate (sat)) {
+          return sat;
+        } else if (!sat) {
           res = false; break;
         } else {
           // keep a model in case the formula is invalid
           m = smt.getModel();
-          for (auto &e: sVars)
-            modelInvalid[e] = m.eval(e);
+          m.evalAll(sVars, modelInvalid);
         }
 
         smt.push();
@@ -221,26 +287,56 @@ namespace ufo
     }
 
     /**
-     * Extract MBP and local Skolem
+     * Extract MBP and local Skolem; false if the run is canceled on the way
      */
-    void getMBPandSkolem(ZSolver<EZ3>::Model &m, Expr pr, ExprSet tmpVars, ExprMap substsMap)
+    bool getMBPandSkolem(ZSolver<EZ3>::Model &m, Expr pr, ExprSet tmpVars, ExprMap substsMap)
     {
+      AE_TIMER ("mbp");
       ExprMap modelMap;
+      ExprVector vars(tmpVars.begin(), tmpVars.end());
+      auto start = std::chrono::steady_clock::now();
+      std::unique_ptr<MBPUtils> mbpu;
+      if (nativeMbp) mbpu.reset(new MBPUtils(efac, m));
       for (auto exp = tmpVars.begin(); exp != tmpVars.end();)
       {
+        if (z3.isCancelled()) return false;
         ExprMap map;
-        pr = z3_qe_model_project_skolem (z3, m, *exp, pr, map);
-        if (skol) getLocalSkolems(m, *exp, map, substsMap, modelMap, pr);
+        Expr prj;
+        if (mbpu) prj = mbpu->project(*exp, pr, map);
+        if (prj == NULL)
+        {
+          // -- non-linear occurrences are left to Z3
+          prj = z3_qe_model_project_skolem (z3, m, *exp, pr, map);
+          mbpFallback++;
+        }
+        else mbpNative++;
+        pr = prj;
+        if (skol) getLocalSkolems(*exp, map, substsMap, pr);
         Expr var = *exp;
         tmpVars.erase(exp++);
       }
+      mbpTime += std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start).count();
+
+      if (skol)
+      {
+        // projections complete the model, so evaluate once they are done;
+        // the native one does not, and reads missing values as defaults
+        ExprVector vals;
+        m.evalAll(vars, vals, nativeMbp);
+        for (unsigned i = 0; i < vars.size(); i++)
+          if (vals[i] != vars[i])
+            modelMap[vars[i]] = mk<EQ>(vars[i], vals[i]);
+      }
 
       if (debug) assert(emptyIntersect(pr, v));
+      AE_VALUE ("mbp.size", dagSize(pr));
 
       someEvals.push_back(modelMap);
       skolMaps.push_back(substsMap);
       projections.push_back(pr);
       partitioning_size++;
+      return true;
     }
 
     void fillSubsts (Expr ef, Expr es, Expr mbp, ExprSet& substs)
@@ -262,8 +358,7 @@ namespace ufo
     /**
      * Compute local skolems based on the model
      */
-    void getLocalSkolems(ZSolver<EZ3>::Model &m, Expr exp,
-                           ExprMap &map, ExprMap &substsMap, ExprMap &modelMap, Expr& mbp)
+    void getLocalSkolems(Expr exp, ExprMap &map, ExprMap &substsMap, Expr& mbp)
     {
       if (map.size() > 0){
         ExprSet substs;
@@ -277,9 +372,6 @@ namespace ufo
           substsMap[exp] = conjoin(substs, efac);
         }
       }
-      if (m.eval(exp) != exp){
-        modelMap[exp] = mk<EQ>(exp, m.eval(exp));
-      }
     }
 
     bool sameBoolOrCmp (Expr ef, Expr es)
@@ -303,11 +395,11 @@ namespace ufo
     }
 
     /**
-     * Model of S /\ \neg T (if AE-formula is invalid)
+     * Model of S /\ \neg T (if AE-formula is invalid), as (= x v) for
+     * each var x of S
      */
-    void printModelNeg()
+    void getModelNeg(ExprVector &model)
     {
-      outs () << "(model\n";
       Expr s_witn = s;
       Expr t_witn = t;
       for (auto &var : sVars){
@@ -316,19 +408,23 @@ namespace ufo
           s_witn = replaceAll(s_witn, var, assnmt);
           t_witn = replaceAll(t_witn, var, assnmt);
         }
-
-        outs () << "  (define-fun " << *var << " () " <<
-          (bind::isBoolConst(var) ? "Bool" : (bind::isIntConst(var) ? "Int" : "Real"))
-                << "\n    " << *assnmt << ")\n";
+        model.push_back(mk<EQ>(var, assnmt));
       }
-      outs () << ")\n";
 
       if (debug){
-        outs () << "Sanity check [model, S-part]: " << !(u.isSat(mk<NEG>(s_witn))) << "\n";
-        outs () << "Sanity check [model, T-part]: " << !(u.isSat(t_witn)) << "\n";
+        outs() << "Sanity check [model, S-part]: " << !(u.isSat(mk<NEG>(s_witn))) << "\n";
+        outs() << "Sanity check [model, T-part]: " << !(u.isSat(t_witn)) << "\n";
       }
     }
 
+    /**
+     * Projections of T, one per partition of S
+     */
+    const ExprVector &getPartitions()
+    {
+      return projections;
+    }
+
     /**
      * Mine the structure of T to get what was assigned to a variable
      */
@@ -597,6 +693,12 @@ namespace ufo
 
         if (!bind::isBoolConst(var) && var != exp->left())
           exp = ineqReverter(ineqMover(exp, var));
+        if (var != exp->left())
+        {
+          // -- e.g., var has a coefficient
+          Expr iso = isolateVar(var, exp);
+          if (iso != NULL) exp = iso;
+        }
         // TODO: write a similar simplifier fo booleans
 
         assert (var == exp->left());
@@ -644,6 +746,11 @@ namespace ufo
         {
           if (isOpX<NEG>(cnj)) cnj = mkNeg(cnj->left());
           cnj = ineqReverter(ineqMover(cnj, var));
+          if (isOp<ComparissonOp>(cnj) && var != cnj->left())
+          {
+            Expr iso = isolateVar(var, cnj);
+            if (iso != NULL) cnj = iso;
+          }
 
           if (isOpX<EQ>(cnj)){
             if (var == cnj->left()) {
@@ -970,9 +1077,20 @@ namespace ufo
         pre.insert(projections[i]);
         post.insert(skol[i]);
       }
-      AeValSolver ae(disjoin(pre, efac), conjoin(post, efac), quant, false, false);
-
-      if (!ae.solve())
+      // -- the span also covers the searches it leads to
+      AE_TRACE (span, "compact.solver");
+      AE_TRACE_ARG (span, "partitions", indexes.size());
+      AeValSolver ae(disjoin(pre, efac), conjoin(post, efac), quant, false, false, &z3);
+      ae.setLimits(smt.getTimeout(), smt.getRlimit());
+      ae.setNativeMbp(nativeMbp);
+
+      boost::tribool res = ae.solve();
+      AE_TRACE_ARG (span, "result", boost::indeterminate(res) ? "unknown" :
+                                    res ? "invalid" : "valid");
+      // -- give up on this subset
+      if (boost::indeterminate(res)) return;
+
+      if (!res)
       {
         if (bestIndexes.size() < indexes.size()) bestIndexes = indexes;
         return;
@@ -1040,9 +1158,20 @@ namespace ufo
         pre.insert(projections[i]);
         post.insert(skol[i]);
       }
-      AeValSolver ae(disjoin(pre, efac), conjoin(post, efac), quant, false, false);
-
-      if (!ae.solve())
+      // -- the span also covers the searches it leads to
+      AE_TRACE (span, "compact.solver");
+      AE_TRACE_ARG (span, "partitions", indexes.size());
+      AeValSolver ae(disjoin(pre, efac), conjoin(post, efac), quant, false, false, &z3);
+      ae.setLimits(smt.getTimeout(), smt.getRlimit());
+      ae.setNativeMbp(nativeMbp);
+
+      boost::tribool res = ae.solve();
+      AE_TRACE_ARG (span, "result", boost::indeterminate(res) ? "unknown" :
+                                    res ? "invalid" : "valid");
+      // -- give up on this subset
+      if (boost::indeterminate(res)) return;
+
+      if (!res)
       {
         if (bestIndexes.size() < indexes.size()) bestIndexes = indexes;
         for (int i = 0; i < partitioning_size; i++)
@@ -1064,7 +1193,7 @@ namespace ufo
       for (auto & a : cyclicSubsts)
       {
         ExprSet vars;
-        filter (a.second, bind::IsConst (), inserter (vars, vars.begin()));
+        filterConsts (a.second, inserter (vars, vars.begin()));
         for (auto & b : vars)
         {
           if (find(v.begin(), v.end(), b) != v.end())
@@ -1113,6 +1242,7 @@ namespace ufo
 
     Expr getSkolemFunction (bool compact = false)
     {
+      AE_TIMER ("skolem");
       ExprSet skolUncond;
       ExprSet eligibleVars;
 
@@ -1200,8 +1330,11 @@ namespace ufo
         if (find(eligibleVars.begin(), eligibleVars.end(), var) != eligibleVars.end()
             && compact)
         {
+          AE_TIMER ("skolem.compact");
           set<int> indexes;
           for (int i = 0; i < partitioning_size; i++) indexes.insert(i);
+          // -- the probes only keep indexes, so their formulas go at once
+          ExprRegion probes (efac);
           searchDownwards (indexes, var, skolemConstraints[var]);
           searchUpwards (bestIndexes, var, skolemConstraints[var]);
         }
@@ -1281,182 +1414,53 @@ namespace ufo
       return partitioning_size;
     }
 
-    // Runnable only after getSkolemFunction
-    Expr getSkolemConstraints(int i)
-    {
-      ExprSet constrs;
-      for (auto & a : skolemConstraints)
-        constrs.insert(a.second[i]);
-      return conjoin(constrs, efac);
-    }
-
     /**
-     * Actually, just print it to cmd in the smt-lib2 format
+     * Per-query timeout (ms) and resource limit, also used by the
+     * internal SMT checks; 0 means no limit
      */
-    void serialize_formula(Expr form)
-    {
-      smt.reset();
-      smt.assertExpr(form);
-      smt.toSmtLib (outs());
-      outs().flush ();
-    }
-  };
-
-  /**
-   * Simple wrapper
-   */
-  inline void aeSolveAndSkolemize(Expr s, Expr t, bool skol, bool debug, bool compact)
-  {
-    ExprSet s_vars;
-    ExprSet t_vars;
-
-    filter (s, bind::IsConst (), inserter (s_vars, s_vars.begin()));
-    filter (t, bind::IsConst (), inserter (t_vars, t_vars.begin()));
-
-    ExprSet t_quantified = minusSets(t_vars, s_vars); // // existentially quantified vars
-
-
-    
-
-    s = convertIntsToReals<DIV>(s);
-    t = convertIntsToReals<DIV>(t);
-    /** An AE-VAL wrapper for cmd
- *
- * Usage: specify 2 smt2-files that describe the formula \foral x. S(x) => \exists y . T (x, y)
- *   <s_part.smt2> = S-part (over x)
- *   <t_part.smt2> = T-part (over x, y)
- *   --skol = to print skolem function
- *   --debug = to print more info and perform sanity checks
- *
- * Notably, the tool automatically recognizes x and y based on their appearances in S or T.
- *
- */
-    if (debug)
-    {
-      outs() << "S: " << *s << "\n";
-      outs() << "T: \\exists ";
-      for (auto &a: t_quantified) outs() << *a << ", ";
-      outs() << *t << "\n";
-    }
-
-    AeValSolver ae(s, t, t_quantified, debug, skol);
-
-    if (ae.solve()){
-      outs () << "Iter: " << ae.getPartitioningSize() << "; Result: invalid\n";
-      ae.printModelNeg();
-      outs() << "\nvalid subset:\n";
-      ae.serialize_formula(ae.getValidSubset());
-    } else {
-      outs () << "Iter: " << ae.getPartitioningSize() << "; Result: valid\n";
-      if (skol)
-      {
-        outs() << "\nextracted skolem:\n";
-        Expr skol = ae.getSkolemFunction(compact);
-        ae.serialize_formula(skol);
-      }
-    }
-  }
-
-
-  /**
-   * Simple wrapper
-   */
-  inline void aeSolveAndSkolemize(Expr t, ExprSet &var_exist_quantified,  bool skol, bool debug, bool compact)
-  {
-  
-    t = convertIntsToReals<DIV>(t);
-
-    if (debug)
+    void setLimits(unsigned timeout, unsigned rlimit = 0)
     {
-      outs() << "T: \\exists ";
-      for (auto &a: var_exist_quantified) outs() << *a << ", ";
-      outs() << *t << "\n";
+      smt.setLimits(timeout, rlimit);
+      u.setLimits(timeout, rlimit);
     }
 
-    AeValSolver ae(t, var_exist_quantified, debug, skol);
-    if (debug)
+    // Runnable only after solve() returned unknown
+    std::string getReasonUnknown()
     {
-      outs() << "AeValSolver initialized"<< "\n";
+      return reasonUnknown;
     }
-    if (ae.solve()){
-      outs () << "Iter: " << ae.getPartitioningSize() << "; Result: invalid\n";
-      ae.printModelNeg();
-      outs() << "\nvalid subset:\n";
-      ae.serialize_formula(ae.getValidSubset());
-    } else {
-      outs () << "Iter: " << ae.getPartitioningSize() << "; Result: valid\n";
-      if (skol)
-      {
-        outs() << "\nextracted skolem:\n";
-        Expr skol = ae.getSkolemFunction(compact);
-        ae.serialize_formula(skol);
-      }
-    }
-  }
-
-  inline void getAllInclusiveSkolem(Expr s, Expr t, bool debug, bool compact)
-  {
-    ExprSet s_vars;
-    ExprSet t_vars;
-
-    filter (s, bind::IsConst (), inserter (s_vars, s_vars.begin()));
-    filter (t, bind::IsConst (), inserter (t_vars, t_vars.begin()));
 
-    ExprSet t_quantified = minusSets(t_vars, s_vars);
-
-    s = convertIntsToReals<DIV>(s);
-    t = convertIntsToReals<DIV>(t);
-
-    SMTUtils u(s->getFactory());
-
-    if (debug)
+    /**
+     * Adds the statistics of the run to st
+     */
+    void getStats(AeValStats &st)
     {
-      outs() << "S: " << *s << "\n";
-      outs() << "T: \\exists ";
-      for (auto &a: t_quantified) outs() << *a << ", ";
-      outs() << *t << "\n";
+      st.iterations += partitioning_size;
+      st.mbpNative += mbpNative;
+      st.mbpFallback += mbpFallback;
+      st.mbpTime += mbpTime;
+      u.getImpliesStats(st.implies, st.impliesSimplex,
+                        st.impliesSimplexTime, st.impliesZ3Time);
+      st.cache = z3.getCacheStats();
     }
 
-    Expr t_init = t;
-    ExprVector skolems;
-    while (true)
+    /**
+     * Use the native projection of MBPUtils for linear arithmetic and
+     * Booleans; the rest is still projected by Z3
+     */
+    void setNativeMbp(bool b)
     {
-      AeValSolver ae(s, t, t_quantified, debug, true);
-
-      if (ae.solve()){
-        if (skolems.size() == 0)
-        {
-          outs () << "Result: invalid\n";
-          ae.printModelNeg();
-          outs() << "\nvalid subset:\n";
-          u.serialize_formula(ae.getValidSubset());
-          return;
-        }
-        break;
-      } else {
-        skolems.push_back(ae.getSkolemFunction(compact));
-        t = mk<AND>(t, mk<NEG>(ae.getSkolemConstraints(0)));
-      }
+      nativeMbp = b;
     }
 
-    Expr skol = skolems.back();
-    if (skolems.size() > 1)
-    {
-      Expr varName = mkTerm <std::string> ("_aeval_tmp_rnd", s->getFactory());
-      Expr var = bind::intConst(varName);
-      for (int i = skolems.size() - 2; i >= 0; i--)
-      {
-        skol = mk<ITE>(mk<EQ>(var, mkTerm (mpz_class (i), s->getFactory())),
-                       skolems[i], skol);
-      }
-    }
-    if (debug)
+    // Runnable only after getSkolemFunction
+    Expr getSkolemConstraints(int i)
     {
-      outs () << "Sanity check [all-inclusive]: " <<
-        u.implies(mk<AND>(s, skol), t_init) << "\n";
+      ExprSet constrs;
+      for (auto & a : skolemConstraints)
+        constrs.insert(a.second[i]);
+      return conjoin(constrs, efac);
     }
-    outs () << "Result: valid\n\nextracted skolem:\n";
-    u.serialize_formula(skol);
   };
 }
 
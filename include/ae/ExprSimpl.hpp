@@ -3,6 +3,7 @@
 #include <assert.h>
 
 #include "ufo/Smt/EZ3.hh"
+#include "ae/LinForm.hpp"
 
 using namespace std;
 using namespace boost;
@@ -46,19 +47,32 @@ namespace ufo
 
   template<typename Range> static bool emptyIntersect(Expr a, Range& bv){
     ExprVector av;
-    filter (a, bind::IsConst (), inserter(av, av.begin()));
+    filterConsts (a, inserter(av, av.begin()));
     return emptyIntersect(av, bv);
   }
 
   inline static bool emptyIntersect(Expr a, Expr b){
-    ExprVector bv;
-    filter (b, bind::IsConst (), inserter(bv, bv.begin()));
-    return emptyIntersect(a, bv);
+    const ENodeMeta *am = getMeta (a.get ());
+    const ENodeMeta *bm = getMeta (b.get ());
+    if (am == NULL || bm == NULL) {
+      ExprVector bv;
+      filterConsts (b, inserter(bv, bv.begin()));
+      return emptyIntersect(a, bv);
+    }
+
+    // -- both are ordered by id
+    auto i = am->consts->begin (), ie = am->consts->end ();
+    auto j = bm->consts->begin (), je = bm->consts->end ();
+    while (i != ie && j != je) {
+      if (*i == *j) return false;
+      if ((*i)->getId () < (*j)->getId ()) ++i; else ++j;
+    }
+    return true;
   }
 
   template<typename Range> static int intersectSize(Expr a, Range& bv){
     ExprVector av;
-    filter (a, bind::IsConst (), inserter(av, av.begin()));
+    filterConsts (a, inserter(av, av.begin()));
     ExprSet intersect;
     for (auto &var1: av){
       for (auto &var2: bv)
@@ -192,6 +206,38 @@ namespace ufo
     return mk<LEQ>(lhs, rhs);
   }
 
+  // not very pretty method, but..
+  inline static Expr reBuildCmp(Expr term, Expr lhs, Expr rhs)
+  {
+    if (isOpX<EQ>(term)){
+      return mk<EQ>(lhs, rhs);
+    }
+    if (isOpX<NEQ>(term)){
+      return mk<NEQ>(lhs, rhs);
+    }
+    if (isOpX<LEQ>(term)){
+      return mk<LEQ>(lhs, rhs);
+    }
+    if (isOpX<GEQ>(term)){
+      return mk<GEQ>(lhs, rhs);
+    }
+    if (isOpX<LT>(term)){
+      return mk<LT>(lhs, rhs);
+    }
+    assert(isOpX<GT>(term));
+    return mk<GT>(lhs, rhs);
+  }
+
+  /** (lhs op' rhs), where op' is op of term with the sides swapped */
+  inline static Expr reBuildFlippedCmp(Expr term, Expr lhs, Expr rhs)
+  {
+    if (isOpX<LEQ>(term)) return mk<GEQ>(lhs, rhs);
+    if (isOpX<GEQ>(term)) return mk<LEQ>(lhs, rhs);
+    if (isOpX<LT>(term)) return mk<GT>(lhs, rhs);
+    if (isOpX<GT>(term)) return mk<LT>(lhs, rhs);
+    return reBuildCmp(term, lhs, rhs);
+  }
+
   inline static Expr mkNeg(Expr term)
   {
     if (isOpX<NEG>(term))
@@ -366,30 +412,35 @@ namespace ufo
     return e;
   }
   
+  /** l - r for a comparison (l op r) */
+  inline static LinForm cmpDiff(Expr e)
+  {
+    return LinForm (e->left(), e->right());
+  }
+
   /**
    *  Merge adjacent inequalities
-   *  (a <= b && a >= b) -> (a == b)
+   *  (a <= b && c >= d) -> (a == b),  if a - b == c - d
    */
   inline static void ineqMerger(ExprSet& expClauses, bool clean = false){
-    for (auto &e: expClauses){
-      if (isOpX<LEQ>(e)){
-        for (auto &e2: expClauses){
-          if (isOpX<GEQ>(e2)){
-            if (e->left() == e2->left()){
-              Expr e1r = exprSorted(e->right());
-              Expr e2r = exprSorted(e2->right());
-              if ( e1r == e2r ){
-                if (clean){
-                  expClauses.erase(e);
-                  expClauses.erase(e2);
-                }
-                expClauses.insert(mk<EQ>(e->left(), e1r));
-              }
-            }
-          }
-        }
-      }
+    std::map<LinForm, Expr> leqs;
+    for (auto &e: expClauses)
+      if (isOpX<LEQ>(e)) leqs.insert (std::make_pair (cmpDiff(e), e));
+    if (leqs.empty ()) return;
+
+    ExprSet eqs;
+    ExprSet merged;
+    for (auto &e2: expClauses){
+      if (!isOpX<GEQ>(e2)) continue;
+      auto it = leqs.find (cmpDiff(e2));
+      if (it == leqs.end ()) continue;
+      Expr e = it->second;
+      eqs.insert(mk<EQ>(e->left(), e->right()));
+      merged.insert(e);
+      merged.insert(e2);
     }
+    if (clean) for (auto &e: merged) expClauses.erase(e);
+    expClauses.insert(eqs.begin(), eqs.end());
   }
   
   /**
@@ -485,15 +536,32 @@ namespace ufo
   }
   
   /**
-   *  Transform the inequalities by the following rules:
+   *  Transform the (in)equalities that are linear in var to the form
+   *  (c*var op t) with c > 0, where t does not contain var, and c*var
+   *  is just var if c = 1:
+   *  (a + .. + c*var + .. + b <= d) -> (c*var <= d - a - .. - b)
+   *  (a + .. + -c*var + .. + b <= d) -> (c*var >= a + .. + b - d)
+   *
+   *  Otherwise, moves the summand with var to the left as it is:
    *  (a + .. + var + .. + b <= c ) -> (var <= -1*a + .. + -1*b + c)
-   *  (a + .. + -1*var + .. + b <= c) -> (-1*var <= -1*a + .. + -1*b + c )
    *  (a <= b + .. + var + .. + c) -> (-1*var <= (-1)*a + b + .. + c)
-   *  (a <= b + .. + (-1)*var + .. + c) -> (var <= (-1)*a + b + .. + c)
-   *
-   *  same for >=
    */
   inline static Expr ineqMover(Expr e, Expr var){
+      if (isOp<ComparissonOp>(e) && e->arity() == 2){
+        LinForm f = cmpDiff(e);
+        mpq_class c = f.coef(var);
+        bool isInt = bind::isIntConst(var) || (!bind::isRealConst(var) &&
+          !isRealTerm(e->left()) && !isRealTerm(e->right()));
+        if (c != 0 && f.isLinearIn(var) && (!isInt || f.isIntegral())){
+          // -- c*var + rest op 0  <=>  c*var op -rest
+          f.erase(var);
+          if (c > 0) f.scale(-1);
+          ExprFactory &efac = e->getFactory();
+          Expr lhs = (c == 1 || c == -1) ? var : mk<MULT>(mkNum(abs(c), isInt, efac), var);
+          Expr rhs = f.toExpr(efac, isInt);
+          return c > 0 ? reBuildCmp(e, lhs, rhs) : reBuildFlippedCmp(e, lhs, rhs);
+        }
+      }
       if (isOpX<LEQ>(e)){
         return rewriteHelperM<LEQ>(e, var);
       } else if (isOpX<GEQ>(e)){
@@ -703,14 +771,17 @@ namespace ufo
     {
       zero = mkTerm (mpz_class (0), efac);
       one = mkTerm (mpz_class (1), efac);
-      minus_one = mkTerm (mpz_class (1), efac);
+      minus_one = mkTerm (mpz_class (-1), efac);
     };
     
     Expr operator() (Expr exp)
     {
       if (isOpX<PLUS>(exp))
       {
-        return simplifiedPlus(exp, zero);
+        // -- simplifiedPlus subtracts zero, which adds it if it is not there
+        if (std::find(exp->args_begin(), exp->args_end(), &*zero) != exp->args_end())
+          return simplifiedPlus(exp, zero);
+        return exp;
       }
       
       if (isOpX<MINUS>(exp) && exp->arity() == 2)
@@ -718,7 +789,7 @@ namespace ufo
         return simplifiedMinus(exp->left(), exp->right());
       }
       
-      if (isOpX<MULT>(exp))
+      if (isOpX<MULT>(exp) && exp->arity() == 2)
       {
         if (exp->left() == zero) return zero;
         if (exp->right() == zero) return zero;
@@ -807,11 +878,42 @@ namespace ufo
     return dagVisit (rw, exp);
   }
 
-  template <typename T> static Expr convertIntsToReals (Expr exp);
+  inline static Expr intToReal (Expr e)
+  {
+    return isOpX<MPZ>(e) ?
+      mkTerm (mpq_class (getTerm<mpz_class> (e)), e->getFactory()) : e;
+  }
+
+  /**
+   * Converts the integer numerals that are arguments of PLUS, MINUS,
+   * MULT and UN_MINUS
+   */
+  struct ArithIntToReal
+  {
+    Expr operator() (Expr exp)
+    {
+      if (!isOpX<PLUS>(exp) && !isOpX<MINUS>(exp) &&
+          !isOpX<MULT>(exp) && !isOpX<UN_MINUS>(exp)) return exp;
 
-  template <typename T> struct IntToReal
+      ExprVector args;
+      for (auto it = exp->args_begin(), end = exp->args_end(); it != end; ++it)
+        args.push_back(intToReal(*it));
+      return exp->getFactory().mkNary(exp->op(), args);
+    }
+  };
+
+  /**
+   * Converts the integer numerals that are arguments of T, or of
+   * arithmetic operators below T. The arguments of all T-nodes are
+   * converted in one traversal with a common memo table, so that
+   * nested arithmetic is visited once.
+   */
+  template <typename T> struct IntToReal : boost::noncopyable
   {
-    IntToReal<T> () {};
+    RW<ArithIntToReal> rw;
+    DagVisit<RW<ArithIntToReal> > arith;
+
+    IntToReal<T> () : rw (new ArithIntToReal ()), arith (rw) {};
 
     Expr operator() (Expr exp)
     {
@@ -821,15 +923,7 @@ namespace ufo
         for (int i = 0; i < exp->arity(); i++)
         {
           Expr e = exp->arg(i);
-          if (isOpX<MPZ>(e))
-            e = mkTerm (mpq_class (lexical_cast<int>(e)), exp->getFactory());
-          else {
-            e = convertIntsToReals<PLUS>(e);
-            e = convertIntsToReals<MINUS>(e);
-            e = convertIntsToReals<MULT>(e);
-            e = convertIntsToReals<UN_MINUS>(e);
-          }
-          args.push_back(e);
+          args.push_back(isOpX<MPZ>(e) ? intToReal(e) : arith(e));
         }
         return mknary<T>(args);
       }
@@ -862,7 +956,7 @@ namespace ufo
   inline bool containsOnlyOf(Expr a, Expr b)
   {
     ExprVector av;
-    filter (a, bind::IsConst (), back_inserter (av));
+    filterConsts (a, back_inserter (av));
     if (av.size() == 1) if (av[0] == b) return true;
     
     return false;
@@ -886,46 +980,153 @@ namespace ufo
     return c.size();
   }
 
-  // not very pretty method, but..
-  inline static Expr reBuildCmp(Expr term, Expr lhs, Expr rhs)
-  {
-    if (isOpX<EQ>(term)){
-      return mk<EQ>(lhs, rhs);
-    }
-    if (isOpX<NEQ>(term)){
-      return mk<NEQ>(lhs, rhs);
-    }
-    if (isOpX<LEQ>(term)){
-      return mk<LEQ>(lhs, rhs);
-    }
-    if (isOpX<GEQ>(term)){
-      return mk<GEQ>(lhs, rhs);
-    }
-    if (isOpX<LT>(term)){
-      return mk<LT>(lhs, rhs);
-    }
-    assert(isOpX<GT>(term));
-    return mk<GT>(lhs, rhs);
-  }
-
+  /**
+   * Numeric comparisons to the form (t op 0), where t is a canonical
+   * linear form (see LinForm). Comparisons of numerals are folded.
+   */
   inline static Expr simplIneqMover(Expr exp)
   {
     exp = ineqNegReverter(exp);
-    if (lexical_cast<string>(exp->right()) == "0") return exp;
+    if (!isOp<ComparissonOp>(exp) || exp->arity() != 2) return exp;
+
+    ExprFactory &efac = exp->getFactory();
+    LinForm f = cmpDiff(exp);
+    if (f.isConst())
+    {
+      const mpq_class &c = f.constant();
+      bool r = isOpX<EQ>(exp) ? c == 0 : isOpX<NEQ>(exp) ? c != 0 :
+               isOpX<LEQ>(exp) ? c <= 0 : isOpX<GEQ>(exp) ? c >= 0 :
+               isOpX<LT>(exp) ? c < 0 : c > 0;
+      return r ? mk<TRUE>(efac) : mk<FALSE>(efac);
+    }
 
-    // GF: find a better way how to move things
-    exp = reBuildCmp(exp, simplifiedMinus(exp->left(), exp->right()),
-                     mkTerm (mpz_class (0), exp->getFactory()));
-    return exp;
+    bool isInt = !isRealTerm(exp->left()) && !isRealTerm(exp->right());
+    if (isInt && !f.isIntegral()) return exp;
+    return reBuildCmp(exp, f.toExpr(efac, isInt), mkNum(0, isInt, efac));
   }
 
-  bool isNumeric(Expr a)
+  inline static bool isNumeric(Expr a)
   {
     // don't consider ITE-s
     return (isOp<NumericOp>(a) || isOpX<MPZ>(a) || isOpX<MPQ>(a) ||
              bind::isIntConst(a) || bind::isRealConst(a));
   }
 
+  /** rule sets of Simplifier */
+  enum SimplRules
+  {
+    SIMPL_ARITH = 1,          // SimplifyArithmExpr
+    SIMPL_BOOL = 2,           // SimplifyBoolExpr
+    SIMPL_INT_TO_REAL = 4,    // IntToReal<DIV>, as convertIntsToReals<DIV>
+    SIMPL_INEQ = 8,           // simplIneqMover
+    SIMPL_ALL = 15
+  };
+
+  /** counters of a Simplifier */
+  struct SimplStats
+  {
+    /** distinct nodes simplified */
+    size_t visited;
+    /** rule applications that changed a node */
+    size_t rewrites;
+    /** nodes at which the fixpoint was cut off */
+    size_t capped;
+
+    SimplStats () : visited (0), rewrites (0), capped (0) {}
+  };
+
+  /**
+   * Applies a set of rules (see SimplRules) in a single bottom-up
+   * pass, instead of one dagVisit per rule set. When a rule changes a
+   * node, the result is simplified again (its arguments through the
+   * same memo table), so that every node is at a fixpoint of all rules.
+   * The memo table lives as long as the simplifier, so that it is
+   * shared by all expressions it is applied to. Until then, other DAG
+   * traversals of the thread fall back to hashing (see DagVisitCache),
+   * so it should not be kept around.
+   */
+  class Simplifier : boost::noncopyable
+  {
+    // -- rewrites of a node in a row before its result is taken as is
+    static const unsigned maxDepth = 16;
+
+    unsigned rules;
+    SimplifyArithmExpr arith;
+    SimplifyBoolExpr boolean;
+    IntToReal<DIV> toReal;
+    DagVisitCache cache;
+    SimplStats stats;
+
+    static bool isNumCmp (Expr e)
+    {
+      return isOp<ComparissonOp>(e) && e->arity() == 2 &&
+        isNumeric(e->left()) && isNumeric(e->right());
+    }
+
+    /** the result of the first rule that changes exp */
+    Expr apply (Expr exp)
+    {
+      Expr r = exp;
+      if ((rules & SIMPL_INT_TO_REAL) && (r = toReal (exp)) != exp) return r;
+      if ((rules & SIMPL_ARITH) && (r = arith (exp)) != exp) return r;
+      if ((rules & SIMPL_BOOL) && (r = boolean (exp)) != exp) return r;
+      if ((rules & SIMPL_INEQ) &&
+          (isNumCmp (exp) || (isOpX<NEG>(exp) && isNumCmp (exp->left()))))
+        return simplIneqMover(exp);
+      return exp;
+    }
+
+    Expr run (Expr exp, unsigned depth)
+    {
+      const Expr *cached = cache.find (&*exp);
+      if (cached != NULL) return *cached;
+      stats.visited++;
+
+      Expr res = exp;
+      if (exp->arity() > 0 && !exp->isMutable())
+      {
+        bool changed = false;
+        VisitKids kids;
+        for (auto it = exp->args_begin(), end = exp->args_end(); it != end; ++it)
+        {
+          Expr k = run (*it, 0);
+          changed = changed || k.get() != *it;
+          kids.push_back (k);
+        }
+        if (changed)
+          res = exp->getFactory().mkNary(exp->op(), kids.begin(), kids.end());
+      }
+
+      Expr r = apply (res);
+      if (r != res)
+      {
+        stats.rewrites++;
+        // -- a cycle of rules would not terminate otherwise
+        if (depth < maxDepth) r = run (r, depth + 1);
+        else stats.capped++;
+        res = r;
+      }
+
+      cache.insert (&*exp, res);
+      return res;
+    }
+
+  public:
+    Simplifier (ExprFactory &efac, unsigned r = SIMPL_ALL) :
+      rules (r), arith (efac), boolean (efac) {}
+
+    Expr operator() (Expr exp) { return run (exp, 0); }
+
+    const SimplStats &getStats () const { return stats; }
+  };
+
+  /** exp simplified by the given rules, see Simplifier */
+  inline static Expr simplify (Expr exp, unsigned rules = SIMPL_ALL)
+  {
+    Simplifier s (exp->getFactory(), rules);
+    return s (exp);
+  }
+
   struct EqNumMiner : public std::unary_function<Expr, VisitAction>
   {
     ExprSet& eqs;
@@ -0,0 +1,319 @@
+#ifndef LRASIMPLEX__HPP__
+#define LRASIMPLEX__HPP__
+#include <assert.h>
+
+#include "ae/ExprSimpl.hpp"
+
+using namespace std;
+using namespace boost;
+namespace ufo
+{
+  /**
+   * Rational number with a symbolic infinitesimal: c + k*delta.
+   * Strict bounds x < c are handled as x <= c - delta.
+   */
+  struct DeltaRat
+  {
+    mpq_class c;
+    mpq_class k;
+
+    DeltaRat () {}
+    DeltaRat (const mpq_class &_c, const mpq_class &_k = 0) : c(_c), k(_k) {}
+
+    bool operator< (const DeltaRat &o) const { return c < o.c || (c == o.c && k < o.k); }
+    bool operator> (const DeltaRat &o) const { return o < *this; }
+    bool operator<= (const DeltaRat &o) const { return !(o < *this); }
+    bool operator>= (const DeltaRat &o) const { return !(*this < o); }
+    DeltaRat operator+ (const DeltaRat &o) const { return DeltaRat (c + o.c, k + o.k); }
+    DeltaRat operator- (const DeltaRat &o) const { return DeltaRat (c - o.c, k - o.k); }
+    DeltaRat operator* (const mpq_class &a) const { return DeltaRat (c * a, k * a); }
+  };
+
+  /**
+   * Incremental simplex over the rationals for conjunctions of linear
+   * (in)equalities over Real constants, following Dutertre and de Moura,
+   * "A Fast Linear-Arithmetic Solver for DPLL(T)". Bounds are asserted on
+   * top of the tableau and retracted with push/pop; the tableau and the
+   * assignment are kept.
+   */
+  class LRASimplex
+  {
+  private:
+
+    typedef std::map<int, mpq_class> Row;
+
+    struct Bound
+    {
+      bool has;
+      DeltaRat val;
+      Bound () : has(false) {}
+    };
+
+    std::map<Expr, int> varIds;
+    std::map<Row, int> slackIds;          // normalized linear forms
+
+    vector<DeltaRat> val;
+    vector<Bound> lower;
+    vector<Bound> upper;
+    vector<int> rowOf;                    // -1 for nonbasic vars
+    vector<int> basicOf;
+    vector<Row> rows;                     // basicOf[r] = sum rows[r]
+
+    struct TrailEntry { int var; bool isUpper; Bound old; };
+    vector<TrailEntry> trail;
+    vector<pair<size_t, bool> > scopes;
+    bool conflict;
+
+    int newVar ()
+    {
+      val.push_back (DeltaRat (0));
+      lower.push_back (Bound ());
+      upper.push_back (Bound ());
+      rowOf.push_back (-1);
+      return val.size () - 1;
+    }
+
+    /** val[x] := v for a nonbasic x */
+    void update (int x, const DeltaRat &v)
+    {
+      DeltaRat d = v - val[x];
+      for (unsigned r = 0; r < rows.size (); r++)
+      {
+        auto it = rows[r].find (x);
+        if (it != rows[r].end ()) val[basicOf[r]] = val[basicOf[r]] + d * it->second;
+      }
+      val[x] = v;
+    }
+
+    /** swaps basic b and nonbasic x */
+    void pivot (int b, int x)
+    {
+      int r = rowOf[b];
+      Row row = rows[r];
+      mpq_class a = row[x];
+      row.erase (x);
+
+      // -- x = (b - sum a_k x_k) / a
+      Row nr;
+      nr[b] = 1 / a;
+      for (auto &t : row) nr[t.first] = -t.second / a;
+
+      for (unsigned i = 0; i < rows.size (); i++)
+      {
+        if ((int)i == r) continue;
+        auto it = rows[i].find (x);
+        if (it == rows[i].end ()) continue;
+        mpq_class c = it->second;
+        rows[i].erase (it);
+        for (auto &t : nr)
+        {
+          mpq_class &e = rows[i][t.first];
+          e += c * t.second;
+          if (e == 0) rows[i].erase (t.first);
+        }
+      }
+
+      rows[r] = nr;
+      basicOf[r] = x;
+      rowOf[x] = r;
+      rowOf[b] = -1;
+    }
+
+    void pivotAndUpdate (int b, int x, const DeltaRat &v)
+    {
+      mpq_class a = rows[rowOf[b]][x];
+      DeltaRat theta = (v - val[b]) * (1 / a);
+      val[b] = v;
+      val[x] = val[x] + theta;
+      for (unsigned r = 0; r < rows.size (); r++)
+      {
+        if (basicOf[r] == b) continue;
+        auto it = rows[r].find (x);
+        if (it != rows[r].end ())
+          val[basicOf[r]] = val[basicOf[r]] + theta * it->second;
+      }
+      pivot (b, x);
+    }
+
+    void setBound (int x, bool isUpper, const DeltaRat &v)
+    {
+      Bound &bnd = isUpper ? upper[x] : lower[x];
+      trail.push_back (TrailEntry {x, isUpper, bnd});
+      bnd.has = true;
+      bnd.val = v;
+    }
+
+    void assertUpper (int x, const DeltaRat &v)
+    {
+      if (upper[x].has && upper[x].val <= v) return;
+      if (lower[x].has && v < lower[x].val) { conflict = true; return; }
+      setBound (x, true, v);
+      if (rowOf[x] < 0 && val[x] > v) update (x, v);
+    }
+
+    void assertLower (int x, const DeltaRat &v)
+    {
+      if (lower[x].has && lower[x].val >= v) return;
+      if (upper[x].has && v > upper[x].val) { conflict = true; return; }
+      setBound (x, false, v);
+      if (rowOf[x] < 0 && val[x] < v) update (x, v);
+    }
+
+    /**
+     * lhs - rhs of lit as a linear form. Fails on anything that is not
+     * linear over Real constants.
+     */
+    static bool getLinear (Expr lit, LinForm &f)
+    {
+      f = LinForm (lit->left (), lit->right ());
+      for (auto &m : f.terms ())
+        if (!bind::isRealConst (m.first)) return false;
+      return true;
+    }
+
+  public:
+
+    LRASimplex () : conflict(false) {}
+
+    /**
+     * Checks that lit is a comparison of linear terms over Real
+     * constants (after pushing negations into it)
+     */
+    static bool isLinearLiteral (Expr lit)
+    {
+      if (isOpX<NEG>(lit)) lit = mkNeg (lit->left ());
+      if (!isOp<ComparissonOp>(lit) || lit->arity () != 2) return false;
+      LinForm f;
+      return getLinear (lit, f);
+    }
+
+    /**
+     * Asserts a literal accepted by isLinearLiteral, except for NEQ
+     * (which is a disjunction). Returns false if it is not supported.
+     */
+    bool assertLiteral (Expr lit)
+    {
+      if (isOpX<NEG>(lit)) lit = mkNeg (lit->left ());
+      if (!isOp<ComparissonOp>(lit) || isOpX<NEQ>(lit)) return false;
+
+      LinForm f;
+      if (!getLinear (lit, f)) return false;
+      const mpq_class &cst = f.constant ();
+
+      // -- sum coefs + cst op 0
+      Row row;
+      for (auto &c : f.terms ())
+      {
+        auto it = varIds.find (c.first);
+        int id = it != varIds.end () ? it->second : (varIds[c.first] = newVar ());
+        row[id] = c.second;
+      }
+
+      bool le = isOpX<LEQ>(lit) || isOpX<LT>(lit) || isOpX<EQ>(lit);
+      bool ge = isOpX<GEQ>(lit) || isOpX<GT>(lit) || isOpX<EQ>(lit);
+      mpq_class strict = (isOpX<LT>(lit) || isOpX<GT>(lit)) ? 1 : 0;
+
+      if (row.empty ())
+      {
+        if ((le && (cst > 0 || (cst == 0 && strict != 0))) ||
+            (ge && (cst < 0 || (cst == 0 && strict != 0))))
+          conflict = true;
+        return true;
+      }
+
+      // -- normalize so that the leading coefficient is 1: x op bnd
+      mpq_class a = row.begin ()->second;
+      for (auto &t : row) t.second /= a;
+      mpq_class bnd = -cst / a;
+      if (a < 0) std::swap (le, ge);
+
+      int x;
+      if (row.size () == 1) x = row.begin ()->first;
+      else
+      {
+        auto it = slackIds.find (row);
+        if (it != slackIds.end ()) x = it->second;
+        else
+        {
+          x = newVar ();
+          slackIds[row] = x;
+
+          // -- express the row over the current nonbasic vars
+          Row r;
+          DeltaRat v (0);
+          for (auto &t : row)
+          {
+            v = v + val[t.first] * t.second;
+            if (rowOf[t.first] < 0) { r[t.first] += t.second; continue; }
+            for (auto &s : rows[rowOf[t.first]]) r[s.first] += t.second * s.second;
+          }
+          for (auto it = r.begin (); it != r.end ();)
+            if (it->second == 0) r.erase (it++); else ++it;
+          rowOf[x] = rows.size ();
+          rows.push_back (r);
+          basicOf.push_back (x);
+          val[x] = v;
+        }
+      }
+
+      if (le) assertUpper (x, DeltaRat (bnd, -strict));
+      if (ge) assertLower (x, DeltaRat (bnd, strict));
+      return true;
+    }
+
+    void push ()
+    {
+      scopes.push_back (make_pair (trail.size (), conflict));
+    }
+
+    void pop ()
+    {
+      assert (!scopes.empty ());
+      size_t sz = scopes.back ().first;
+      conflict = scopes.back ().second;
+      scopes.pop_back ();
+      while (trail.size () > sz)
+      {
+        TrailEntry &t = trail.back ();
+        (t.isUpper ? upper : lower)[t.var] = t.old;
+        trail.pop_back ();
+      }
+    }
+
+    /**
+     * Satisfiability of the asserted bounds, with Bland's rule to
+     * guarantee termination
+     */
+    bool check ()
+    {
+      if (conflict) return false;
+      while (true)
+      {
+        int b = -1;
+        for (unsigned r = 0; r < rows.size (); r++)
+        {
+          int x = basicOf[r];
+          if ((lower[x].has && val[x] < lower[x].val) ||
+              (upper[x].has && val[x] > upper[x].val))
+            if (b < 0 || x < b) b = x;
+        }
+        if (b < 0) return true;
+
+        bool below = lower[b].has && val[b] < lower[b].val;
+        int n = -1;
+        for (auto &t : rows[rowOf[b]])
+        {
+          int x = t.first;
+          bool inc = (t.second > 0) == below;     // x has to grow
+          if (inc ? (!upper[x].has || val[x] < upper[x].val) :
+                    (!lower[x].has || val[x] > lower[x].val))
+            if (n < 0 || x < n) n = x;
+        }
+        if (n < 0) return false;
+        pivotAndUpdate (b, n, below ? lower[b].val : upper[b].val);
+      }
+    }
+  };
+}
+
+#endif
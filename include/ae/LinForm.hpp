@@ -0,0 +1,281 @@
+#ifndef LINFORM__HPP__
+#define LINFORM__HPP__
+#include <assert.h>
+
+#include "ufo/Expr.hpp"
+
+using namespace std;
+using namespace boost;
+namespace ufo
+{
+  inline static Expr mkNum (const mpq_class &c, bool isInt, ExprFactory &efac)
+  {
+    if (isInt)
+    {
+      assert (c.get_den () == 1);
+      return mkTerm (mpz_class (c.get_num ()), efac);
+    }
+    return mkTerm (c, efac);
+  }
+
+  /**
+   * Canonical linear form  cst + c_1*t_1 + ... + c_n*t_n  of a numeric
+   * term. The atoms t_i are the constants and the non-linear subterms
+   * of the term. They are kept sorted by id, with nonzero coefficients,
+   * so that linear terms that are equal up to arithmetic have equal
+   * forms, and add, scale and compare are linear in their size.
+   */
+  class LinForm
+  {
+  public:
+    typedef std::pair<Expr, mpq_class> Mono;
+    typedef std::vector<Mono> Monos;
+
+  private:
+    Monos monos;
+    mpq_class cst;
+
+    struct LessMono
+    {
+      bool operator() (const Mono &a, const Mono &b) const
+      { return a.first->getId () < b.first->getId (); }
+    };
+
+    /** adds k*e to monos (unsorted) and cst */
+    static void collect (Expr e, const mpq_class &k, Monos &out, mpq_class &cst)
+    {
+      if (isOpX<MPZ>(e)) { cst += k * mpq_class (getTerm<mpz_class> (e)); return; }
+      if (isOpX<MPQ>(e)) { cst += k * getTerm<mpq_class> (e); return; }
+
+      if (isOpX<PLUS>(e))
+      {
+        for (auto it = e->args_begin (), end = e->args_end (); it != end; ++it)
+          collect (*it, k, out, cst);
+        return;
+      }
+      if (isOpX<MINUS>(e))
+      {
+        collect (e->arg (0), k, out, cst);
+        mpq_class nk = -k;
+        for (unsigned i = 1; i < e->arity (); i++) collect (e->arg (i), nk, out, cst);
+        return;
+      }
+      if (isOpX<UN_MINUS>(e)) { collect (e->left (), -k, out, cst); return; }
+
+      if (isOpX<MULT>(e))
+      {
+        // -- numerals times at most one other factor
+        mpq_class c = 1;
+        Expr factor;
+        for (auto it = e->args_begin (), end = e->args_end (); it != end; ++it)
+        {
+          Expr a = *it;
+          if (isOpX<MPZ>(a)) c *= mpq_class (getTerm<mpz_class> (a));
+          else if (isOpX<MPQ>(a)) c *= getTerm<mpq_class> (a);
+          else if (factor == NULL) factor = a;
+          else { out.push_back (Mono (e, k)); return; }
+        }
+        if (factor == NULL) cst += k * c;
+        else if (c == 1) collect (factor, k, out, cst);
+        else collect (factor, k * c, out, cst);
+        return;
+      }
+
+      if (isOpX<DIV>(e) && e->arity () == 2 &&
+          (isOpX<MPZ>(e->right ()) || isOpX<MPQ>(e->right ())))
+      {
+        mpq_class c = isOpX<MPZ>(e->right ()) ?
+          mpq_class (getTerm<mpz_class> (e->right ())) : getTerm<mpq_class> (e->right ());
+        if (c != 0) { collect (e->left (), k / c, out, cst); return; }
+      }
+
+      out.push_back (Mono (e, k));
+    }
+
+    /** sorts monos, merges equal atoms and drops zeros */
+    void normalize ()
+    {
+      std::sort (monos.begin (), monos.end (), LessMono ());
+      size_t j = 0;
+      for (size_t i = 0; i < monos.size (); i++)
+      {
+        if (j > 0 && monos [j - 1].first == monos [i].first)
+          monos [j - 1].second += monos [i].second;
+        else
+        {
+          if (j > 0 && monos [j - 1].second == 0) j--;
+          if (i != j) std::swap (monos [j], monos [i]);
+          j++;
+        }
+      }
+      if (j > 0 && monos [j - 1].second == 0) j--;
+      monos.resize (j);
+    }
+
+  public:
+    LinForm () {}
+    explicit LinForm (const mpq_class &c) : cst (c) {}
+    explicit LinForm (Expr e)
+    {
+      collect (e, 1, monos, cst);
+      normalize ();
+    }
+    /** the form of l - r */
+    LinForm (Expr l, Expr r)
+    {
+      collect (l, 1, monos, cst);
+      collect (r, -1, monos, cst);
+      normalize ();
+    }
+
+    const Monos &terms () const { return monos; }
+    const mpq_class &constant () const { return cst; }
+    bool isConst () const { return monos.empty (); }
+
+    /** coefficient of the atom t */
+    mpq_class coef (Expr t) const
+    {
+      Monos::const_iterator it =
+        std::lower_bound (monos.begin (), monos.end (), Mono (t, 0), LessMono ());
+      return it != monos.end () && it->first == t ? it->second : mpq_class (0);
+    }
+
+    /** removes the atom t */
+    void erase (Expr t)
+    {
+      Monos::iterator it =
+        std::lower_bound (monos.begin (), monos.end (), Mono (t, 0), LessMono ());
+      if (it != monos.end () && it->first == t) monos.erase (it);
+    }
+
+    /** true if var occurs only as an atom of its own */
+    bool isLinearIn (Expr var) const
+    {
+      for (auto &m : monos)
+        if (m.first != var && contains (m.first, var)) return false;
+      return true;
+    }
+
+    /** true if all coefficients and the constant are integers */
+    bool isIntegral () const
+    {
+      if (cst.get_den () != 1) return false;
+      for (auto &m : monos) if (m.second.get_den () != 1) return false;
+      return true;
+    }
+
+    void addConst (const mpq_class &c) { cst += c; }
+
+    /** this += k * o */
+    void add (const LinForm &o, const mpq_class &k = 1)
+    {
+      if (k == 0) return;
+      cst += k * o.cst;
+      if (o.monos.empty ()) return;
+
+      Monos res;
+      res.reserve (monos.size () + o.monos.size ());
+      Monos::iterator a = monos.begin ();
+      Monos::const_iterator b = o.monos.begin ();
+      while (a != monos.end () || b != o.monos.end ())
+      {
+        if (b == o.monos.end () ||
+            (a != monos.end () && a->first->getId () < b->first->getId ()))
+          res.push_back (*a++);
+        else if (a == monos.end () || b->first->getId () < a->first->getId ())
+        {
+          res.push_back (Mono (b->first, k * b->second));
+          ++b;
+        }
+        else
+        {
+          mpq_class c = a->second + k * b->second;
+          if (c != 0) res.push_back (Mono (a->first, c));
+          ++a; ++b;
+        }
+      }
+      monos.swap (res);
+    }
+
+    /** this *= k */
+    void scale (const mpq_class &k)
+    {
+      if (k == 0) { monos.clear (); cst = 0; return; }
+      cst *= k;
+      for (auto &m : monos) m.second *= k;
+    }
+
+    /**
+     * Scales the form so that the first coefficient is 1 (the constant,
+     * if there are no atoms), and returns the factor. The forms of
+     * (f op 0) and (g op 0) are then equal iff f and g are proportional.
+     */
+    mpq_class makeMonic ()
+    {
+      mpq_class k = monos.empty () ? cst : monos [0].second;
+      if (k == 0) return 1;
+      k = 1 / k;
+      scale (k);
+      return k;
+    }
+
+    int compare (const LinForm &o) const
+    {
+      size_t n = std::min (monos.size (), o.monos.size ());
+      for (size_t i = 0; i < n; i++)
+      {
+        unsigned x = monos [i].first->getId (), y = o.monos [i].first->getId ();
+        if (x != y) return x < y ? -1 : 1;
+        int c = cmp (monos [i].second, o.monos [i].second);
+        if (c != 0) return c < 0 ? -1 : 1;
+      }
+      if (monos.size () != o.monos.size ())
+        return monos.size () < o.monos.size () ? -1 : 1;
+      int c = cmp (cst, o.cst);
+      return c < 0 ? -1 : c > 0 ? 1 : 0;
+    }
+
+    bool operator== (const LinForm &o) const { return compare (o) == 0; }
+    bool operator!= (const LinForm &o) const { return compare (o) != 0; }
+    bool operator< (const LinForm &o) const { return compare (o) < 0; }
+
+    /**
+     * The form as an Expr: a sum of c_i*t_i (just t_i if c_i = 1, and
+     * -t_i if c_i = -1, as SimplifyArithmExpr leaves them), and of the
+     * constant if it is nonzero. Numerals are integers if isInt.
+     */
+    Expr toExpr (ExprFactory &efac, bool isInt) const
+    {
+      ExprVector summands;
+      for (auto &m : monos)
+      {
+        if (m.second == 1) summands.push_back (m.first);
+        else if (m.second == -1) summands.push_back (mk<UN_MINUS>(m.first));
+        else summands.push_back (mk<MULT>(mkNum (m.second, isInt, efac), m.first));
+      }
+      if (cst != 0 || summands.empty ()) summands.push_back (mkNum (cst, isInt, efac));
+      return summands.size () == 1 ? summands [0] : mknary<PLUS>(summands);
+    }
+  };
+
+  /** true if e is a numeric term over the reals, as far as it can tell */
+  inline static bool isRealTerm (Expr e)
+  {
+    if (isOpX<MPQ>(e) || isOpX<DIV>(e)) return true;
+    if (isOpX<MPZ>(e) || isOpX<IDIV>(e) || isOpX<MOD>(e)) return false;
+    if (bind::isRealConst (e)) return true;
+    if (bind::isIntConst (e)) return false;
+    if (isOpX<ITE>(e)) return isRealTerm (e->arg (1)) || isRealTerm (e->arg (2));
+    if (isOp<NumericOp>(e))
+    {
+      for (auto it = e->args_begin (), end = e->args_end (); it != end; ++it)
+        if (isRealTerm (*it)) return true;
+      return false;
+    }
+    if (isOpX<FAPP>(e) && isOpX<FDECL>(e->left ()))
+      return isOpX<REAL_TY>(bind::rangeTy (e->left ()));
+    return false;
+  }
+}
+
+#endif
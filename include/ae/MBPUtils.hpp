@@ -0,0 +1,532 @@
+#ifndef MBPUTILS__HPP__
+#define MBPUTILS__HPP__
+#include <assert.h>
+
+#include "ae/ExprSimpl.hpp"
+
+using namespace std;
+using namespace boost;
+namespace ufo
+{
+  /**
+   * lhs - rhs of lit as a linear form. Fails if it is not linear in var
+   */
+  inline static bool getLinForm (Expr lit, Expr var, LinForm &out)
+  {
+    out = LinForm (lit->left (), lit->right ());
+    return out.isLinearIn (var);
+  }
+
+  /**
+   * Rewrites a numeric literal into the form (var op bound). Returns
+   * NULL if lit is not linear in var, or if the coefficient of an
+   * integer var is not 1 or -1.
+   */
+  inline static Expr isolateVar (Expr var, Expr lit)
+  {
+    if (isOpX<NEG>(lit)) lit = mkNeg (lit->left ());
+    if (!isOp<ComparissonOp>(lit) || lit->arity () != 2) return NULL;
+
+    bool isInt = bind::isIntConst (var);
+    LinForm t;
+    if (!getLinForm (lit, var, t)) return NULL;
+    mpq_class coef = t.coef (var);
+    if (coef == 0) return NULL;
+    if (isInt && coef != 1 && coef != -1) return NULL;
+    if (isInt && !t.isIntegral ()) return NULL;
+
+    // -- a*var + rest op 0  <=>  var op' -rest/a  (op' is flipped if a < 0)
+    t.erase (var);
+    t.scale (-1 / coef);
+    Expr bnd = t.toExpr (var->getFactory (), isInt);
+    return coef > 0 ? reBuildCmp (lit, var, bnd) : reBuildFlippedCmp (lit, var, bnd);
+  }
+
+  /**
+   * Model-based projection of a single variable on Expr.
+   *
+   * Real variables are eliminated with Loos-Weispfenning virtual
+   * substitution, using the bound that is closest to the model value
+   * from below. Integer variables are eliminated with model-based
+   * Cooper: the coefficients are normalized to y = d*var, and y is
+   * replaced with the closest lower threshold shifted by the residue of
+   * the model value. Booleans are replaced with their definition (if T
+   * has one at the top level) or their model value.
+   *
+   * Each projection comes with Skolem substitutions in the format of
+   * z3_qe_model_project_skolem: either var -> term, or literal of var
+   * -> literal after the substitution.
+   */
+  class MBPUtils
+  {
+  private:
+
+    enum BndKind { B_LT, B_LE, B_EQ, B_NE, B_GE, B_GT };
+
+    struct Atom
+    {
+      Expr lit;
+      BndKind kind;   // y kind bnd, for y = d*var
+      LinForm bnd;    // bnd = k * bnd with k = scale
+      mpq_class scale;
+      mpq_class val;  // model value of bnd
+    };
+
+    ExprFactory &efac;
+    ExprMap vals;   // interpretation of constants in the model
+
+    std::unordered_map<Expr, mpq_class> numCache;
+    std::unordered_map<Expr, bool> boolCache;
+
+  public:
+
+    template <typename M>
+    MBPUtils (ExprFactory &_efac, M &m) : efac(_efac)
+    {
+      m.getConstInterps (vals);
+    }
+
+    static bool isBoolTerm (Expr e)
+    {
+      if (isOpX<ITE>(e)) return isBoolTerm (e->right ());
+      return isOp<BoolOp>(e) || isOp<ComparissonOp>(e) || bind::isBoolConst (e);
+    }
+
+    /**
+     * Value of a numeric term in the model; constants missing from the
+     * model are 0 as in Z3's model completion
+     */
+    bool evalNum (Expr e, mpq_class &res)
+    {
+      if (isOpX<MPZ>(e)) { res = getTerm<mpz_class> (e); return true; }
+      if (isOpX<MPQ>(e)) { res = getTerm<mpq_class> (e); return true; }
+
+      auto it = numCache.find (e);
+      if (it != numCache.end ()) { res = it->second; return true; }
+
+      if (bind::isIntConst (e) || bind::isRealConst (e))
+      {
+        res = 0;
+        auto v = vals.find (e);
+        if (v != vals.end () && !evalNum (v->second, res)) return false;
+      }
+      else if (isOpX<PLUS>(e) || isOpX<MINUS>(e) || isOpX<MULT>(e))
+      {
+        if (!evalNum (e->arg (0), res)) return false;
+        for (unsigned i = 1; i < e->arity (); i++)
+        {
+          mpq_class a;
+          if (!evalNum (e->arg (i), a)) return false;
+          if (isOpX<PLUS>(e)) res += a;
+          else if (isOpX<MINUS>(e)) res -= a;
+          else res *= a;
+        }
+      }
+      else if (isOpX<UN_MINUS>(e))
+      {
+        if (!evalNum (e->left (), res)) return false;
+        res = -res;
+      }
+      else if (isOpX<DIV>(e) || isOpX<IDIV>(e) || isOpX<MOD>(e))
+      {
+        mpq_class a, b;
+        if (!evalNum (e->left (), a) || !evalNum (e->right (), b)) return false;
+        if (b == 0) return false;
+        if (isOpX<DIV>(e)) res = a / b;
+        else
+        {
+          // -- SMT-LIB semantics: the remainder is non-negative
+          mpz_class q, r;
+          mpz_fdiv_qr (q.get_mpz_t (), r.get_mpz_t (),
+                       a.get_num_mpz_t (), b.get_num_mpz_t ());
+          if (r != 0 && b < 0) { q += 1; r -= b.get_num (); }
+          res = isOpX<IDIV>(e) ? mpq_class (q) : mpq_class (r);
+        }
+      }
+      else if (isOpX<ITE>(e))
+      {
+        bool c;
+        if (!evalBool (e->arg (0), c)) return false;
+        if (!evalNum (c ? e->arg (1) : e->arg (2), res)) return false;
+      }
+      else return false;
+
+      numCache[e] = res;
+      return true;
+    }
+
+    bool evalBool (Expr e, bool &res)
+    {
+      if (isOpX<TRUE>(e)) { res = true; return true; }
+      if (isOpX<FALSE>(e)) { res = false; return true; }
+
+      auto it = boolCache.find (e);
+      if (it != boolCache.end ()) { res = it->second; return true; }
+
+      if (bind::isBoolConst (e))
+      {
+        auto v = vals.find (e);
+        res = v != vals.end () && isOpX<TRUE>(v->second);
+      }
+      else if (isOpX<NEG>(e))
+      {
+        if (!evalBool (e->left (), res)) return false;
+        res = !res;
+      }
+      else if (isOpX<AND>(e) || isOpX<OR>(e))
+      {
+        bool isAnd = isOpX<AND>(e);
+        res = isAnd;
+        for (unsigned i = 0; i < e->arity (); i++)
+        {
+          bool a;
+          if (!evalBool (e->arg (i), a)) return false;
+          if (a != isAnd) { res = a; break; }
+        }
+      }
+      else if (isOpX<IMPL>(e) || isOpX<IFF>(e) || isOpX<XOR>(e))
+      {
+        bool a, b;
+        if (!evalBool (e->left (), a) || !evalBool (e->right (), b)) return false;
+        res = isOpX<IMPL>(e) ? (!a || b) : isOpX<IFF>(e) ? (a == b) : (a != b);
+      }
+      else if (isOpX<ITE>(e))
+      {
+        bool c;
+        if (!evalBool (e->arg (0), c)) return false;
+        if (!evalBool (c ? e->arg (1) : e->arg (2), res)) return false;
+      }
+      else if ((isOpX<EQ>(e) || isOpX<NEQ>(e)) && isBoolTerm (e->left ()))
+      {
+        bool a, b;
+        if (!evalBool (e->left (), a) || !evalBool (e->right (), b)) return false;
+        res = isOpX<EQ>(e) ? (a == b) : (a != b);
+      }
+      else if (isOp<ComparissonOp>(e))
+      {
+        mpq_class a, b;
+        if (!evalNum (e->left (), a) || !evalNum (e->right (), b)) return false;
+        if (isOpX<EQ>(e)) res = a == b;
+        else if (isOpX<NEQ>(e)) res = a != b;
+        else if (isOpX<LT>(e)) res = a < b;
+        else if (isOpX<LEQ>(e)) res = a <= b;
+        else if (isOpX<GT>(e)) res = a > b;
+        else res = a >= b;
+      }
+      else return false;
+
+      boolCache[e] = res;
+      return true;
+    }
+
+  private:
+
+    /** replaces the keys of m in e and propagates constants bottom-up */
+    Expr substitute (Expr e, ExprMap &m, std::unordered_map<Expr, Expr> &cache)
+    {
+      auto r = m.find (e);
+      if (r != m.end ()) return r->second;
+      if (e->arity () == 0) return e;
+
+      auto it = cache.find (e);
+      if (it != cache.end ()) return it->second;
+
+      ExprVector args;
+      bool changed = false;
+      for (unsigned i = 0; i < e->arity (); i++)
+      {
+        args.push_back (substitute (e->arg (i), m, cache));
+        changed |= args.back () != e->arg (i);
+      }
+
+      Expr res = e;
+      if (changed)
+      {
+        if (isOpX<AND>(e) || isOpX<OR>(e))
+        {
+          bool isAnd = isOpX<AND>(e);
+          ExprVector newArgs;
+          for (auto &a : args)
+          {
+            if (isAnd ? isOpX<FALSE>(a) : isOpX<TRUE>(a))
+            {
+              newArgs.clear ();
+              newArgs.push_back (a);
+              break;
+            }
+            if (!(isAnd ? isOpX<TRUE>(a) : isOpX<FALSE>(a))) newArgs.push_back (a);
+          }
+          res = isAnd ? conjoin (newArgs, efac) : disjoin (newArgs, efac);
+          if (newArgs.size () == 1) res = newArgs[0];
+        }
+        else if (isOpX<NEG>(e)) res = boolop::lneg (args[0]);
+        else if (isOpX<IMPL>(e)) res = boolop::lor (boolop::lneg (args[0]), args[1]);
+        else if (isOpX<ITE>(e)) res = boolop::lite (args[0], args[1], args[2]);
+        else if ((isOpX<EQ>(e) || isOpX<IFF>(e)) &&
+                 (isOpX<TRUE>(args[0]) || isOpX<FALSE>(args[0]) ||
+                  isOpX<TRUE>(args[1]) || isOpX<FALSE>(args[1])))
+        {
+          if (isOpX<TRUE>(args[0])) res = args[1];
+          else if (isOpX<TRUE>(args[1])) res = args[0];
+          else if (isOpX<FALSE>(args[0])) res = boolop::lneg (args[1]);
+          else res = boolop::lneg (args[0]);
+        }
+        else res = efac.mkNary (e->op (), args);
+      }
+      cache[e] = res;
+      return res;
+    }
+
+    void getAtoms (Expr e, Expr var, ExprSet &atoms, std::unordered_set<Expr> &seen)
+    {
+      if (e->arity () == 0 || !seen.insert (e).second) return;
+      if (isOp<ComparissonOp>(e) && !isBoolTerm (e->left ()))
+      {
+        if (contains (e, var)) atoms.insert (e);
+        return;
+      }
+      for (unsigned i = 0; i < e->arity (); i++)
+        getAtoms (e->arg (i), var, atoms, seen);
+    }
+
+    Expr cmp (BndKind k, Expr a, Expr b, const LinForm &diff)
+    {
+      // -- fold comparisons of constants
+      if (diff.isConst ())
+      {
+        const mpq_class &c = diff.constant ();
+        bool r;
+        switch (k)
+        {
+          case B_LT: r = c < 0; break;
+          case B_LE: r = c <= 0; break;
+          case B_EQ: r = c == 0; break;
+          case B_NE: r = c != 0; break;
+          case B_GE: r = c >= 0; break;
+          default:   r = c > 0; break;
+        }
+        return r ? mk<TRUE>(efac) : mk<FALSE>(efac);
+      }
+      switch (k)
+      {
+        case B_LT: return mk<LT>(a, b);
+        case B_LE: return mk<LEQ>(a, b);
+        case B_EQ: return mk<EQ>(a, b);
+        case B_NE: return mk<NEQ>(a, b);
+        case B_GE: return mk<GEQ>(a, b);
+        default:   return mk<GT>(a, b);
+      }
+    }
+
+    /** u - bnd of the atom as a linear form */
+    LinForm diff (const LinForm &u, const Atom &a)
+    {
+      LinForm d = u;
+      d.add (a.bnd, -a.scale);
+      return d;
+    }
+
+    /**
+     * Literals that are false in the model are recorded negated, so that
+     * each of them constrains the Skolem
+     */
+    void addLitSubsts (ExprMap &subst, ExprMap &map)
+    {
+      for (auto &a : subst)
+      {
+        bool b;
+        if (evalBool (a.first, b) && !b)
+          map[mkNeg (a.first)] = isOpX<FALSE>(a.second) ?
+            mk<TRUE>(efac) : mkNeg (a.second);
+        else map[a.first] = a.second;
+      }
+    }
+
+    Expr projectBool (Expr var, Expr pr, ExprMap &map)
+    {
+      Expr def;
+      ExprSet cnjs;
+      getConj (pr, cnjs);
+      for (auto &c : cnjs)
+      {
+        if (c == var) def = mk<TRUE>(efac);
+        else if (isOpX<NEG>(c) && c->left () == var) def = mk<FALSE>(efac);
+        else if ((isOpX<EQ>(c) || isOpX<IFF>(c)) && c->left () == var &&
+                 !contains (c->right (), var)) def = c->right ();
+        else if ((isOpX<EQ>(c) || isOpX<IFF>(c)) && c->right () == var &&
+                 !contains (c->left (), var)) def = c->left ();
+        if (def != NULL) break;
+      }
+      if (def == NULL)
+      {
+        bool b;
+        evalBool (var, b);
+        def = b ? mk<TRUE>(efac) : mk<FALSE>(efac);
+      }
+
+      ExprMap m;
+      m[var] = def;
+      std::unordered_map<Expr, Expr> cache;
+      map[var] = def;
+      return substitute (pr, m, cache);
+    }
+
+  public:
+
+    /**
+     * Projects var from pr. Returns NULL (and leaves map untouched) if
+     * var occurs in pr outside of linear atoms.
+     */
+    Expr project (Expr var, Expr pr, ExprMap &map)
+    {
+      return bind::isBoolConst (var) ? projectBool (var, pr, map) :
+                                       projectNum (var, pr, map);
+    }
+
+  private:
+
+    Expr projectNum (Expr var, Expr pr, ExprMap &map)
+    {
+      bool isInt = bind::isIntConst (var);
+      if (!isInt && !bind::isRealConst (var)) return NULL;
+
+      ExprSet lits;
+      std::unordered_set<Expr> seen;
+      getAtoms (pr, var, lits, seen);
+
+      // -- normalize all atoms to (a*var op bnd)
+      vector<Atom> atoms;
+      mpz_class d = 1;
+      for (auto &lit : lits)
+      {
+        LinForm t;
+        if (!getLinForm (lit, var, t)) return NULL;
+        mpq_class coef = t.coef (var);
+        if (coef == 0) continue;
+        if (isInt)
+        {
+          if (!t.isIntegral ()) return NULL;
+          mpz_class c = abs (coef.get_num ());
+          mpz_lcm (d.get_mpz_t (), d.get_mpz_t (), c.get_mpz_t ());
+        }
+
+        Atom a;
+        a.lit = lit;
+        BndKind k = isOpX<LT>(lit) ? B_LT : isOpX<LEQ>(lit) ? B_LE :
+                    isOpX<EQ>(lit) ? B_EQ : isOpX<NEQ>(lit) ? B_NE :
+                    isOpX<GEQ>(lit) ? B_GE : B_GT;
+        // -- a*var + rest op 0  <=>  var op' -rest/a  (op' is flipped if a < 0)
+        if (coef < 0)
+          k = k == B_LT ? B_GT : k == B_LE ? B_GE : k == B_GE ? B_LE :
+              k == B_GT ? B_LT : k;
+        a.kind = k;
+        a.scale = -1 / coef;
+        t.erase (var);
+        a.bnd = t;
+        atoms.push_back (a);
+      }
+
+      mpq_class x;
+      if (!evalNum (var, x)) return NULL;
+
+      for (auto &a : atoms)
+      {
+        if (isInt) a.scale *= mpq_class (d);     // bounds of y = d*var
+        mpq_class v = a.bnd.constant ();
+        for (auto &r : a.bnd.terms ())
+        {
+          mpq_class rv;
+          if (!evalNum (r.first, rv)) return NULL;
+          v += r.second * rv;
+        }
+        a.val = a.scale * v;
+      }
+      mpq_class y = isInt ? x * mpq_class (d) : x;
+
+      // -- pick the closest threshold from below
+      int best = -1;
+      bool bestStrict = false;
+      mpq_class bestVal;
+      for (unsigned i = 0; i < atoms.size (); i++)
+      {
+        Atom &a = atoms[i];
+        // -- integer thresholds: y >= bnd changes at bnd, y > bnd at bnd + 1
+        for (int shift = 0; shift < (isInt ? 2 : 1); shift++)
+        {
+          if (isInt && shift == 0 && (a.kind == B_GT || a.kind == B_LE)) continue;
+          if (isInt && shift == 1 && (a.kind == B_GE || a.kind == B_LT)) continue;
+
+          mpq_class v = a.val + shift;
+          if (v > y) continue;
+          // -- for reals, prefer exact (v == y) and then equalities
+          if (best < 0 || v > bestVal ||
+              (v == bestVal && !isInt && a.kind == B_EQ))
+          {
+            best = i;
+            bestVal = v;
+            bestStrict = shift == 1;
+          }
+        }
+      }
+
+      ExprMap subst;
+      if (best < 0)
+      {
+        // -- minus infinity
+        for (auto &a : atoms)
+          subst[a.lit] = (a.kind == B_LT || a.kind == B_LE || a.kind == B_NE) ?
+            mk<TRUE>(efac) : mk<FALSE>(efac);
+        addLitSubsts (subst, map);
+        std::unordered_map<Expr, Expr> cache;
+        Expr res = substitute (pr, subst, cache);
+        return contains (res, var) ? NULL : res;
+      }
+
+      Atom &b = atoms[best];
+      // -- u = bnd (+ 1) (+ residue), as a term over y
+      LinForm u;
+      u.add (b.bnd, b.scale);
+      if (isInt)
+      {
+        mpz_class r = mpq_class (y - bestVal).get_num ();
+        mpz_fdiv_r (r.get_mpz_t (), r.get_mpz_t (), d.get_mpz_t ());
+        u.addConst ((bestStrict ? 1 : 0) + mpq_class (r));
+      }
+      Expr uExpr = u.toExpr (efac, isInt);
+      bool exact = isInt || bestVal == y;
+
+      for (auto &a : atoms)
+      {
+        LinForm sb = a.bnd;
+        sb.scale (a.scale);
+        Expr bnd = sb.toExpr (efac, isInt);
+        LinForm df = diff (u, a);
+        BndKind k = a.kind;
+        if (exact) subst[a.lit] = cmp (k, uExpr, bnd, df);
+        else
+        {
+          // -- virtual substitution of u + eps
+          if (k == B_EQ) subst[a.lit] = mk<FALSE>(efac);
+          else if (k == B_NE) subst[a.lit] = mk<TRUE>(efac);
+          else if (k == B_LT || k == B_LE) subst[a.lit] = cmp (B_LT, uExpr, bnd, df);
+          else subst[a.lit] = cmp (B_GE, uExpr, bnd, df);
+        }
+      }
+
+      std::unordered_map<Expr, Expr> cache;
+      Expr res = substitute (pr, subst, cache);
+      if (contains (res, var)) return NULL;
+
+      if (isInt && d > 1)
+        res = boolop::land (res, mk<EQ>(mk<MOD>(uExpr, mkNum (mpq_class (d), true, efac)),
+                                        mkNum (0, true, efac)));
+      if (exact)
+        map[var] = (isInt && d > 1) ?
+          mk<IDIV>(uExpr, mkNum (mpq_class (d), true, efac)) : uExpr;
+      else addLitSubsts (subst, map);
+      return res;
+    }
+  };
+}
+
+#endif
@@ -10,7 +10,7 @@
 #include "../../synthlib2parser/src/include/SynthLib2ParserIFace.hpp"
 #include "../ufo/Smt/Z3n.hpp"
 #include "../ufo/ExprLlvm.hpp"
-#include "AeValSolver.hpp"
+#include "AeVal.hpp"
 #include "AeValException.hpp"
 
 using namespace ufo;
@@ -77,6 +77,9 @@ namespace ae
         std::vector<std::map<std::string, Expr>> LetVarExpressionStack;
         /*vector<map<Expression, Expression>> LetVarBindingStack;*/
 
+        AeValOptions Options;
+        AeValResult Result;
+
     public:
         MarshallVisitor(ExprFactory &efac);
         virtual ~MarshallVisitor();
@@ -130,30 +133,23 @@ namespace ae
 
         /*[-] Sort EXPR*/
 
-        static void Solve(const string &InFileName, ExprFactory &efac, bool allincl, bool scol );
+        /** Solves the synthesis problem of the file; opts.allInclusive is not supported */
+        static AeValResult Solve(const string &InFileName, ExprFactory &efac,
+                                 const AeValOptions &opts);
 
     };
 
     using namespace SynthLib2Parser;
 
-    void MarshallVisitor::Solve(const string &InFileName, ExprFactory &efac, bool allincl, bool scol )
+    AeValResult MarshallVisitor::Solve(const string &InFileName, ExprFactory &efac,
+                                       const AeValOptions &opts)
     {
         MarshallVisitor AeSynth(efac);
+        AeSynth.Options = opts;
         SynthLib2Parser::SynthLib2Parser Parser;
-        std::cout << "try read file" << std::endl;
-        try
-        {
-            Parser(InFileName);
-        }
-        catch (const std::exception &Ex)
-        {
-            cout << "Error " << endl;
-            cout << Ex.what() << endl;
-            throw Ex;
-        }
-        std::cout << "readed file" << std::endl;
+        Parser(InFileName);
         Parser.GetProgram()->Accept(&AeSynth);
-        return;
+        return AeSynth.Result;
     }
 
     MarshallVisitor::MarshallVisitor(ExprFactory &efac) :
@@ -608,7 +604,7 @@ namespace ae
         // std::cout<<std::endl;
          std::cout<< "--- End Alll vars----- "<<std::endl;*/
 
-        ufo::aeSolveAndSkolemize(e, SynthFnsVars, true, true, false);
+        Result = ufo::aeSolve(e, SynthFnsVars, Options);
     }
 
 
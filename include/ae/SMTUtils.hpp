@@ -1,9 +1,12 @@
 #ifndef SMTUTILS__HPP__
 #define SMTUTILS__HPP__
 #include <assert.h>
+#include <chrono>
 
 #include "ae/ExprSimpl.hpp"
+#include "ae/LRASimplex.hpp"
 #include "ufo/Smt/EZ3.hh"
+#include "ufo/Stats.hpp"
 
 using namespace std;
 using namespace boost;
@@ -14,24 +17,70 @@ namespace ufo
   private:
     
     ExprFactory &efac;
-    EZ3 z3;
+    std::unique_ptr<EZ3> ownZ3;
+    EZ3 &z3;
     ZSolver<EZ3> smt;
+    unsigned unknowns;
+
+    // -- statistics of implies
+    unsigned impliesCnt;
+    unsigned simplexCnt;
+    double simplexTime;   // ms
+    double z3Time;        // ms
+
+    /**
+     * Unknown (timeout, resource limit or cancellation) counts as sat,
+     * which is the conservative answer for implies, isTrue, isFalse and
+     * isEquiv.
+     */
+    bool check()
+    {
+      AE_COUNT ("smt.utils");
+      boost::tribool res = smt.solve ();
+      if (boost::indeterminate (res))
+      {
+        unknowns++;
+        return true;
+      }
+      return bool(res);
+    }
     
   public:
     
-    SMTUtils (ExprFactory& _efac) :
+    /**
+     * If _z3 is given, the context (and its translation cache) is
+     * shared with the caller, which must keep it alive.
+     */
+    SMTUtils (ExprFactory& _efac, EZ3 *_z3 = NULL) :
     efac(_efac),
-    z3(efac),
-    smt (z3)
+    ownZ3(_z3 ? NULL : new EZ3(efac)),
+    z3(_z3 ? *_z3 : *ownZ3),
+    smt (z3),
+    unknowns (0),
+    impliesCnt (0),
+    simplexCnt (0),
+    simplexTime (0),
+    z3Time (0)
     {}
 
+    /** per-query timeout (ms) and resource limit; 0 means no limit */
+    void setLimits(unsigned timeout, unsigned rlimit = 0)
+    {
+      smt.setLimits (timeout, rlimit);
+    }
+
+    /** number of queries that returned unknown */
+    unsigned getUnknownCount() { return unknowns; }
+
     Expr getModel(ExprVector& vars)
     {
       ExprVector eqs;
       ZSolver<EZ3>::Model m = smt.getModel();
-      for (auto & v : vars) if (v != m.eval(v))
+      ExprVector vals;
+      m.evalAll(vars, vals);
+      for (unsigned i = 0; i < vars.size(); i++) if (vars[i] != vals[i])
       {
-        eqs.push_back(mk<EQ>(v, m.eval(v)));
+        eqs.push_back(mk<EQ>(vars[i], vals[i]));
       }
       return conjoin (eqs, efac);
     }
@@ -44,10 +93,7 @@ namespace ufo
       smt.reset();
       smt.assertExpr (a);
       smt.assertExpr (b);
-      if (!smt.solve ()) {
-        return false;
-      }
-      return true;
+      return check ();
     }
 
     /**
@@ -59,10 +105,7 @@ namespace ufo
       smt.assertExpr (a);
       smt.assertExpr (b);
       smt.assertExpr (c);
-      if (!smt.solve ()) {
-        return false;
-      }
-      return true;
+      return check ();
     }
 
     /**
@@ -72,10 +115,7 @@ namespace ufo
     {
       if (reset) smt.reset();
       smt.assertExpr (a);
-      if (!smt.solve ()) {
-        return false;
-      }
-      return true;
+      return check ();
     }
 
     /**
@@ -86,6 +126,61 @@ namespace ufo
       return implies (a, b) && implies (b, a);
     }
     
+    /**
+     * Implication check for conjunctions of linear literals over Reals,
+     * by simplex; indeterminate if a or b is out of this fragment
+     */
+    boost::tribool impliesLRA (Expr a, Expr b)
+    {
+      ExprSet as;
+      ExprSet bs;
+      getConj (a, as);
+      getConj (b, bs);
+      for (auto &c : as)
+        if (!isOpX<TRUE>(c) && !isOpX<FALSE>(c) &&
+            (!LRASimplex::isLinearLiteral (c) || isOpX<NEQ>(c) ||
+             (isOpX<NEG>(c) && isOpX<EQ>(c->left()))))
+          return boost::indeterminate;
+      for (auto &c : bs)
+        if (!isOpX<TRUE>(c) && !isOpX<FALSE>(c) && !LRASimplex::isLinearLiteral (c))
+          return boost::indeterminate;
+
+      LRASimplex spx;
+      for (auto &c : as)
+      {
+        if (isOpX<TRUE>(c)) continue;
+        if (isOpX<FALSE>(c)) return true;
+        spx.assertLiteral (c);
+      }
+      if (!spx.check ()) return true;
+
+      for (auto c : bs)
+      {
+        if (isOpX<TRUE>(c)) continue;
+        if (isOpX<FALSE>(c)) return false;
+        if (isOpX<NEG>(c)) c = mkNeg(c->left());
+
+        // -- a && !c is unsat; !(x = y) is split into x < y and x > y
+        ExprVector negs;
+        if (isOpX<EQ>(c))
+        {
+          negs.push_back (mk<LT>(c->left(), c->right()));
+          negs.push_back (mk<GT>(c->left(), c->right()));
+        }
+        else negs.push_back (mkNeg (c));
+
+        for (auto &n : negs)
+        {
+          spx.push ();
+          spx.assertLiteral (n);
+          bool sat = spx.check ();
+          spx.pop ();
+          if (sat) return false;
+        }
+      }
+      return true;
+    }
+
     /**
      * SMT-based implication check
      */
@@ -93,7 +188,39 @@ namespace ufo
     {
       if (isOpX<TRUE>(b)) return true;
       if (isOpX<FALSE>(a)) return true;
-      return ! isSat(a, mk<NEG>(b));
+
+      impliesCnt++;
+      auto start = std::chrono::steady_clock::now();
+      boost::tribool res = impliesLRA (a, b);
+      double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+      simplexTime += ms;
+      if (!boost::indeterminate (res))
+      {
+        AE_COUNT ("smt.implies.simplex");
+        simplexCnt++;
+        return bool(res);
+      }
+
+      AE_COUNT ("smt.implies");
+      start = std::chrono::steady_clock::now();
+      bool r = ! isSat(a, mk<NEG>(b));
+      z3Time += std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start).count();
+      return r;
+    }
+
+    /**
+     * Adds the number of implies, how many of them were answered by
+     * simplex, and the time (ms) of simplex and of Z3 on them
+     */
+    void getImpliesStats (unsigned &cnt, unsigned &simplex,
+                          double &simplexMs, double &z3Ms)
+    {
+      cnt += impliesCnt;
+      simplex += simplexCnt;
+      simplexMs += simplexTime;
+      z3Ms += z3Time;
     }
     
     /**
@@ -116,7 +243,12 @@ namespace ufo
      * Check if v has only one sat assignment in phi
      */
     bool hasOneModel(Expr v, Expr phi) {
-      if (isFalse(phi)) return false;
+      if (isOpX<FALSE>(phi)) return false;
+      smt.reset();
+      smt.assertExpr (phi);
+      // -- no model to look at if phi is unsat or unknown
+      boost::tribool res = smt.solve ();
+      if (!res || boost::indeterminate (res)) return false;
 
       ZSolver<EZ3>::Model m = smt.getModel();
       Expr val = m.eval(v);
@@ -129,10 +261,12 @@ namespace ufo
     }
 
     /**
-     * ITE-simplifier (prt 2)
+     * ITE-simplifier (prt 2); once the run is canceled, every branch is
+     * sat and the recursion would unfold the whole DAG, so it stops
      */
     Expr simplifyITE(Expr ex, Expr upLevelCond)
     {
+      if (z3.isCancelled()) return ex;
       if (isOpX<ITE>(ex)){
         
         Expr cond = ex->arg(0);
@@ -258,7 +392,7 @@ namespace ufo
     Expr numericUnderapprox(Expr exp)
     {
       ExprVector cnstr_vars;
-      filter (exp, bind::IsConst (), back_inserter (cnstr_vars));
+      filterConsts (exp, back_inserter (cnstr_vars));
       if (cnstr_vars.size() == 1)
       {
         smt.reset();
@@ -271,12 +405,13 @@ namespace ufo
       return exp;
     }
 
-    void serialize_formula(Expr form)
+    void serialize_formula(Expr form, raw_ostream &out = outs())
     {
+      AE_TIMER ("serialize");
       smt.reset();
       smt.assertExpr(form);
-      smt.toSmtLib (outs());
-      outs().flush ();
+      smt.toSmtLib (out);
+      out.flush ();
     }
   };
   
@@ -289,7 +424,7 @@ namespace ufo
     EZ3 z3(efac);
     
     ExprVector allVars;
-    filter (mk<AND>(A,B), bind::IsConst (), back_inserter (allVars));
+    filterConsts (mk<AND>(A,B), back_inserter (allVars));
     
     ExprVector sharedTypes;
     
@@ -341,10 +476,10 @@ namespace ufo
     ExprVector sharedVars;
     
     ExprVector aVars;
-    filter (A, bind::IsConst (), back_inserter (aVars));
+    filterConsts (A, back_inserter (aVars));
     
     ExprVector bVars;
-    filter (B, bind::IsConst (), back_inserter (bVars));
+    filterConsts (B, back_inserter (bVars));
     
     // computing shared vars:
     for (auto &var: aVars) {
@@ -0,0 +1,318 @@
+#ifndef SKOLEMCHECK__HPP__
+#define SKOLEMCHECK__HPP__
+
+#include <chrono>
+#include "ae/SMTUtils.hpp"
+
+/**
+ * Semantic checks of Skolem functions of \forall x . S(x) => \exists y . T(x, y),
+ * as printed by AE-VAL or given in bench/skolems: a conjunction with a
+ * definition (= y f) for each y, where f usually is a chain of ITEs
+ * over the cases (partitions) of the function.
+ */
+namespace ufo
+{
+  struct SkolemInfo
+  {
+    size_t size;        // DAG nodes
+    unsigned defs;      // definitions (= y f), if sampling can evaluate them
+    unsigned cases;     // see SkolemChecker::getCases
+    double evalUs;      // evaluation of all definitions at a sample, on average
+
+    SkolemInfo () : size (0), defs (0), cases (1), evalUs (0) {}
+  };
+
+  class SkolemChecker
+  {
+    ExprFactory &efac;
+    EZ3 &z3;
+    ZSolver<EZ3> smt;
+    Expr s;
+    Expr t;
+    ExprVector sVars;
+    std::vector<ZSolver<EZ3>::Model> samples;
+
+    static bool contains (const ExprVector &v, Expr e)
+    {
+      return std::find (v.begin (), v.end (), e) != v.end ();
+    }
+
+    /** the value of a numeral, possibly negated */
+    static bool getNum (Expr e, mpq_class &q)
+    {
+      if (isOpX<MPZ>(e)) q = getTerm<mpz_class> (e);
+      else if (isOpX<MPQ>(e)) q = getTerm<mpq_class> (e);
+      else if (isOpX<UN_MINUS>(e) && getNum (e->left (), q)) q = -q;
+      else return false;
+      return true;
+    }
+
+    /** same values, also if one of them is an Int and the other a Real */
+    static bool sameValue (Expr a, Expr b)
+    {
+      mpq_class qa, qb;
+      return a == b || (getNum (a, qa) && getNum (b, qb) && qa == qb);
+    }
+
+    static unsigned chainLength (Expr e)
+    {
+      unsigned n = 0;
+      for (; isOpX<ITE>(e); e = e->last ()) n++;
+      return n;
+    }
+
+  public:
+    /** queries are limited by timeout (ms, 0 means no limit) */
+    SkolemChecker (Expr _s, Expr _t, EZ3 &_z3, unsigned timeout = 0) :
+      efac (_s->getFactory ()), z3 (_z3), smt (_z3), s (_s), t (_t)
+    {
+      filterConsts (s, std::back_inserter (sVars));
+      smt.setLimits (timeout);
+    }
+
+    /**
+     * Cases of skol: the guards of the longest ITE chain of its
+     * conjuncts or definitions, each of them with the negations of the ones before,
+     * and the rest. They cover everything.
+     */
+    ExprVector getCases (Expr skol)
+    {
+      Expr chain = skol;
+      ExprSet conjs;
+      getConj (skol, conjs);
+      for (auto &c : conjs)
+      {
+        Expr e = isOpX<EQ>(c) ? c->right () : c;
+        if (chainLength (e) > chainLength (chain)) chain = e;
+      }
+
+      ExprVector res, before;
+      for (Expr e = chain; isOpX<ITE>(e); e = e->last ())
+      {
+        before.push_back (e->left ());
+        res.push_back (conjoin (before, efac));
+        before.back () = mkNeg (e->left ());
+      }
+      res.push_back (conjoin (before, efac));
+      return res;
+    }
+
+    /**
+     * Checks S /\ skol => T, case by case on one solver; res gets the
+     * verdict of each case (true if it holds). A case where S holds but
+     * skol has no model does not hold, so that a vacuous (or
+     * contradictory) skol fails; one where S does not hold does. True
+     * if all of them hold, false if one does not, and indeterminate if
+     * unknown.
+     */
+    boost::tribool check (Expr skol, std::vector<boost::tribool> &res)
+    {
+      ExprVector cases = getCases (skol);
+      smt.reset ();
+      smt.assertExpr (s);
+
+      bool failed = false, unknown = false;
+      res.clear ();
+      for (auto &c : cases)
+      {
+        smt.push ();
+        smt.assertExpr (c);
+        smt.push ();
+        smt.assertExpr (skol);
+        boost::tribool r = smt.solve ();
+        if (r)
+        {
+          smt.assertExpr (mkNeg (t));
+          r = !smt.solve ();
+          smt.pop ();
+        }
+        else
+        {
+          // -- no model of skol: fine only if the case is not one of S
+          smt.pop ();
+          if (!r) r = !smt.solve ();
+        }
+        smt.pop ();
+        res.push_back (r);
+        if (boost::indeterminate (r)) unknown = true;
+        else if (!r) failed = true;
+      }
+      if (failed) return false;
+      if (unknown) return boost::indeterminate;
+      return true;
+    }
+
+    /**
+     * Checks that skol has a model at each sample. False if it has
+     * none at one of them, with that sample in witness, true if it has
+     * at all of them, and indeterminate if unknown.
+     */
+    boost::tribool defined (Expr skol, ExprMap &witness)
+    {
+      witness.clear ();
+      bool unknown = false;
+      smt.reset ();
+      smt.assertExpr (skol);
+      for (auto &m : samples)
+      {
+        ExprVector vals, eqs;
+        m.evalAll (sVars, vals, true);
+        for (unsigned i = 0; i < sVars.size (); i++) eqs.push_back (mk<EQ>(sVars [i], vals [i]));
+        smt.push ();
+        smt.assertExpr (conjoin (eqs, efac));
+        boost::tribool r = smt.solve ();
+        smt.pop ();
+        if (boost::indeterminate (r)) unknown = true;
+        else if (!r)
+        {
+          m.evalAll (sVars, witness, true);
+          return false;
+        }
+      }
+      return unknown ? boost::indeterminate : boost::tribool (true);
+    }
+
+    /** S /\ a => b */
+    boost::tribool implies (Expr a, Expr b)
+    {
+      smt.reset ();
+      smt.assertExpr (s);
+      smt.assertExpr (a);
+      smt.assertExpr (mkNeg (b));
+      return !smt.solve ();
+    }
+
+    /**
+     * Draws up to n distinct models of S (over its constants) for
+     * evaluate () and compare (); returns how many there are
+     */
+    unsigned sample (unsigned n)
+    {
+      samples.clear ();
+      smt.reset ();
+      smt.assertExpr (s);
+      while (samples.size () < n && smt.solve ())
+      {
+        samples.push_back (smt.getModel ());
+        if (sVars.empty ()) break;
+        ExprVector vals, eqs;
+        samples.back ().evalAll (sVars, vals, true);
+        for (unsigned i = 0; i < sVars.size (); i++) eqs.push_back (mk<EQ>(sVars [i], vals [i]));
+        smt.assertExpr (mkNeg (conjoin (eqs, efac)));
+      }
+      return samples.size ();
+    }
+
+    /**
+     * Values of the defined constants of skol at the i-th sample, in
+     * the order of dependencies. Cases (ITEs over conjunctions) are
+     * resolved by their guards. False if some of its conjuncts are not
+     * definitions over the constants of S and the ones before.
+     */
+    bool evaluate (Expr skol, unsigned i, ExprMap &vals)
+    {
+      ExprVector todo (1, skol), ys, yVals;
+      vals.clear ();
+      while (!todo.empty ())
+      {
+        bool progress = false;
+        ExprVector next;
+        for (Expr c : todo)
+        {
+          if (isOpX<TRUE>(c) || isOpX<AND>(c))
+          {
+            for (unsigned j = 0; j < c->arity (); j++) next.push_back (c->arg (j));
+            progress = true;
+            continue;
+          }
+          // -- Boolean definitions may be simplified to literals
+          if (bind::isBoolConst (c)) c = mk<EQ>(c, mk<TRUE>(efac));
+          else if (isOpX<NEG>(c) && bind::isBoolConst (c->left ()))
+            c = mk<EQ>(c->left (), mk<FALSE>(efac));
+
+          bool isCase = isOpX<ITE>(c);
+          if (!isCase && (!isOpX<EQ>(c) || !bind::IsConst () (c->left ()) ||
+                          contains (sVars, c->left ()) || contains (ys, c->left ())))
+            return false;
+
+          // -- the constants of S are evaluated by the model
+          Expr f = isCase ? c->first () : c->right ();
+          ExprVector cs;
+          filterConsts (f, std::back_inserter (cs));
+          bool ready = true;
+          for (auto &a : cs) ready &= contains (sVars, a) || contains (ys, a);
+          if (!ready)
+          {
+            next.push_back (c);
+            continue;
+          }
+
+          Expr v = samples [i].eval (ys.empty () ? f : replaceAll (f, ys, yVals), true);
+          progress = true;
+          if (isCase)
+          {
+            if (isOpX<TRUE>(v)) next.push_back (c->arg (1));
+            else if (isOpX<FALSE>(v)) next.push_back (c->last ());
+            else return false;
+            continue;
+          }
+          vals [c->left ()] = v;
+          ys.push_back (c->left ());
+          yVals.push_back (v);
+        }
+        if (!progress) return false;
+        todo.swap (next);
+      }
+      return true;
+    }
+
+    /** size, cases and evaluation cost of skol, over the samples */
+    SkolemInfo getInfo (Expr skol)
+    {
+      SkolemInfo info;
+      info.size = dagSize (skol);
+      info.cases = getCases (skol).size ();
+      ExprMap vals;
+      auto start = std::chrono::steady_clock::now ();
+      unsigned evaluated = 0;
+      for (unsigned i = 0; i < samples.size (); i++)
+        if (evaluate (skol, i, vals)) evaluated++;
+      if (evaluated > 0)
+      {
+        info.evalUs = std::chrono::duration<double, std::micro> (
+          std::chrono::steady_clock::now () - start).count () / evaluated;
+        info.defs = vals.size ();
+      }
+      return info;
+    }
+
+    /**
+     * Compares a and b on S: first at the samples, then by SMT. False
+     * if they differ, with the sample where they do in witness (empty
+     * if found by SMT), true if equivalent, indeterminate if unknown.
+     */
+    boost::tribool compare (Expr a, Expr b, ExprMap &witness)
+    {
+      witness.clear ();
+      ExprMap va, vb;
+      for (unsigned i = 0; i < samples.size (); i++)
+      {
+        if (!evaluate (a, i, va) || !evaluate (b, i, vb)) break;
+        for (auto &d : va)
+        {
+          auto it = vb.find (d.first);
+          if (it == vb.end () || sameValue (it->second, d.second)) continue;
+          samples [i].evalAll (sVars, witness, true);
+          return false;
+        }
+      }
+      boost::tribool ab = implies (a, b);
+      if (!ab) return false;
+      boost::tribool ba = implies (b, a);
+      if (!ba) return false;
+      return ab && ba ? boost::tribool (true) : boost::indeterminate;
+    }
+  };
+}
+
+#endif
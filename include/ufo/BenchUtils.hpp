@@ -0,0 +1,120 @@
+#ifndef UFO_BENCHUTILS__HPP__
+#define UFO_BENCHUTILS__HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include "ufo/Expr.hpp"
+
+/**
+ * Helpers of the benchmark tools (aebench, microbench, exprbench and
+ * rwbench): clocks, the tasks of a directory such as bench/tasks, the
+ * lines of JSON of their results, and DAGs of expressions flattened to
+ * be rebuilt in a factory.
+ */
+namespace ufo
+{
+  inline double nowNs ()
+  {
+    return std::chrono::duration<double, std::nano> (
+      std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+  }
+
+  inline double nowMs () { return nowNs () / 1e6; }
+
+  inline bool fileExists (const std::string &f) { return std::ifstream (f).good (); }
+
+  /**
+   * The tasks of dir (the names with an _s_part.smt2 and a _t_part.smt2
+   * file) that contain filter (if not NULL), sorted by name
+   */
+  inline std::vector<std::string> getTasks (const std::string &dir, const char *filter)
+  {
+    std::vector<std::string> res;
+    const std::string suf = "_s_part.smt2";
+    DIR *d = opendir (dir.c_str ());
+    if (d == NULL) return res;
+    while (dirent *e = readdir (d))
+    {
+      std::string f = e->d_name;
+      if (f.size () <= suf.size () || f.compare (f.size () - suf.size (), suf.size (), suf) != 0)
+        continue;
+      f.resize (f.size () - suf.size ());
+      if (filter != NULL && f.find (filter) == std::string::npos) continue;
+      if (fileExists (dir + "/" + f + "_t_part.smt2")) res.push_back (f);
+    }
+    closedir (d);
+    std::sort (res.begin (), res.end ());
+    return res;
+  }
+
+  /** the value of key in a flat line of JSON, without quotes; empty if none */
+  inline std::string jsonField (const std::string &line, const std::string &key)
+  {
+    size_t p = line.find ("\"" + key + "\": ");
+    if (p == std::string::npos) return "";
+    p += key.size () + 4;
+    if (line [p] == '"') return line.substr (p + 1, line.find ('"', p + 1) - p - 1);
+    return line.substr (p, line.find_first_of (",}", p) - p);
+  }
+
+  /**
+   * Results of fname, a line of JSON each, by their "name"; parse (line, r)
+   * reads the other fields of r. False if fname cannot be read.
+   */
+  template <typename R, typename F>
+  bool readResults (const char *fname, std::map<std::string, R> &res, F parse)
+  {
+    std::ifstream in (fname);
+    if (!in) return false;
+    std::string line;
+    while (std::getline (in, line))
+    {
+      std::string name = jsonField (line, "name");
+      if (name.empty ()) continue;
+      R r;
+      r.name = name;
+      parse (line, r);
+      res [name] = r;
+    }
+    return true;
+  }
+
+  /** DAG nodes of e in post-order, with the positions of their arguments */
+  inline void flatten (Expr e, std::vector<ENode*> &nodes,
+                       std::vector<std::vector<unsigned> > &args,
+                       std::unordered_map<ENode*, unsigned> &pos)
+  {
+    if (pos.count (&*e)) return;
+    std::vector<unsigned> a;
+    for (auto b = e->args_begin (), end = e->args_end (); b != end; ++b)
+    {
+      flatten (*b, nodes, args, pos);
+      a.push_back (pos [*b]);
+    }
+    pos [&*e] = nodes.size ();
+    nodes.push_back (&*e);
+    args.push_back (a);
+  }
+
+  /** the nodes of flatten () again in efac, one mk per node */
+  inline void rebuild (std::vector<ENode*> &nodes, std::vector<std::vector<unsigned> > &args,
+                       ExprFactory &efac, ExprVector &res)
+  {
+    res.resize (nodes.size ());
+    ExprVector kids;
+    for (unsigned i = 0; i < nodes.size (); i++)
+    {
+      kids.clear ();
+      for (unsigned a : args [i]) kids.push_back (res [a]);
+      res [i] = efac.mkNary (nodes [i]->op (), kids);
+    }
+  }
+}
+
+#endif
@@ -22,6 +22,8 @@ DM-0002198
 #pragma clang diagnostic ignored "-Wpotentially-evaluated-expression"
 
 #include <typeinfo>
+#include <type_traits>
+#include <cassert>
 #include <algorithm>
 #include <set>
 #include <map>
@@ -35,6 +37,13 @@ DM-0002198
 #include <unordered_map>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include <gmpxx.h>
 
@@ -68,6 +77,9 @@ namespace expr
   using namespace expr::op;
 
   class ENode;
+  class ENodeUniqueTable;
+  struct ENodeFreeList;
+  struct ENodeMeta;
   class ExprFactory;
   class ExprFactoryAllocator;
   
@@ -87,6 +99,74 @@ namespace expr
   inline ENode* eptr (Expr &e) { return e.get (); }
   //inline ENode* eptr (Expr e) { return e.get (); }
 
+  /**
+   * Arguments of an expression node. Up to three of them are stored in
+   * the node itself, which covers almost all nodes. Longer argument
+   * lists are moved to the heap.
+   */
+  class ENodeArgs
+  {
+  private:
+    enum { INLINE = 3 };
+
+    union 
+    {
+      ENode *inl [INLINE];
+      ENode **heap;
+    };
+    unsigned int sz;
+    unsigned int cap;
+
+    ENode **data () { return cap > INLINE ? heap : inl; }
+    ENode * const *data () const { return cap > INLINE ? heap : inl; }
+
+    void grow ()
+    {
+      ENode **n = new ENode* [2 * cap];
+      std::copy (data (), data () + sz, n);
+      if (cap > INLINE) delete [] heap;
+      heap = n;
+      cap *= 2;
+    }
+
+  public:
+    typedef ENode * const * const_iterator;
+
+    ENodeArgs () : sz (0), cap (INLINE) {}
+    ENodeArgs (const ENodeArgs &o) : sz (0), cap (INLINE) 
+    { for (ENode *a : o) push_back (a); }
+    ~ENodeArgs () { release (); }
+
+    ENodeArgs &operator= (const ENodeArgs &o)
+    {
+      if (this != &o) { clear (); for (ENode *a : o) push_back (a); }
+      return *this;
+    }
+
+    size_t size () const { return sz; }
+    bool empty () const { return sz == 0; }
+    const_iterator begin () const { return data (); }
+    const_iterator end () const { return data () + sz; }
+    ENode *operator[] (size_t p) const { return data () [p]; }
+    ENode *back () const { return data () [sz - 1]; }
+
+    void push_back (ENode *a) 
+    { 
+      if (sz == cap) grow ();
+      data () [sz++] = a; 
+    }
+
+    /** keeps the storage */
+    void clear () { sz = 0; }
+    /** frees the heap storage, if any */
+    void release ()
+    {
+      if (cap > INLINE) delete [] heap;
+      sz = 0;
+      cap = INLINE;
+    }
+  };
+
   class Operator;
     
   /* An operator (a.k.a. a tag) of an expression node */
@@ -103,7 +183,7 @@ namespace expr
               -- might be ambiguous and brakets might be required
      **/
     virtual void Print (std::ostream &OS,
-			const std::vector<ENode*> &args,
+			const ENodeArgs &args,
 			int depth = 0, 
 			bool brkt = true) const = 0;
     virtual bool operator== (const Operator& rhs) const = 0;
@@ -112,11 +192,37 @@ namespace expr
     virtual bool isMutable () const { return false; }
     /* Returns a heap-allocated clone of this */
     virtual Operator* clone (ExprFactoryAllocator &allocator) const = 0;
+    /** index of the instance shared by all nodes of a factory (see
+	InternedOp), or -1 if every node has its own copy */
+    virtual int internIndex () const { return -1; }
   };
 
+  /**
+   * Marks operators without data. A factory keeps a single instance of
+   * each of them, so that they are compared by address.
+   */
+  struct InternedOp {};
+
+#define INTERNED_OPS_MAX 1024
+
+  inline unsigned newInternIndex ()
+  {
+    static std::atomic<unsigned> next (0);
+    unsigned res = next++;
+    assert (res < INTERNED_OPS_MAX);
+    return res;
+  }
+
+  /** a dense index for each type of interned operator */
+  template <typename O> unsigned internIndex ()
+  {
+    static const unsigned res = newInternIndex ();
+    return res;
+  }
+
 
   inline std::ostream &operator<<(std::ostream &OS, const Operator &V) {
-    std::vector<ENode*> x;
+    ENodeArgs x;
     V.Print (OS, x);
     return OS;
   }
@@ -128,22 +234,34 @@ namespace expr
   {
   private:
     // // -- no default constructor
-    ENode () : id(0), count(0), fac(NULL) {}
+    ENode () : id(0), visitSlot(0), count(0), hval(0), meta(NULL), fac(NULL), 
+	       oper(NULL) {}
     // // -- no copy constructor
-    ENode (const ENode &) : count(0), fac(NULL) {}
+    ENode (const ENode &) : visitSlot(0), count(0), hval(0), meta(NULL), 
+			    fac(NULL), oper(NULL) {}
   protected:
     /** unique identifier of this expression node */
     unsigned int id;
-    /** reference counter */
-    unsigned int count;
+    /** position in the memo table of a DAG traversal, see DagVisitCache */
+    unsigned int visitSlot;
+    /** reference counter, atomic so that nodes can be shared by threads */
+    std::atomic<unsigned int> count;
+
+    /** hash of a canonical node, see ENodeUniqueHash */
+    size_t hval;
+
+    /** cached facts about the expression, see getMeta */
+    std::atomic<ENodeMeta*> meta;
 
     ExprFactory *fac;
-    std::vector<ENode*> args;
+    ENodeArgs args;
 
-    std::shared_ptr<Operator> oper;
+    /** allocated by the factory, shared by all nodes if interned,
+	otherwise owned by the node */
+    Operator *oper;
     
     
-    void Deref () { if (count > 0) count--; }
+    void Deref ();
 
 
     /** assigns a unique id to the node */
@@ -160,11 +278,17 @@ namespace expr
     /** returns the unique id of this expression */
     unsigned int getId () const { return id; }
 
-    void Ref () { count++; }
-    bool isGarbage () const { return count == 0; }
+    void Ref ();
+    bool isGarbage () const { return count.load () == 0; }
     bool isMutable () const { return oper->isMutable (); }
 
-    unsigned int use_count () { return count; }
+    unsigned int use_count () { return count.load (); }
+
+    /** facts about this expression, NULL if not computed yet */
+    const ENodeMeta *cachedMeta () const 
+    { return meta.load (std::memory_order_acquire); }
+    /** caches m unless it has been done already, returns the cached one */
+    const ENodeMeta *cacheMeta (ENodeMeta *m);
 
     ENode* operator[] (size_t p) { return arg (p); }
     ENode* arg (size_t p) { return args [p]; }
@@ -180,7 +304,7 @@ namespace expr
     { return args.size () > 0 ? args [args.size () - 1] : NULL; }
     
 
-    typedef std::vector<ENode*>::const_iterator args_iterator;
+    typedef ENodeArgs::const_iterator args_iterator;
 
     bool args_empty () const { return args.empty () ; }
     args_iterator args_begin () const { return args.begin (); }
@@ -198,7 +322,10 @@ namespace expr
     { oper->Print (OS, args, depth, brkt); }
 
     friend struct LessENode;
+    friend class ENodeUniqueTable;
+    friend struct ENodeFreeList;
     friend class ExprFactory;
+    friend class DagVisitCache;
     friend struct std::less<expr::ENode*>;
   };
 
@@ -219,7 +346,9 @@ namespace expr
   {
     std::size_t operator() (const ENode *e) const
     {
+      // -- terminals of different types may have equal value hashes
       size_t res = e->op ().hash ();
+      boost::hash_combine (res, static_cast<const void*> (typeid (e->op ()).name ()));
 
       size_t a = e->arity ();
       if (a == 0) return res;
@@ -264,17 +393,17 @@ namespace expr
   {
     bool operator () (ENode* const &e1, ENode* const &e2) const
     {
-      // -- same type
-      if (typeid (e1->op ()) == typeid (e2->op ()))
-	// -- same number of children
-	if (e1->arity () == e2->arity ())
-	  // -- operators (if have data) are equal
-	  if (e1->op () == e2->op ())
-	    // -- children are equal as pointers
-	    return std::equal (e1->args_begin (), 
-			       e1->args_end (), 
-			       e2->args_begin ());
-      return false;
+      // -- same number of children
+      if (e1->arity () != e2->arity ()) return false;
+      // -- same operator: either the same interned instance, or of the
+      // -- same type and (if have data) equal
+      if (&e1->op () != &e2->op () &&
+	  (typeid (e1->op ()) != typeid (e2->op ()) || !(e1->op () == e2->op ())))
+	return false;
+      // -- children are equal as pointers
+      return std::equal (e1->args_begin (), 
+			 e1->args_end (), 
+			 e2->args_begin ());
     }
   };
     
@@ -286,7 +415,7 @@ namespace expr
       if (typeid (e1->op ()) == typeid (e2->op ()))
 	{
 	  if (e1->op () == e2->op ())
-	    return lexicographical_compare (e1->args_begin (), 
+	    return std::lexicographical_compare (e1->args_begin (), 
 					    e1->args_end (),
 					    e2->args_begin (),
 					    e2->args_end ());
@@ -300,6 +429,118 @@ namespace expr
   };
 
   
+  /**
+   * Unique table of canonical nodes: a single open-addressing hash
+   * table with linear probing. Slots keep the precomputed hash, so most
+   * mismatches are rejected without touching the node. Deletion shifts
+   * the following entries back instead of leaving tombstones.
+   */
+  class ENodeUniqueTable : boost::noncopyable
+  {
+    struct Slot
+    {
+      size_t hash;
+      ENode *node;
+    };
+
+    std::vector<Slot> slots;
+    size_t count;
+
+    size_t mask () const { return slots.size () - 1; }
+
+    void grow ()
+    {
+      std::vector<Slot> old (2 * slots.size (), Slot {0, NULL});
+      old.swap (slots);
+      for (const Slot &s : old)
+	if (s.node != NULL)
+	  {
+	    size_t i = s.hash & mask ();
+	    while (slots [i].node != NULL) i = (i + 1) & mask ();
+	    slots [i] = s;
+	  }
+    }
+
+  public:
+    ENodeUniqueTable () : slots (1024, Slot {0, NULL}), count (0) {}
+
+    /** returns the node equal to v, inserting v if there is none */
+    ENode *insert (ENode *v)
+    {
+      // -- keep the load factor below 3/4
+      if (4 * (count + 1) > 3 * slots.size ()) grow ();
+
+      ENodeUniqueEqual eq;
+      size_t i = v->hval & mask ();
+      for (; slots [i].node != NULL; i = (i + 1) & mask ())
+	if (slots [i].hash == v->hval && eq (slots [i].node, v))
+	  return slots [i].node;
+
+      slots [i] = Slot {v->hval, v};
+      count++;
+      return v;
+    }
+
+    void erase (ENode *v)
+    {
+      size_t i = v->hval & mask ();
+      while (slots [i].node != v)
+	{
+	  // -- can only remove things that have been inserted before
+	  assert (slots [i].node != NULL);
+	  i = (i + 1) & mask ();
+	}
+
+      // -- move back entries whose home slot is not in (i, j]
+      for (size_t j = (i + 1) & mask (); slots [j].node != NULL;
+	   j = (j + 1) & mask ())
+	{
+	  size_t k = slots [j].hash & mask ();
+	  if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+	    {
+	      slots [i] = slots [j];
+	      i = j;
+	    }
+	}
+      slots [i].node = NULL;
+      count--;
+    }
+
+    size_t size () const { return count; }
+    size_t capacity () const { return slots.size (); }
+    /** memory taken by the table itself */
+    size_t bytes () const { return slots.size () * sizeof (Slot); }
+  };
+
+  /** 
+   * Facts about the expression rooted at a node. They are computed on
+   * demand by getMeta and live as long as the node.
+   */
+  struct ENodeMeta
+  {
+    /** constants as collected by filter (e, bind::IsConst (), ...),
+	ordered by id. Equal sets are shared between nodes */
+    std::shared_ptr<const std::vector<ENode*> > consts;
+    /** true if there is a VARIANT node in the expression */
+    bool variants;
+    /** size as a tree, saturates at SIZE_MAX */
+    size_t treeSize;
+    /** size as a DAG, 0 until it is asked for */
+    std::atomic<size_t> dagSize;
+
+    ENodeMeta () : variants (false), treeSize (1), dagSize (0) {}
+  };
+
+  inline const ENodeMeta *ENode::cacheMeta (ENodeMeta *m)
+  {
+    ENodeMeta *old = NULL;
+    if (meta.compare_exchange_strong (old, m, std::memory_order_acq_rel))
+      return m;
+    // -- another thread was first
+    delete m;
+    return old;
+  }
+
   /**
    * A type erasure of a cache
    */
@@ -330,77 +571,251 @@ namespace expr
   {
     ExprFactoryAllocator &m_efa;
     EFADeleter (ExprFactoryAllocator &efa) : m_efa (efa) {}
-    void operator() (void *p);
+    void operator() (Operator *p);
   };
 
     
+  /** kinds of memory of ExprFactoryAllocator */
+  enum ExprPool { EFA_TINY, EFA_SMALL, EFA_NODES, EFA_HEAP, EFA_POOLS };
+
+  /** 
+   * Memory of an ExprFactory, see ExprFactory::getMemStats. Bytes are
+   * only accounted when the factory is not concurrent.
+   */
+  struct ExprMemStats
+  {
+    /** live nodes, and their maximum so far */
+    size_t nodes;
+    size_t peakNodes;
+    /** freed nodes kept for reuse */
+    size_t freeNodes;
+    /** bytes handed out by each pool (and from the heap) */
+    size_t used [EFA_POOLS];
+    /** bytes held by each pool, approximately */
+    size_t reserved [EFA_POOLS];
+    /** maximum of the total of used so far */
+    size_t peakUsed;
+    /** open regions, and closed ones that still have live objects */
+    unsigned regions;
+    unsigned retired;
+
+    size_t totalUsed () const 
+    { size_t r = 0; for (size_t u : used) r += u; return r; }
+    size_t totalReserved () const 
+    { size_t r = 0; for (size_t u : reserved) r += u; return r; }
+  };
+    
   class ExprFactoryAllocator : boost::noncopyable
   {
   private:
-    /** pool for tiny objects */
-    boost::pool<> tiny;
-    /** pool for small objects */
-    boost::pool<> small;
+    /** the pools of the factory, or of one of its regions */
+    struct PoolSet
+    {
+      /** pool for tiny objects */
+      boost::pool<> tiny;
+      /** pool for small objects */
+      boost::pool<> small;
+      /** pool for expression nodes */
+      boost::pool<> nodes;
+      /** initial number of blocks of each pool */
+      size_t start [EFA_HEAP];
+      /** blocks handed out by each pool */
+      size_t used [EFA_HEAP];
+
+      PoolSet (size_t t, size_t s, size_t n) : 
+	tiny (8, t), small (64, s), nodes (sizeof (ENode), n)
+      { 
+	start [EFA_TINY] = t; start [EFA_SMALL] = s; start [EFA_NODES] = n;
+	for (size_t &u : used) u = 0;
+      }
+
+      boost::pool<> &pool (unsigned p) 
+      { return p == EFA_TINY ? tiny : p == EFA_SMALL ? small : nodes; }
+
+      /** the pool that block is from, or EFA_HEAP */
+      unsigned owner (void *block)
+      {
+	for (unsigned p = 0; p < EFA_HEAP; p++)
+	  if (pool (p).is_from (block)) return p;
+	return EFA_HEAP;
+      }
+
+      bool empty () const 
+      { return used [EFA_TINY] + used [EFA_SMALL] + used [EFA_NODES] == 0; }
+
+      /** blocks allocated so far: the pools double their next block */
+      size_t reserved (unsigned p) 
+      { return (pool (p).get_next_size () - start [p]) * pool (p).get_requested_size (); }
+    };
+
+    /** the pools are not thread-safe and are bypassed in concurrent mode */
+    bool concurrent;
+
+    /** the pools of the factory, then those of the open regions */
+    std::vector<std::unique_ptr<PoolSet> > sets;
+    /** sets.back () */
+    PoolSet *cur;
+    /** pools of closed regions, until their last object is freed */
+    std::vector<std::unique_ptr<PoolSet> > retired;
+    /** allocate from sets [0] if positive */
+    unsigned outermost;
+
+    /** bytes from the heap, and the peak of the total */
+    size_t heap;
+    size_t total;
+    size_t peak;
+
+    /** heap blocks start with their size, so that they can be accounted */
+    union HeapHeader { size_t size; std::max_align_t align; };
+
+    void account (size_t n, bool alloc)
+    {
+      if (alloc) { total += n; if (total > peak) peak = total; }
+      else total -= n;
+    }
+
+    void *poolAlloc (PoolSet &ps, unsigned p)
+    {
+      ps.used [p]++;
+      account (ps.pool (p).get_requested_size (), true);
+      return ps.pool (p).malloc ();
+    }
 
   public:
-    ExprFactoryAllocator () : tiny(8, 65536), small (64, 65536) {};
+    ExprFactoryAllocator (bool c = false) : 
+      concurrent (c), outermost (0), heap (0), total (0), peak (0)
+    { 
+      sets.push_back (std::unique_ptr<PoolSet> (new PoolSet (65536, 65536, 1024))); 
+      cur = sets.back ().get ();
+    }
     
     void *allocate (size_t n);
     void free (void *block);
     
     EFADeleter get_deleter ();    
+
+    /** opens a region: allocations come from new pools until it is closed */
+    void pushRegion ();
+    /** 
+     * Closes the innermost region. Its pools are released at once if
+     * none of their blocks are in use, otherwise by trim () later.
+     */
+    void popRegion ();
+    /** true if block is from the pools of the innermost region */
+    bool inRegion (void *block) 
+    { return sets.size () > 1 && sets.back ()->owner (block) != EFA_HEAP; }
+    /** true if block is from the pools of a closed region */
+    bool inRetired (void *block)
+    {
+      for (auto &ps : retired) if (ps->owner (block) != EFA_HEAP) return true;
+      return false;
+    }
+    bool hasRetired () const { return !retired.empty (); }
+    unsigned regions () const { return sets.size () - 1; }
+
+    /** releases the pools that have no blocks in use; returns bytes */
+    size_t trim ();
+
+    void getStats (ExprMemStats &st);
+
+    /** makes allocate use the pools of the factory, not of a region */
+    struct Outermost
+    {
+      ExprFactoryAllocator &a;
+      Outermost (ExprFactoryAllocator &_a) : a (_a) { a.outermost++; }
+      ~Outermost () { a.outermost--; }
+    };
   };
   
   
 
+  /** 
+   * Free list of the calling thread, shared by all concurrent
+   * factories. Nodes of concurrent factories are allocated on the heap
+   * and do not depend on the factory once they are freed.
+   */
+  struct ENodeFreeList
+  {
+    std::vector<ENode*> nodes;
+    ~ENodeFreeList ();
+
+    static ENodeFreeList &local ()
+    {
+      static thread_local ENodeFreeList fl;
+      return fl;
+    }
+  };
+
+  /**
+   * In concurrent mode, the factory can be used from several threads at
+   * once, and expressions can be shared between threads. The unique
+   * table is split into shards, each with its own lock, and the free
+   * list is thread-local. Registered caches are not synchronized, so
+   * they must either be owned by a single thread or be skipped (see
+   * ZTransCache).
+   */
   class ExprFactory : boost::noncopyable
   {
   protected:
 
-#define UNORDERED_SET_UNIQUE_TABLE 1
-#ifndef UNORDERED_SET_UNIQUE_TABLE
-    // -- type of unique table entry
-    typedef std::set<ENode*,LessENode> unique_entry_type;
-#else
-    typedef std::unordered_set<ENode*, 
-                               ENodeUniqueHash, 
-                               ENodeUniqueEqual> unique_entry_type;
-#endif
-    typedef const char* unique_key_type;
-    // -- type of the unique table
-    typedef std::map<unique_key_type,unique_entry_type> unique_type;
-
     typedef boost::ptr_vector<CacheStub> caches_type;
     
+    /** a part of the unique table */
+    struct UniqueShard
+    {
+      ENodeUniqueTable table;
+      std::mutex lock;
+    };
+
+#define UNIQUE_SHARD_BITS 6
+
+    const bool concurrent;
 
     /** pool allocator */
     ExprFactoryAllocator allocator;
 
     /** list of registered caches */
     caches_type caches;
+    std::mutex cachesLock;
     
-    // -- unique table
-    unique_type unique;
+    // -- unique table, a single shard unless concurrent
+    std::unique_ptr<UniqueShard[]> unique;
 
     /** counter for assigning unique ids*/
-    unsigned int idCount;
+    std::atomic<unsigned int> idCount;
+
+    /** the instances of interned operators, by internIndex () */
+    std::atomic<Operator*> interned [INTERNED_OPS_MAX];
     
     /** returns a unique id > 0 */
     unsigned int uniqueId () { return ++idCount; }
     
+    UniqueShard &shard (const ENode *v)
+    {
+      if (!concurrent) return unique [0];
+      // -- the table itself uses the low bits of the hash
+      return unique [(uint64_t (v->hval) * 0x9E3779B97F4A7C15ULL) >>
+		     (64 - UNIQUE_SHARD_BITS)];
+    }
+
+    /** locks m, but only in concurrent mode */
+    std::unique_lock<std::mutex> guard (std::mutex &m)
+    {
+      return concurrent ? std::unique_lock<std::mutex> (m) :
+	std::unique_lock<std::mutex> (m, std::defer_lock);
+    }
+
     /** 
      * Remove value from unique table
      */
     void Remove (ENode *val)
     { 
       clearCaches (val);
-      if (!val->isMutable ())
+      if (!val->isMutable ()) 
 	{
-	  unique_type::iterator it = unique.find (typeid (val->op ()).name ());
-	  // -- can only remove things that have been inserted before
-	  assert (it != unique.end ());
-	  it->second.erase (val);
-	  if (it->second.empty ()) unique.erase (it);
+	  UniqueShard &s = shard (val);
+	  std::unique_lock<std::mutex> l = guard (s.lock);
+	  s.table.erase (val);
 	}
 
       freeNode (val);
@@ -409,34 +824,41 @@ namespace expr
     /**
      * Clear val from all registered caches
      */
-    void clearCaches (ENode *val) { for (CacheStub &c : caches) c.erase (val); }
+    void clearCaches (ENode *val) 
+    {
+      std::unique_lock<std::mutex> l = guard (cachesLock);
+      for (CacheStub &c : caches) c.erase (val); 
+    }
     
     
 
     /**
-     * Return the canonical (unique) representetive of the input
+     * Return the canonical (unique) representetive of the input. The
+     * result is referenced on behalf of the caller, so that it cannot
+     * be collected by another thread before the caller gets it.
      */
     ENode* canonize (ENode* v)
     {
       if (v->isMutable ()) 
 	{
 	  v->setId (uniqueId ());
+	  v->Ref ();
 	  return v;
 	}
       
 
-      std::pair<unique_entry_type::iterator,bool> x = 
-	unique [typeid (v->op ()).name ()].insert (v);
-      if (x.second) 
-	{ 
-	  v->setId (uniqueId ());
-	  return v;
-	}
-      else
-	{
-	  freeNode (v);
-	  return *x.first;
-	}
+      v->hval = ENodeUniqueHash () (v);
+      UniqueShard &s = shard (v);
+      ENode *x;
+      {
+	std::unique_lock<std::mutex> l = guard (s.lock);
+	x = s.table.insert (v);
+	if (x == v) v->setId (uniqueId ());
+	x->Ref ();
+      }
+
+      if (x != v) freeNode (v);
+      return x;
     }
 
     ENode* mkExpr (const Operator &op)
@@ -495,34 +917,188 @@ namespace expr
 
 #define FREE_LIST_MAX_SIZE 1024*4
     std::vector<ENode*> freeList;
+    /** free lists of the enclosing regions */
+    std::vector<std::vector<ENode*> > outerFreeLists;
+    /** nodes out of the free lists, unless concurrent */
+    size_t liveNodes;
+    size_t peakNodes;
     void freeNode (ENode *n);
+    /** frees a node that is not used any more */
+    void dropNode (ENode *n);
     ENode *allocNode (const Operator &op);
+    void setOper (ENode *n, const Operator &op);
 
     
 
 
   public:
-    ExprFactory () : idCount(0) {}
+    explicit ExprFactory (bool c = false) : 
+      concurrent (c), allocator (c),
+      unique (new UniqueShard [c ? 1 << UNIQUE_SHARD_BITS : 1]), idCount(0),
+      liveNodes (0), peakNodes (0)
+    { for (auto &op : interned) op.store (NULL, std::memory_order_relaxed); }
+
+    ~ExprFactory ()
+    {
+      // -- the nodes themselves go away with the pools
+      for (ENode *n : freeList) n->args.release ();
+      for (auto &fl : outerFreeLists) for (ENode *n : fl) n->args.release ();
+      for (auto &op : interned) 
+	if (Operator *o = op.load (std::memory_order_relaxed)) 
+	  allocator.get_deleter () (o);
+    }
+
+    bool isConcurrent () const { return concurrent; }
+
+    /** the instance of the interned operator with the given index, or
+	NULL if there are no nodes with it yet */
+    const Operator *getInterned (unsigned idx) const
+    { return interned [idx].load (std::memory_order_acquire); }
+
+    /** number of nodes created so far, each with an id of its own */
+    unsigned int getCreatedNodes () const
+    { return idCount.load (std::memory_order_relaxed); }
+
+    /** number of canonical nodes and memory of the unique table */
+    size_t getUniqueSize () 
+    { 
+      size_t res = 0;
+      for (unsigned i = 0; i < (concurrent ? 1 << UNIQUE_SHARD_BITS : 1); i++)
+	{
+	  std::unique_lock<std::mutex> l = guard (unique [i].lock);
+	  res += unique [i].table.size ();
+	}
+      return res;
+    }
+    size_t getUniqueBytes () 
+    { 
+      size_t res = 0;
+      for (unsigned i = 0; i < (concurrent ? 1 << UNIQUE_SHARD_BITS : 1); i++)
+	{
+	  std::unique_lock<std::mutex> l = guard (unique [i].lock);
+	  res += unique [i].table.bytes ();
+	}
+      return res;
+    }
+
+    /**
+     * Opens a region of temporary expressions, see ExprRegion. Nothing
+     * is done in concurrent mode.
+     */
+    void pushRegion ()
+    {
+      if (concurrent) return;
+      allocator.pushRegion ();
+      outerFreeLists.push_back (std::vector<ENode*> ());
+      outerFreeLists.back ().swap (freeList);
+    }
+
+    void popRegion ()
+    {
+      if (concurrent) return;
+      assert (!outerFreeLists.empty ());
+      // -- freed nodes of the region go back to its pools, others are
+      // -- kept by the enclosing region
+      std::vector<ENode*> inner;
+      inner.swap (freeList);
+      freeList.swap (outerFreeLists.back ());
+      outerFreeLists.pop_back ();
+      for (ENode *n : inner)
+	if (allocator.inRegion (n) || freeList.size () >= FREE_LIST_MAX_SIZE) 
+	  dropNode (n);
+	else freeList.push_back (n);
+      allocator.popRegion ();
+    }
+
+    /**
+     * Returns unused memory: drops the free list of the calling thread
+     * (of the innermost region, if any), releases the pools that have
+     * nothing in use, and asks malloc to give memory back to the OS.
+     * Returns the bytes released from the pools.
+     */
+    size_t trim ()
+    {
+      std::vector<ENode*> &fl = concurrent ? ENodeFreeList::local ().nodes : freeList;
+      for (ENode *n : fl) dropNode (n);
+      fl.clear ();
+      size_t res = allocator.trim ();
+#ifdef __GLIBC__
+      malloc_trim (0);
+#endif
+      return res;
+    }
+
+    /** 
+     * Memory in use. In concurrent mode, there are only the nodes
+     * of the unique table.
+     */
+    ExprMemStats getMemStats ()
+    {
+      ExprMemStats st;
+      allocator.getStats (st);
+      if (concurrent)
+	{
+	  st.nodes = getUniqueSize ();
+	  st.peakNodes = 0;
+	  st.freeNodes = ENodeFreeList::local ().nodes.size ();
+	  return st;
+	}
+      st.nodes = liveNodes;
+      st.peakNodes = peakNodes;
+      st.freeNodes = freeList.size ();
+      for (auto &fl : outerFreeLists) st.freeNodes += fl.size ();
+      return st;
+    }
 
     /** Derefernce a value */
     void Deref (ENode* val)
     {
-      val->Deref ();
-      if (val->isGarbage ()) Remove (val);
+      if (!concurrent)
+	{
+	  val->Deref ();
+	  if (val->isGarbage ()) Remove (val);
+	  return;
+	}
+
+      // -- not the last reference, no need to lock
+      unsigned int c = val->count.load (std::memory_order_relaxed);
+      while (c > 1)
+	if (val->count.compare_exchange_weak (c, c - 1, 
+					      std::memory_order_release,
+					      std::memory_order_relaxed))
+	  return;
+
+      if (val->isMutable ())
+	{
+	  if (val->count.fetch_sub (1, std::memory_order_acq_rel) == 1) 
+	    Remove (val);
+	  return;
+	}
+
+      // -- the count drops to 0 under the lock of the shard, so that
+      // -- canonize () cannot pick up a dying node
+      {
+	UniqueShard &s = shard (val);
+	std::lock_guard<std::mutex> l (s.lock);
+	if (val->count.fetch_sub (1, std::memory_order_acq_rel) != 1) return;
+	s.table.erase (val);
+      }
+      clearCaches (val);
+      freeNode (val);
     }
 
     /** User functions */
-    Expr mkTerm (const Operator &o) { return Expr (mkExpr (o)); }
+    Expr mkTerm (const Operator &o) { return Expr (mkExpr (o), false); }
     Expr mkUnary (const Operator &o, Expr e) 
-    { return Expr (mkExpr (o, e.get ())); }
+    { return Expr (mkExpr (o, e.get ()), false); }
     Expr mkBin (const Operator &o, Expr e1, Expr e2)
-    { return Expr (mkExpr (o, e1.get (), e2.get ())); }
+    { return Expr (mkExpr (o, e1.get (), e2.get ()), false); }
     Expr mkTern (const Operator &o, Expr e1, Expr e2, 
 		 Expr e3)
-    { return Expr (mkExpr (o, e1.get (), e2.get (), e3.get ())); }
+    { return Expr (mkExpr (o, e1.get (), e2.get (), e3.get ()), false); }
     template <typename iterator>
     Expr mkNary (const Operator &o, iterator b, iterator e)
-    { return Expr (mkNExpr (o, b, e)); }
+    { return Expr (mkNExpr (o, b, e), false); }
     
     template <typename Range>
     Expr mkNary (const Operator &o, const Range &r)
@@ -534,6 +1110,7 @@ namespace expr
     {
       // -- to avoid double registration
       unregisterCache (cache);
+      std::unique_lock<std::mutex> l = guard (cachesLock);
       caches.push_back (static_cast<CacheStub*> (new CacheStubTmpl<Cache> (cache)));
     }
     
@@ -541,6 +1118,7 @@ namespace expr
     bool unregisterCache (const Cache &cache)
     {
       const void *ptr = static_cast<const void*> (&cache);
+      std::unique_lock<std::mutex> l = guard (cachesLock);
       
       for (caches_type::iterator it = caches.begin (), end = caches.end ();
 	   it != end; ++it)
@@ -555,11 +1133,40 @@ namespace expr
     friend class ENode;
   };
 
+  /**
+   * Scope of temporary expressions, e.g. of a sub-solve whose results
+   * are not kept. Nodes and operators made while the region is open
+   * come from pools of their own, which are released in bulk when the
+   * region is closed, or, if some of them are still alive, by a trim ()
+   * of the factory once they are not. Expressions made in the region
+   * can be used after it as any other. Does nothing to concurrent
+   * factories.
+   */
+  class ExprRegion : boost::noncopyable
+  {
+    ExprFactory &efac;
+  public:
+    explicit ExprRegion (ExprFactory &f) : efac (f) { efac.pushRegion (); }
+    ~ExprRegion () { efac.popRegion (); }
+  };
+
   inline ENode::ENode (ExprFactory &f, const Operator &o) :
-    count(0), fac(&f), 
-    oper(o.clone (f.allocator), 
-	 f.allocator.get_deleter (),
-	 boost::pool_allocator<char> ()) {}
+    visitSlot(0), count(0), hval(0), meta(NULL), fac(&f), oper(NULL) 
+  { f.setOper (this, o); }
+
+  // -- plain loads and stores are enough unless the factory is concurrent
+  inline void ENode::Ref ()
+  {
+    if (fac->concurrent) count.fetch_add (1, std::memory_order_relaxed);
+    else count.store (count.load (std::memory_order_relaxed) + 1, 
+		      std::memory_order_relaxed);
+  }
+
+  inline void ENode::Deref ()
+  {
+    unsigned int c = count.load (std::memory_order_relaxed);
+    if (c > 0) count.store (c - 1, std::memory_order_relaxed);
+  }
 }
 
 inline void * operator new (size_t n, expr::ExprFactoryAllocator &alloc)
@@ -570,70 +1177,301 @@ inline void operator delete (void *p, expr::ExprFactoryAllocator &alloc)
 
 namespace expr
 {
-  inline void ExprFactory::freeNode (ENode *n)
+  inline void ExprFactory::setOper (ENode *n, const Operator &op)
   {
-    if (freeList.size () < FREE_LIST_MAX_SIZE) 
-      {      
-	for (ENode *a : n->args) Deref (a);
-	n->args.clear ();
-	n->oper.reset ();
+    assert (n->oper == NULL);
+    int idx = op.internIndex ();
+    if (idx < 0) 
+      {
+	n->oper = op.clone (allocator);
+	return;
+      }
 
-	if (freeList.size () < FREE_LIST_MAX_SIZE) 
-	  { 
-	    assert (n->count == 0);
-	    freeList.push_back (n);
-	    return;
-	  }
+    Operator *o = interned [idx].load (std::memory_order_acquire);
+    if (o == NULL)
+      {
+	// -- the first node with this operator, possibly in several
+	// -- threads. It lives as long as the factory, not in a region
+	ExprFactoryAllocator::Outermost g (allocator);
+	Operator *c = op.clone (allocator);
+	if (interned [idx].compare_exchange_strong (o, c, std::memory_order_acq_rel))
+	  o = c;
+	else
+	  allocator.get_deleter () (c);
       }
+    n->oper = o;
+  }
+
+  inline void ExprFactory::freeNode (ENode *n)
+  {
+    // -- the children are released even if n does not go to the free list
+    for (ENode *a : n->args) Deref (a);
+    n->args.clear ();
+    if (n->oper->internIndex () < 0) allocator.get_deleter () (n->oper);
+    n->oper = NULL;
+    delete n->meta.exchange (NULL);
+
+    if (!concurrent) liveNodes--;
+
+    std::vector<ENode*> &fl = concurrent ? ENodeFreeList::local ().nodes : freeList;
+    // -- nodes of closed regions are not reused, so that their pools
+    // -- can be released
+    if (fl.size () < FREE_LIST_MAX_SIZE && 
+	(concurrent || !allocator.hasRetired () || !allocator.inRetired (n)))
+      { 
+	assert (n->count == 0);
+	fl.push_back (n);
+	return;
+      }
+
+    dropNode (n);
+  }
 
+  inline void ExprFactory::dropNode (ENode *n)
+  {
+    n->args.release ();
     operator delete (static_cast<void*>(n), allocator);
   }
 
   inline ENode *ExprFactory::allocNode (const Operator &op)
   {
-    if (freeList.empty ())
+    if (!concurrent && ++liveNodes > peakNodes) peakNodes = liveNodes;
+
+    std::vector<ENode*> &fl = concurrent ? ENodeFreeList::local ().nodes : freeList;
+    if (fl.empty ())
       return new(allocator) ENode (*this, op);
       
-    ENode *res = freeList.back ();
-    freeList.pop_back ();
-    res->oper.reset (op.clone (allocator), 
-		     allocator.get_deleter (),
-		     boost::pool_allocator<char> ());
+    ENode *res = fl.back ();
+    fl.pop_back ();
+    res->fac = this;
+    setOper (res, op);
     assert (res->count == 0);
     return res;
   }
+
+  inline ENodeFreeList::~ENodeFreeList ()
+  {
+    // -- allocated with new[] by ExprFactoryAllocator in concurrent mode
+    for (ENode *n : nodes)
+      {
+	n->args.release ();
+	delete [] reinterpret_cast<char*> (n);
+      }
+  }
     
 
   inline void *ExprFactoryAllocator::allocate (size_t n)
   { 
-    if (n <= tiny.get_requested_size ()) return tiny.malloc ();
-    else if (n <= small.get_requested_size ()) return small.malloc ();
+    if (concurrent) return static_cast<void*> (new char[n]);
+    PoolSet &ps = outermost > 0 ? *sets [0] : *cur;
+    if (n <= ps.tiny.get_requested_size ()) return poolAlloc (ps, EFA_TINY);
+    if (n <= ps.small.get_requested_size ()) return poolAlloc (ps, EFA_SMALL);
+    if (n <= ps.nodes.get_requested_size ()) return poolAlloc (ps, EFA_NODES);
     
-    return static_cast<void*> (new char[n]);
+    HeapHeader *h = reinterpret_cast<HeapHeader*> (new char[sizeof (HeapHeader) + n]);
+    h->size = n;
+    heap += n;
+    account (n, true);
+    return static_cast<void*> (h + 1);
   }
 
 
   inline void ExprFactoryAllocator::free (void *block) 
   { 
-    if (tiny.is_from (block)) tiny.free (block);
-    else if (small.is_from (block)) small.free (block);
-    else delete [] static_cast<char * const> (block); 
+    if (concurrent) { delete [] static_cast<char * const> (block); return; }
+
+    // -- most blocks are from the innermost pools
+    for (auto it = sets.rbegin (), end = sets.rend (); it != end; ++it)
+      {
+	unsigned p = (*it)->owner (block);
+	if (p == EFA_HEAP) continue;
+	(*it)->pool (p).free (block);
+	(*it)->used [p]--;
+	account ((*it)->pool (p).get_requested_size (), false);
+	return;
+      }
+    for (auto &ps : retired)
+      {
+	unsigned p = ps->owner (block);
+	if (p == EFA_HEAP) continue;
+	ps->pool (p).free (block);
+	ps->used [p]--;
+	account (ps->pool (p).get_requested_size (), false);
+	return;
+      }
+
+    HeapHeader *h = static_cast<HeapHeader*> (block) - 1;
+    heap -= h->size;
+    account (h->size, false);
+    delete [] reinterpret_cast<char*> (h); 
   }  
 
+  inline void ExprFactoryAllocator::pushRegion ()
+  {
+    if (concurrent) return;
+    sets.push_back (std::unique_ptr<PoolSet> (new PoolSet (1024, 1024, 256)));
+    cur = sets.back ().get ();
+  }
+
+  inline void ExprFactoryAllocator::popRegion ()
+  {
+    if (concurrent) return;
+    assert (sets.size () > 1);
+    if (!sets.back ()->empty ()) retired.push_back (std::move (sets.back ()));
+    sets.pop_back ();
+    cur = sets.back ().get ();
+  }
+
+  inline size_t ExprFactoryAllocator::trim ()
+  {
+    if (concurrent) return 0;
+    size_t res = 0;
+    for (auto it = retired.begin (); it != retired.end ();)
+      if ((*it)->empty ())
+	{
+	  for (unsigned p = 0; p < EFA_HEAP; p++) res += (*it)->reserved (p);
+	  it = retired.erase (it);
+	}
+      else ++it;
+
+    for (auto &ps : sets)
+      for (unsigned p = 0; p < EFA_HEAP; p++)
+	if (ps->used [p] == 0)
+	  {
+	    res += ps->reserved (p);
+	    ps->pool (p).purge_memory ();
+	  }
+    return res;
+  }
+
+  inline void ExprFactoryAllocator::getStats (ExprMemStats &st)
+  {
+    for (unsigned p = 0; p < EFA_POOLS; p++) st.used [p] = st.reserved [p] = 0;
+    st.peakUsed = st.regions = st.retired = 0;
+    if (concurrent) return;
+
+    for (auto *v : {&sets, &retired})
+      for (auto &ps : *v)
+	for (unsigned p = 0; p < EFA_HEAP; p++)
+	  {
+	    st.used [p] += ps->used [p] * ps->pool (p).get_requested_size ();
+	    st.reserved [p] += ps->reserved (p);
+	  }
+    st.used [EFA_HEAP] = st.reserved [EFA_HEAP] = heap;
+    st.peakUsed = peak;
+    st.regions = sets.size () - 1;
+    st.retired = retired.size ();
+  }
+
   inline EFADeleter ExprFactoryAllocator::get_deleter () 
   { return EFADeleter (*this); }
 
-  inline void EFADeleter::operator() (void *p)
-  { operator delete (p, m_efa); }
+  inline void EFADeleter::operator() (Operator *p)
+  {
+    // -- terminals own memory (strings, big numerals)
+    p->~Operator ();
+    operator delete (static_cast<void*> (p), m_efa);
+  }
 
   template <typename T>
   struct TerminalTrait {};
+
+  /**
+   * Storage of an mpz_class numeral in a Terminal. Values that fit in a
+   * long are kept inline, so making and cloning them does not touch
+   * GMP. The representation is canonical: a big value never fits in a
+   * long.
+   */
+  class SmallMpz
+  {
+    long small;
+    mpz_class *big;
+
+  public:
+    SmallMpz (const mpz_class &v) : small (0), big (NULL)
+    {
+      if (v.fits_slong_p ()) small = v.get_si ();
+      else big = new mpz_class (v);
+    }
+    SmallMpz (long v) : small (v), big (NULL) {}
+    SmallMpz (const SmallMpz &o) :
+      small (o.small), big (o.big ? new mpz_class (*o.big) : NULL) {}
+    ~SmallMpz () { delete big; }
+    SmallMpz &operator= (const SmallMpz &o)
+    {
+      if (this != &o)
+	{
+	  delete big;
+	  small = o.small;
+	  big = o.big ? new mpz_class (*o.big) : NULL;
+	}
+      return *this;
+    }
+
+    bool isSmall () const { return big == NULL; }
+    long getSmall () const { return small; }
+    const mpz_class &getBig () const { return *big; }
+
+    operator mpz_class () const { return big ? *big : mpz_class (small); }
+  };
+
+  /** Storage of an mpq_class numeral, see SmallMpz */
+  class SmallMpq
+  {
+    long num;
+    long den;
+    mpq_class *big;
+
+  public:
+    SmallMpq (const mpq_class &v) : num (0), den (1), big (NULL)
+    {
+      if (v.get_num ().fits_slong_p () && v.get_den ().fits_slong_p ())
+	{
+	  num = v.get_num ().get_si ();
+	  den = v.get_den ().get_si ();
+	}
+      else big = new mpq_class (v);
+    }
+    SmallMpq (const SmallMpq &o) :
+      num (o.num), den (o.den), big (o.big ? new mpq_class (*o.big) : NULL) {}
+    ~SmallMpq () { delete big; }
+    SmallMpq &operator= (const SmallMpq &o)
+    {
+      if (this != &o)
+	{
+	  delete big;
+	  num = o.num;
+	  den = o.den;
+	  big = o.big ? new mpq_class (*o.big) : NULL;
+	}
+      return *this;
+    }
+
+    bool isSmall () const { return big == NULL; }
+    long getNum () const { return num; }
+    long getDen () const { return den; }
+    const mpq_class &getBig () const { return *big; }
+
+    operator mpq_class () const
+    {
+      if (big) return *big;
+      // -- already canonical
+      mpq_class res;
+      mpq_set_si (res.get_mpq_t (), num, den);
+      return res;
+    }
+  };
+
+  /** how a Terminal stores its value */
+  template <typename T> struct TerminalStore { typedef T type; };
+  template <> struct TerminalStore<mpz_class> { typedef SmallMpz type; };
+  template <> struct TerminalStore<mpq_class> { typedef SmallMpq type; };
   
   template <typename T, typename P=TerminalTrait<T> >
   class Terminal : public Operator
   {
   protected:
-    T val;
+    typename TerminalStore<T>::type val;
   public:
     typedef T base_type;
     typedef P terminal_type;
@@ -644,12 +1482,12 @@ namespace expr
     base_type get () const { return val; }
 
     this_type* clone (ExprFactoryAllocator &allocator) const
-    { return new (allocator) this_type (val); }
+    { return new (allocator) this_type (*this); }
     
     
 
     void Print (std::ostream &OS, 
-		const std::vector<ENode*> &args,
+		const ENodeArgs &args,
 		int depth = 0, 
 		bool brkt = true) const
     {
@@ -777,14 +1615,39 @@ namespace expr
     
     static inline size_t hash (const mpz_class &v)
     {
-      std::string str = boost::lexical_cast<std::string> (v);
-      std::hash<std::string> hasher;
-      return hasher (str);
+      // -- sign and limbs
+      size_t res = mpz_sgn (v.get_mpz_t ());
+      for (size_t i = 0, sz = mpz_size (v.get_mpz_t ()); i < sz; i++)
+	boost::hash_combine (res, mpz_getlimbn (v.get_mpz_t (), i));
+      return res;
+    }
+
+    static inline void print (std::ostream &OS, const SmallMpz &v,
+			      int depth, bool brkt)
+    {
+      if (v.isSmall ()) OS << v.getSmall ();
+      else print (OS, v.getBig (), depth, brkt);
     }
-    
-    
 
+    static inline bool less (const SmallMpz &v1, const SmallMpz &v2)
+    {
+      if (v1.isSmall () && v2.isSmall ()) return v1.getSmall () < v2.getSmall ();
+      return mpz_class (v1) < mpz_class (v2);
+    }
+
+    static inline bool equal_to (const SmallMpz &v1, const SmallMpz &v2)
+    {
+      if (v1.isSmall () != v2.isSmall ()) return false;
+      if (v1.isSmall ()) return v1.getSmall () == v2.getSmall ();
+      return v1.getBig () == v2.getBig ();
+    }
 
+    static inline size_t hash (const SmallMpz &v)
+    {
+      if (!v.isSmall ()) return hash (v.getBig ());
+      std::hash<long> hasher;
+      return hasher (v.getSmall ());
+    }
   };
 
 
@@ -803,10 +1666,39 @@ namespace expr
     
     static inline size_t hash (const mpq_class &v)
     {
-      std::string str = boost::lexical_cast<std::string> (v);
-      std::hash<std::string> hasher;
-      return hasher (str);
-    }    
+      size_t res = TerminalTrait<mpz_class>::hash (v.get_num ());
+      boost::hash_combine (res, TerminalTrait<mpz_class>::hash (v.get_den ()));
+      return res;
+    }
+
+    static inline void print (std::ostream &OS, const SmallMpq &v,
+			      int depth, bool brkt)
+    {
+      if (!v.isSmall ()) OS << v.getBig ();
+      else if (v.getDen () == 1) OS << v.getNum ();
+      else OS << v.getNum () << "/" << v.getDen ();
+    }
+
+    static inline bool less (const SmallMpq &v1, const SmallMpq &v2)
+    {
+      return mpq_class (v1) < mpq_class (v2);
+    }
+
+    static inline bool equal_to (const SmallMpq &v1, const SmallMpq &v2)
+    {
+      if (v1.isSmall () != v2.isSmall ()) return false;
+      if (v1.isSmall ())
+	return v1.getNum () == v2.getNum () && v1.getDen () == v2.getDen ();
+      return v1.getBig () == v2.getBig ();
+    }
+
+    static inline size_t hash (const SmallMpq &v)
+    {
+      if (!v.isSmall ()) return hash (v.getBig ());
+      size_t res = std::hash<long> () (v.getNum ());
+      boost::hash_combine (res, v.getDen ());
+      return res;
+    }
   };
 
 
@@ -835,7 +1727,7 @@ namespace expr
 				int depth,
 				bool brkt,
 				const std::string &name,
-				const std::vector<ENode*> &args)	
+				const ENodeArgs &args)	
       {
 	if (args.size () >= 2) OS << "[";
 	if (args.size () == 1 && brkt) OS << "(";
@@ -852,7 +1744,7 @@ namespace expr
 	  }
 	  
 
-	for (std::vector<ENode*>::const_iterator it = args.begin (), 
+	for (ENodeArgs::const_iterator it = args.begin (), 
 	       end = args.end (); it != end; ++it)
 	  {
 	    OS << "\n";
@@ -873,7 +1765,7 @@ namespace expr
 				int depth,
 				bool brkt,
 				const std::string &name,
-				const std::vector<ENode*> &args)	
+				const ENodeArgs &args)	
       {
 	
 	if (args.size () != 2) 
@@ -898,13 +1790,13 @@ namespace expr
 				int depth,
 				bool brkt,
 				const std::string &name,
-				const std::vector<ENode*> &args)	
+				const ENodeArgs &args)	
       {
 	OS << name << "(";
       
 	
 	bool first = true;
-	for (std::vector<ENode*>::const_iterator it = args.begin (), 
+	for (ENodeArgs::const_iterator it = args.begin (), 
 	       end = args.end (); it != end; ++it)
 	  {
 	    if (!first) OS << ", ";
@@ -922,12 +1814,12 @@ namespace expr
 				int depth,
 				bool brkt,
 				const std::string &name,
-				const std::vector<ENode*> &args)	
+				const ENodeArgs &args)	
       {
 	OS << "(" << name << " ";
       
 	bool first = true;
-	for (std::vector<ENode*>::const_iterator it = args.begin (), 
+	for (ENodeArgs::const_iterator it = args.begin (), 
 	       end = args.end (); it != end; ++it)
 	  {
 	    if (!first) OS << " ";
@@ -980,7 +1872,7 @@ namespace expr
   
 
   template <typename T, typename B, typename P> 
-  struct DefOp : public B
+  struct DefOp : public B, public InternedOp
   {
     typedef DefOp<T,B,P> this_type;
     typedef B base_type;
@@ -988,7 +1880,7 @@ namespace expr
     typedef P ps_type;
     
     void Print (std::ostream &OS, 
-		const std::vector<ENode*> &args,
+		const ENodeArgs &args,
 		int depth = 0, 
 		bool brkt = true) const
     { ps_type::print (OS, depth, brkt, op_type::name (), args);  }
@@ -1004,7 +1896,8 @@ namespace expr
     
     this_type * clone (ExprFactoryAllocator &allocator) const 
     { return new (allocator) this_type (*this); }
-      
+
+    int internIndex () const { return expr::internIndex<this_type> (); }
   };
 
   inline ENode::~ENode () 
@@ -1019,8 +1912,8 @@ namespace expr
   template <typename iterator>
   void ENode::renew_args (iterator b, iterator e)
   {
-    std::vector<ENode*> old = args;
-    args = std::vector<ENode*> ();
+    ENodeArgs old = args;
+    args.clear ();
     
     // -- increment reference count of all new arguments
     for (; b != e; ++b)
@@ -1073,54 +1966,36 @@ namespace expr
     virtual Expr apply (Expr e) = 0;
   };
 
-  namespace
-  {
-    template <typename T>
-    struct ExprFunctionoid : public ExprFn
-    {
-      typedef std::shared_ptr<T> fn_type;
-
-      fn_type fn;
-
-      ExprFunctionoid (T* f) : fn_type (fn) {}
-      ExprFunctionoid (fn_type f) : fn(f) {}
-      Expr apply (Expr e) { return (*fn)(e); }
-    };
-      
-  }
-  
-
   class VisitAction
   {
   public:
 
     // skipKids or doKids
-    VisitAction (bool kids = false) : 
-      _skipKids (kids), fn (new ExprFunctionoid<IdentityRewriter> 
-                            (std::make_shared<IdentityRewriter> ())) {}
+    VisitAction (bool kids = false) : _skipKids (kids), fn (NULL) {}
     
     // changeTo or doKidsRewrite
+    VisitAction (Expr e, bool kids) : _skipKids(kids), expr(e), fn (NULL) {}
+
     template <typename R>
-    VisitAction (Expr e, bool kids = false, 
-		 std::shared_ptr<R> r = std::make_shared<IdentityRewriter> ()) :
-                 _skipKids(kids), expr(e), fn(new ExprFunctionoid<R> (r)) {}
+    VisitAction (Expr e, bool kids, std::shared_ptr<R> r) :
+                 _skipKids(kids), expr(e), rewriter (r), fn (&applyFn<R>) {}
     
     bool isSkipKids () { return _skipKids && expr.get () == NULL; }
     bool isChangeTo () { return _skipKids && expr.get () != NULL; }
     bool isDoKids () { return !_skipKids && expr.get () == NULL; }
     bool isChangeDoKidsRewrite () { return !_skipKids && expr.get () != NULL; }
 
-    Expr rewrite (Expr v) { return fn->apply (v); }
+    Expr rewrite (Expr v) { return fn == NULL ? v : fn (rewriter.get (), v); }
 
     Expr getExpr () { return expr; }
 
     static inline VisitAction skipKids () { return VisitAction (true); }
     static inline VisitAction doKids () { return VisitAction (false); }
     static inline VisitAction changeTo (Expr e) 
-    { return VisitAction (e, true, std::make_shared<IdentityRewriter> ());}
+    { return VisitAction (e, true);}
     
     static inline VisitAction changeDoKids (Expr e) 
-    { return VisitAction (e, false, std::make_shared<IdentityRewriter> ());}
+    { return VisitAction (e, false);}
     
     template <typename R> 
     static inline VisitAction changeDoKidsRewrite (Expr e, std::shared_ptr<R> r) 
@@ -1130,20 +2005,143 @@ namespace expr
     bool _skipKids;
     Expr expr;
   private:
-    std::shared_ptr<ExprFn> fn;
+    // -- the rewriter is called through a plain function pointer, so
+    // -- that an action does not allocate. No rewriter is the identity
+    std::shared_ptr<void> rewriter;
+    Expr (*fn) (void*, Expr);
+
+    template <typename R>
+    static Expr applyFn (void *r, Expr e) { return (*static_cast<R*> (r)) (e); }
+  };
+
+
+  /**
+   * Memo table of a DAG traversal. The first traversal of a thread
+   * keeps the position of each node in the node itself, so that a
+   * lookup is a single load and a compare, and reuses the array of
+   * the previous one. Traversals nested in it, and traversals of
+   * concurrent factories (whose nodes are shared with other threads),
+   * fall back to a hash map.
+   */
+  class DagVisitCache : boost::noncopyable
+  {
+    struct Entry 
+    {
+      ENode *key;
+      Expr res;
+      Entry (ENode *k, Expr r) : key (k), res (r) {}
+    };
+
+    /** the array of the calling thread, and whether it is in use */
+    struct Arena
+    {
+      std::vector<Entry> entries;
+      bool busy;
+      Arena () : busy (false) {}
+    };
+
+    static Arena &local ()
+    {
+      static thread_local Arena a;
+      return a;
+    }
+
+    /** the arena owned by this traversal, if any */
+    Arena *arena;
+    bool started;
+    std::unordered_map<ENode*,Expr> map;
+
+    void start (ENode *n)
+    {
+      started = true;
+      Arena &a = local ();
+      if (a.busy || n->efac ().isConcurrent ()) return;
+      a.busy = true;
+      arena = &a;
+    }
+
+  public:
+    DagVisitCache () : arena (NULL), started (false) {}
+    ~DagVisitCache () { clear (); }
+
+    /** the result cached for n, or NULL */
+    const Expr *find (ENode *n)
+    {
+      if (!started) start (n);
+      if (arena != NULL)
+	{
+	  // -- the slot may have been set by another traversal
+	  unsigned s = n->visitSlot;
+	  std::vector<Entry> &es = arena->entries;
+	  return s < es.size () && es [s].key == n ? &es [s].res : NULL;
+	}
+      std::unordered_map<ENode*,Expr>::const_iterator it = map.find (n);
+      return it == map.end () ? NULL : &it->second;
+    }
+
+    /** caches res for n and keeps n alive until clear () */
+    void insert (ENode *n, Expr res)
+    {
+      if (!started) start (n);
+      n->Ref ();
+      if (arena != NULL)
+	{
+	  n->visitSlot = arena->entries.size ();
+	  arena->entries.push_back (Entry (n, res));
+	}
+      else
+	map [n] = res;
+    }
+
+    void clear ()
+    {
+      if (arena != NULL)
+	{
+	  for (Entry &e : arena->entries) e.key->efac ().Deref (e.key);
+	  // -- keeps the capacity for the next traversal
+	  arena->entries.clear ();
+	  arena->busy = false;
+	  arena = NULL;
+	}
+      for (std::pair<ENode* const,Expr> &kv : map)
+	kv.first->efac ().Deref (kv.first);
+      map.clear ();
+      started = false;
+    }
   };
 
+  /** 
+   * The arguments rebuilt by a visit. They live on a stack shared by
+   * all visits of the calling thread, so that a visit does not
+   * allocate.
+   */
+  class VisitKids : boost::noncopyable
+  {
+    ExprVector &stack;
+    size_t base;
 
-  typedef std::unordered_map<ENode*,Expr> DagVisitCache;
+    static ExprVector &local ()
+    {
+      static thread_local ExprVector s;
+      return s;
+    }
+
+  public:
+    VisitKids () : stack (local ()), base (stack.size ()) {}
+    ~VisitKids () { stack.erase (begin (), end ()); }
+
+    void push_back (Expr e) { stack.push_back (e); }
+    ExprVector::iterator begin () { return stack.begin () + base; }
+    ExprVector::iterator end () { return stack.end (); }
+  };
 
   template <typename ExprVisitor> 
   Expr visit (ExprVisitor &v, Expr expr, DagVisitCache &cache)
   {
     if (expr->use_count () > 1)
       {
-	DagVisitCache::const_iterator cit 
-	  = cache.find (&*expr);
-	if (cit != cache.end ()) return cit->second;
+	const Expr *cached = cache.find (&*expr);
+	if (cached != NULL) return *cached;
       }
     
     
@@ -1160,15 +2158,15 @@ namespace expr
 	if (res->arity () > 0) 
 	  {
 	    bool changed = false;
-            std::vector<Expr> kids;
+	    VisitKids kids;
 
 	    for (ENode::args_iterator b = res->args_begin (), 
 		   e = res->args_end (); 
 		 b != e; ++b)
 	      {
 		Expr k = visit (v, *b, cache);
-		kids.push_back (k);
 		changed  = (changed || k.get () != *b);
+		kids.push_back (k);
 	      }
 	    
 	    if (changed)
@@ -1185,21 +2183,12 @@ namespace expr
 	res = va.rewrite (res);
       }
 
-    if (expr->use_count () > 1)
-      {
-	expr->Ref ();
-	cache[&*expr] = res;
-      }
+    if (expr->use_count () > 1) cache.insert (&*expr, res);
     
     return res;
   }  
 
-  inline void clearDagVisitCache (DagVisitCache &cache)
-  {
-    for (DagVisitCache::value_type &kv : cache) 
-      kv.first->efac ().Deref (kv.first);
-    cache.clear ();
-  }
+  inline void clearDagVisitCache (DagVisitCache &cache) { cache.clear (); }
 
 
   template <typename ExprVisitor>
@@ -1244,15 +2233,15 @@ namespace expr
     if (res->arity () == 0) return va.rewrite (res);
 
     bool changed = false;
-    std::vector<Expr> kids;
+    VisitKids kids;
 
     for (ENode::args_iterator b = res->args_begin (), 
 	   e = res->args_end (); 
 	 b != e; ++b)
       {
 	Expr k = visit (v, *b);
-	kids.push_back (k);
 	changed  = (changed || k.get () != *b);
+	kids.push_back (k);
       }
 
     if (changed)
@@ -1291,9 +2280,20 @@ namespace expr
   
   // -- usage isOpX<TYPE>(EXPR) . Returns true if top operator of
   // -- expression is of type TYPE.    
-  template <typename O, typename T> bool isOpX (T e)
+  template <typename O, typename T> 
+  typename std::enable_if<!std::is_base_of<InternedOp, O>::value, bool>::type 
+  isOpX (T e)
   { return typeid (eptr (e)->op ()) == typeid (O); }
 
+  // -- interned operators are compared by address
+  template <typename O, typename T> 
+  typename std::enable_if<std::is_base_of<InternedOp, O>::value, bool>::type 
+  isOpX (T e)
+  { 
+    const ENode *n = eptr (e);
+    return &n->op () == n->efac ().getInterned (internIndex<O> ());
+  }
+
   /**********************************************************************/
   /* Creation */
   /**********************************************************************/
@@ -1972,7 +2972,7 @@ namespace expr
 				  int depth,
 				  bool brkt,
 				  const std::string &name,
-				  const std::vector<ENode*> &args)	
+				  const ENodeArgs &args)	
 	{
 	  OS << "[";
 	  args [0]->Print (OS, depth, false);
@@ -2022,7 +3022,7 @@ namespace expr
 				  int depth,
 				  bool brkt,
 				  const std::string &name,
-				  const std::vector<ENode*> &args)
+				  const ENodeArgs &args)
 	{
 	  args [1]->Print (OS, depth, true);
 	  OS << "_";
@@ -2036,7 +3036,7 @@ namespace expr
 				  int depth,
 				  bool brkt,
 				  const std::string &name,
-				  const std::vector<ENode*> &args)
+				  const ENodeArgs &args)
 	{
 	  args [1]->Print (OS, depth, true);
 	  OS << "!";
@@ -2157,7 +3157,7 @@ namespace expr
 				  int depth,
 				  bool brkt,
 				  const std::string &name,
-				  const std::vector<ENode*> &args)	
+				  const ENodeArgs &args)	
 	{
 	  OS << "[" << name << " ";
 	  args[0]->Print (OS, depth+2, false);
@@ -2335,7 +3335,7 @@ namespace expr
 				  int depth, 
 				  int brkt,
 				  const std::string &name,
-				  const std::vector<ENode*> &args)
+				  const ENodeArgs &args)
 	{
 	  if (args.size () > 1) OS << "(";
 
@@ -2363,7 +3363,7 @@ namespace expr
         ExprVector _args;
         _args.reserve (fdecl->arity ());
         _args.push_back (name);
-        _args.insert (_args.end (), ++(fdecl->args_begin ()), fdecl->args_end ());
+        _args.insert (_args.end (), fdecl->args_begin () + 1, fdecl->args_end ());
         return mknary<FDECL> (_args);
       }
       
@@ -2377,7 +3377,7 @@ namespace expr
         ExprVector _args;
         _args.reserve (fapp->arity ());
         _args.push_back (fdecl);
-        _args.insert (_args.end (), ++(fapp->args_begin ()), fapp->args_end ());
+        _args.insert (_args.end (), fapp->args_begin () + 1, fapp->args_end ());
         return mknary<FAPP> (_args);
       }
       
@@ -2535,7 +3535,7 @@ namespace expr
                                   int depth,
                                   bool brkt,
                                   const std::string &name,
-                                  const std::vector<ENode*> &args)
+                                  const ENodeArgs &args)
         {
           OS << "(" << name << " ";
       
@@ -2576,7 +3576,7 @@ namespace expr
       {return rangeTy (decl (e, i));}
       
       
-      inline Expr body (Expr e) {return *(--(e->args_end ()));}
+      inline Expr body (Expr e) {return *(e->args_end () - 1);}
       
       
       template <typename Op, typename Range> 
@@ -2907,17 +3907,94 @@ namespace expr
     return dagVisit (rw, e);
   }
   
+  namespace
+  {
+    struct LessId
+    {
+      bool operator() (const ENode *x, const ENode *y) const
+      { return x->getId () < y->getId (); }
+    };
+  }
+
+  /**
+   * Returns the facts about e, computing them for e and all its
+   * sub-expressions if needed. Returns NULL if e contains a mutable
+   * node, since then they can change.
+   */
+  inline const ENodeMeta *getMeta (ENode *e)
+  {
+    const ENodeMeta *res = e->cachedMeta ();
+    if (res != NULL) return res;
+    if (e->isMutable ()) return NULL;
+
+    std::unique_ptr<ENodeMeta> m (new ENodeMeta ());
+    m->variants = isOpX<VARIANT> (e);
+
+    std::vector<const ENodeMeta*> kids;
+    for (ENode::args_iterator b = e->args_begin (), end = e->args_end ();
+	 b != end; ++b)
+      {
+	const ENodeMeta *k = getMeta (*b);
+	if (k == NULL) return NULL;
+	kids.push_back (k);
+	m->variants = m->variants || k->variants;
+	m->treeSize = k->treeSize > SIZE_MAX - m->treeSize ? 
+	  SIZE_MAX : m->treeSize + k->treeSize;
+      }
+
+    if (op::bind::IsConst () (e))
+      m->consts = std::make_shared<const std::vector<ENode*> > (1, e);
+    else
+      {
+	// -- reuse the largest set of the kids if it has everything
+	const ENodeMeta *big = NULL;
+	for (const ENodeMeta *k : kids)
+	  if (big == NULL || k->consts->size () > big->consts->size ()) big = k;
+
+	if (big == NULL)
+	  {
+	    static const std::shared_ptr<const std::vector<ENode*> > 
+	      empty = std::make_shared<const std::vector<ENode*> > ();
+	    m->consts = empty;
+	  }
+	else
+	  {
+	    std::vector<ENode*> all (*big->consts), tmp;
+	    for (const ENodeMeta *k : kids)
+	      {
+		if (k == big || k->consts == big->consts) continue;
+		tmp.clear ();
+		std::set_union (all.begin (), all.end (), 
+				k->consts->begin (), k->consts->end (),
+				std::back_inserter (tmp), LessId ());
+		all.swap (tmp);
+	      }
+	    if (all.size () == big->consts->size ()) m->consts = big->consts;
+	    else m->consts = std::make_shared<const std::vector<ENode*> > (std::move (all));
+	  }
+      }
+
+    return e->cacheMeta (m.release ());
+  }
+
   /** Size of an expression as a DAG */
   inline size_t dagSize (Expr e)
   {
+    const ENodeMeta *m = getMeta (e.get ());
+    if (m != NULL && m->dagSize.load () > 0) return m->dagSize.load ();
+
     SIZE sz;
     dagVisit (sz, e);
+    if (m != NULL) const_cast<ENodeMeta*> (m)->dagSize.store (sz.count);
     return sz.count;
   }
 
   /** Size of an expression as a tree */
   inline size_t treeSize (Expr e)
   {
+    const ENodeMeta *m = getMeta (e.get ());
+    if (m != NULL) return m->treeSize;
+
     SIZE sz;
     visit (sz, e);
     return sz.count;
@@ -2955,6 +4032,19 @@ namespace expr
     dagVisit (fv, exp);
   }
 
+  /**
+   * Constants of exp in the order of their ids. Same as 
+   * filter (exp, bind::IsConst (), out), but only the first call
+   * traverses exp.
+   */
+  template <typename OutputIterator>
+  void filterConsts (Expr exp, OutputIterator out)
+  {
+    const ENodeMeta *m = getMeta (exp.get ());
+    if (m == NULL) filter (exp, op::bind::IsConst (), out);
+    else for (ENode *c : *m->consts) *(out++) = Expr (c);
+  }
+
   // template <typename F>
   // void filter (Expr exp, F f, ExprSet &out)
   // {
@@ -3023,6 +4113,16 @@ namespace expr
   /** Returns true if e1 contains e2 as a sub-expression */
   inline bool contains (Expr e1, Expr e2)
   {
+    // -- a constant is found in the cached set, unless it can be 
+    // -- hidden under a VARIANT
+    if (op::bind::IsConst () (e2) && !isOpX<VARIANT> (e2))
+      {
+	const ENodeMeta *m = getMeta (e1.get ());
+	if (m != NULL && !m->variants)
+	  return std::binary_search (m->consts->begin (), m->consts->end (),
+				     e2.get (), LessId ());
+      }
+
     CV cv(e2);
     dagVisit (cv, e1);
     return cv.found;
@@ -33,6 +33,10 @@ DM-0002198
 
 #include <unordered_map>
 #include <unordered_set>
+#include <climits>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 
 #include <boost/range/algorithm/sort.hpp>
 #include <boost/range/algorithm/copy.hpp>
@@ -43,6 +47,7 @@ DM-0002198
 
 #include "ufo/Expr.hpp"
 #include "ufo/ExprInterp.hh"
+#include "ufo/Trace.hpp"
 
 namespace z3
 {
@@ -136,7 +141,10 @@ namespace ufo
     z3::context &ctx = z3.get_ctx ();
     z3::ast ast (z3.toAst (e));
 
-    return z3.toExpr (z3::ast (ctx, Z3_simplify (ctx, ast)));
+    // -- interruptible: fails (and throws) once the context is canceled
+    Z3_ast res = Z3_simplify (ctx, ast);
+    ctx.check_error ();
+    return z3.toExpr (z3::ast (ctx, res));
   }
 
   template <typename Z>
@@ -198,9 +206,11 @@ namespace ufo
   {
     z3::context &ctx = z3.get_ctx ();
 
-    z3::ast ast (ctx, Z3_parse_smtlib2_string (ctx, smt.c_str (),
-					       0, NULL, NULL, 0, NULL, NULL));
+    Z3_ast a = Z3_parse_smtlib2_string (ctx, smt.c_str (),
+					0, NULL, NULL, 0, NULL, NULL);
+    // -- a is NULL on parse errors
     ctx.check_error ();
+    z3::ast ast (ctx, a);
     return z3.toExpr (ast);
   }
 
@@ -208,9 +218,11 @@ namespace ufo
   Expr z3_from_smtlib_file (Z &z3, const char *fname)
   {
     z3::context &ctx = z3.get_ctx ();
-    z3::ast ast (ctx, Z3_parse_smtlib2_file (ctx, fname,
-                                             0, NULL, NULL, 0, NULL, NULL));
+    Z3_ast a = Z3_parse_smtlib2_file (ctx, fname,
+                                      0, NULL, NULL, 0, NULL, NULL);
+    // -- a is NULL on parse errors and missing files
     ctx.check_error ();
+    z3::ast ast (ctx, a);
     return z3.toExpr (ast);
   }
 
@@ -221,6 +233,8 @@ namespace ufo
   template <typename Z, typename M>
   Expr z3_qe_model_project_skolem (Z &z3, M &model, Expr v, Expr body, ExprMap &map)
     {
+        AE_TRACE (span, "z3.project");
+        AE_TRACE_ARG (span, "size", dagSize (body));
         z3::context &ctx = z3.get_ctx ();
         z3::ast b (ctx, z3.toAst (body));
         std::vector<Z3_app> bound;
@@ -235,11 +249,15 @@ namespace ufo
         z3::ast res (ctx,
                      Z3_qe_model_project_skolem (ctx, model.get_model (), bound.size (),
                                                  &bound [0], b, emap));
+        // -- interruptible, as z3_lite_simplify
+        ctx.check_error ();
         z3::ast_vector keys (emap.get_keys());
         for (unsigned i = 0; i < keys.size(); i++){
             map[z3.toExpr(keys[i])] = z3.toExpr(emap.find(keys[i]));
         }
-        return z3.toExpr (res);
+        Expr prj = z3.toExpr (res);
+        AE_TRACE_ARG (span, "result", dagSize (prj));
+        return prj;
     }
     
 }
@@ -268,6 +286,200 @@ namespace ufo
 
   using namespace boost;
 
+  /**
+   * Translation cache between Expr and z3::ast.
+   *
+   * Entries are keyed by raw ENode pointers and do not hold a
+   * reference to the expression. The cache is registered with the
+   * ExprFactory, and an entry is dropped (together with the Z3 ast it
+   * pins) as soon as its ENode is garbage collected. When the number
+   * of entries reaches the capacity, the cache is flushed.
+   *
+   * With a concurrent ExprFactory, nodes may be collected by other
+   * threads, while Z3 asts may only be released by the owner of the
+   * context. In that case the cache is not registered and holds a
+   * reference to every key until it is flushed.
+   */
+  class ZTransCache : boost::noncopyable
+  {
+  private:
+    typedef bimap< bimaps::unordered_set_of<ENode*>,
+		   bimaps::unordered_set_of<z3::ast,
+					    z3::ast_ptr_hash,
+					    z3::ast_ptr_equal_to> > cache_type;
+
+    typedef cache_type::left_map::const_iterator left_iterator;
+    typedef cache_type::right_map::const_iterator right_iterator;
+
+  public:
+    struct Stats
+    {
+      unsigned long hits;
+      unsigned long misses;
+      unsigned long inserts;
+      /** entries dropped because their ENode died */
+      unsigned long evictions;
+      /** number of times the cache was emptied due to the capacity */
+      unsigned long flushes;
+      size_t peak;
+
+      Stats () : hits(0), misses(0), inserts(0),
+		 evictions(0), flushes(0), peak(0) {}
+
+      template <typename OutputStream>
+      void print (OutputStream &out) const
+      {
+	out << "marshal cache: hits " << hits << ", misses " << misses
+	    << ", inserts " << inserts << ", evictions " << evictions
+	    << ", flushes " << flushes << ", peak " << peak << "\n";
+      }
+    };
+
+  private:
+    ExprFactory &efac;
+    cache_type cache;
+    size_t capacity;
+    Stats stats;
+    /** keys are referenced by the cache */
+    bool pinned;
+
+    void flush ()
+    {
+      if (!pinned) { cache.clear (); return; }
+
+      std::vector<ENode*> keys;
+      for (auto &kv : cache.left) keys.push_back (kv.first);
+      cache.clear ();
+      for (ENode *n : keys) efac.Deref (n);
+    }
+
+    void insert (ENode *n, const z3::ast &a)
+    {
+      if (capacity > 0 && cache.size () >= capacity)
+      {
+	flush ();
+	stats.flushes++;
+      }
+
+      if (cache.insert (cache_type::value_type (n, a)).second)
+      {
+	if (pinned) n->Ref ();
+	stats.inserts++;
+	if (cache.size () > stats.peak) stats.peak = cache.size ();
+      }
+    }
+
+  public:
+    /** Expr -> z3::ast view used by the marshaler */
+    class ExprView
+    {
+      ZTransCache &m_c;
+    public:
+      typedef left_iterator const_iterator;
+
+      ExprView (ZTransCache &c) : m_c (c) {}
+
+      const_iterator find (Expr e)
+      {
+	const_iterator it = m_c.cache.left.find (e.get ());
+	if (it != m_c.cache.left.end ()) m_c.stats.hits++;
+	else m_c.stats.misses++;
+	return it;
+      }
+      const_iterator end () const { return m_c.cache.left.end (); }
+      void insert (Expr e, const z3::ast &a) { m_c.insert (e.get (), a); }
+    };
+
+    /** z3::ast -> Expr view used by the unmarshaler */
+    class AstView
+    {
+      ZTransCache &m_c;
+    public:
+      typedef right_iterator const_iterator;
+
+      AstView (ZTransCache &c) : m_c (c) {}
+
+      const_iterator find (const z3::ast &a)
+      {
+	const_iterator it = m_c.cache.right.find (a);
+	if (it != m_c.cache.right.end ()) m_c.stats.hits++;
+	else m_c.stats.misses++;
+	return it;
+      }
+      const_iterator end () const { return m_c.cache.right.end (); }
+      void insert (const z3::ast &a, Expr e) { m_c.insert (e.get (), a); }
+    };
+
+    ZTransCache (ExprFactory &ef, size_t c = 1 << 20) :
+      efac (ef), capacity (c), pinned (ef.isConcurrent ())
+    { if (!pinned) efac.registerCache (*this); }
+
+    ~ZTransCache ()
+    {
+      if (!pinned) efac.unregisterCache (*this);
+      flush ();
+    }
+
+    /** called by the ExprFactory when n is garbage collected */
+    void erase (ENode *n)
+    {
+      if (cache.left.erase (n) > 0) stats.evictions++;
+    }
+
+    void clear () { flush (); }
+    size_t size () const { return cache.size (); }
+
+    size_t getCapacity () const { return capacity; }
+    /** 0 means unbounded */
+    void setCapacity (size_t c) { capacity = c; }
+
+    const Stats &getStats () const { return stats; }
+
+    ExprView left () { return ExprView (*this); }
+    AstView right () { return AstView (*this); }
+  };
+
+  /**
+   * Cancellation token.
+   *
+   * Contexts attached to the token are interrupted (Z3_interrupt) when
+   * cancel() is called, possibly from another thread. Queries started
+   * after cancellation return unknown.
+   */
+  class ZCancelToken : boost::noncopyable
+  {
+  private:
+    std::atomic<bool> m_cancelled;
+    std::mutex m_mutex;
+    std::vector<Z3_context> m_ctxs;
+
+  public:
+    ZCancelToken () : m_cancelled (false) {}
+
+    void attach (Z3_context c)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_ctxs.push_back (c);
+      if (m_cancelled) Z3_interrupt (c);
+    }
+
+    void detach (Z3_context c)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_ctxs.erase (std::remove (m_ctxs.begin (), m_ctxs.end (), c),
+                    m_ctxs.end ());
+    }
+
+    void cancel ()
+    {
+      m_cancelled = true;
+      std::lock_guard<std::mutex> lock (m_mutex);
+      for (Z3_context c : m_ctxs) Z3_interrupt (c);
+    }
+
+    bool isCancelled () const { return m_cancelled; }
+  };
+
   /**
    * AST manager. Responsible for converting between Z3 ast and Expr.
    *
@@ -280,15 +492,14 @@ namespace ufo
   private:
     typedef ZContext<M,U> this_type;
     typedef ZModel<this_type> this_model_type;
-    typedef bimap< bimaps::unordered_set_of<Expr>,
-		   bimaps::unordered_set_of<z3::ast,
-					    z3::ast_ptr_hash,
-					    z3::ast_ptr_equal_to> > cache_type;
 
     ExprFactory& efac;
     z3::context ctx;
 
-    cache_type cache;
+    /** must be declared after ctx so that cached asts die first */
+    ZTransCache cache;
+
+    ZCancelToken *cancelToken;
 
     void init ()
     {
@@ -301,23 +512,28 @@ namespace ufo
     z3::ast toAst (Expr e)
     {
       expr_ast_map seen;
-      return M::marshal (e, get_ctx (), cache.left, seen);
+      ZTransCache::ExprView c (cache.left ());
+      return M::marshal (e, get_ctx (), c, seen);
     }
     Expr toExpr (z3::ast a)
     {
       if (!a) return Expr();
 
       ast_expr_map seen;
-      return U::unmarshal (a, get_efac (), cache.right, seen);
+      ZTransCache::AstView c (cache.right ());
+      return U::unmarshal (a, get_efac (), c, seen);
     }
 
     ExprFactory &get_efac () { return efac; }
 
     typedef std::unordered_set<Z3_func_decl> Z3_func_decl_set;
 
-    void allDecls (Z3_ast a, Z3_func_decl_set &seen)
+    /** uninterpreted decls of a; each node of the DAG is visited once */
+    void allDecls (Z3_ast a, Z3_func_decl_set &seen,
+                   std::unordered_set<Z3_ast> &visited)
     {
       if (Z3_get_ast_kind (ctx, a) != Z3_APP_AST) return;
+      if (!visited.insert (a).second) return;
 
       Z3_app app = Z3_to_app (ctx, a);
       Z3_func_decl fdecl = Z3_get_app_decl (ctx, app);
@@ -327,16 +543,44 @@ namespace ufo
 	seen.insert (fdecl);
 
       for (unsigned i = 0; i < Z3_get_app_num_args (ctx, app); i++)
-	allDecls (Z3_get_app_arg (ctx, app, i), seen);
+	allDecls (Z3_get_app_arg (ctx, app, i), seen, visited);
     }
 
 
   public:
 
-    ZContext (ExprFactory &ef) : efac(ef) { init (); }
-    ZContext (ExprFactory &ef, z3::config &c) : efac (ef), ctx(c) { init (); }
+    ZContext (ExprFactory &ef) :
+      efac(ef), cache (ef), cancelToken (nullptr) { init (); }
+    ZContext (ExprFactory &ef, z3::config &c) :
+      efac (ef), ctx(c), cache (ef), cancelToken (nullptr) { init (); }
+
+    ~ZContext ()
+    {
+      setCancelToken (nullptr);
+      cache.clear ();
+    }
+
+    /** attach the context to a cancellation token (nullptr to detach) */
+    void setCancelToken (ZCancelToken *t)
+    {
+      if (cancelToken) cancelToken->detach (ctx);
+      cancelToken = t;
+      if (cancelToken) cancelToken->attach (ctx);
+    }
+
+    bool isCancelled () const
+    { return cancelToken && cancelToken->isCancelled (); }
 
-    ~ZContext () { cache.clear (); }
+    /** interrupt a running query. Can be called from another thread */
+    void interrupt () { Z3_interrupt (ctx); }
+
+    /** statistics of the Expr <-> z3::ast translation cache */
+    const ZTransCache::Stats &getCacheStats () const
+    { return cache.getStats (); }
+    size_t getCacheSize () const { return cache.size (); }
+    /** maximal number of cached translations; 0 means unbounded */
+    void setCacheCapacity (size_t c) { cache.setCapacity (c); }
+    void clearCache () { cache.clear (); }
 
     template <typename V>
     void set (char const *p, V v) { ctx.set (p, v); }
@@ -348,8 +592,9 @@ namespace ufo
     {
       std::ostringstream out;
       Z3_func_decl_set seen;
+      std::unordered_set<Z3_ast> visited;
       z3::ast a (toAst (e));
-      allDecls (static_cast<Z3_ast>(a), seen);
+      allDecls (static_cast<Z3_ast>(a), seen, visited);
       for (Z3_func_decl fdecl : seen)
 	out << Z3_func_decl_to_string (ctx, fdecl) << "\n";
       return out.str ();
@@ -425,6 +670,17 @@ namespace ufo
       Expr res = mdl::fentry (args, z3.toExpr (zval));
       return res;
     }
+
+    /** converts a value returned by the model to Expr */
+    Expr valueToExpr (const z3::ast &val)
+    {
+      if (!isAsArray (val)) return z3.toExpr (val);
+
+      Z3_func_decl fdecl = Z3_get_as_array_func_decl (ctx, val);
+      z3::func_interp zfunc (ctx, Z3_model_get_func_interp (ctx, model, fdecl));
+      ctx.check_error ();
+      return finterpToExpr (zfunc);
+    }
     
     
 
@@ -470,18 +726,62 @@ namespace ufo
       {
         z3::ast val (ctx, raw_val);
         ctx.check_error ();
-        if (!isAsArray (val)) return z3.toExpr (val);
-          
-          
-        Z3_func_decl fdecl = Z3_get_as_array_func_decl (ctx, val);
-        z3::func_interp zfunc (ctx, Z3_model_get_func_interp (ctx, model, fdecl));
-        ctx.check_error ();
-        return finterpToExpr (zfunc);
+        return valueToExpr (val);
       }
       ctx.check_error ();
       return mk<NONDET> (efac);
     }
 
+    /**
+     * Interpretations of all constants defined by the model, keyed by
+     * the constant.
+     */
+    void getConstInterps (ExprMap &out)
+    {
+      assert (model);
+      for (unsigned i = 0, sz = Z3_model_get_num_consts (ctx, model); i < sz; ++i)
+      {
+        Z3_func_decl fdecl = Z3_model_get_const_decl (ctx, model, i);
+        Z3_ast raw_val = Z3_model_get_const_interp (ctx, model, fdecl);
+        if (!raw_val) continue;
+
+        z3::ast c (ctx, Z3_mk_app (ctx, fdecl, 0, nullptr));
+        z3::ast val (ctx, raw_val);
+        out [z3.toExpr (c)] = valueToExpr (val);
+      }
+      ctx.check_error ();
+    }
+
+    /**
+     * Evaluates every expression of rng. Constant interpretations are
+     * extracted from the model once, and only the remaining
+     * expressions go through eval().
+     */
+    template <typename Range>
+    void evalAll (const Range &rng, ExprMap &out, bool completion = false)
+    {
+      ExprMap consts;
+      getConstInterps (consts);
+      for (const Expr &e : rng)
+      {
+        ExprMap::const_iterator it = consts.find (e);
+        out [e] = it != consts.end () ? it->second : eval (e, completion);
+      }
+    }
+
+    /** same as above, the i-th result corresponds to the i-th element */
+    template <typename Range>
+    void evalAll (const Range &rng, ExprVector &out, bool completion = false)
+    {
+      ExprMap consts;
+      getConstInterps (consts);
+      for (const Expr &e : rng)
+      {
+        ExprMap::const_iterator it = consts.find (e);
+        out.push_back (it != consts.end () ? it->second : eval (e, completion));
+      }
+    }
+
     ExprFactory &getExprFactory () { return z3.getExprFactory (); }
     Expr operator() (Expr e) { return eval (e); }
 
@@ -518,6 +818,11 @@ namespace ufo
     void set (char const * k, char const *v )
     { params.set (k, ctx.str_symbol (v)); }
 
+    /** per-query timeout in milliseconds, 0 is no limit */
+    void setTimeout (unsigned ms) { set ("timeout", ms ? ms : UINT_MAX); }
+    /** per-query resource limit, 0 is no limit */
+    void setRlimit (unsigned r) { set ("rlimit", r); }
+
     operator z3::params () const { return params; }
     operator Z3_params () const { return static_cast<Z3_params> (params); }
 
@@ -533,19 +838,49 @@ namespace ufo
     z3::solver solver;
     ExprFactory &efac;
 
+    unsigned timeout;
+    unsigned rlimit;
+
+    void applyLimits (unsigned t, unsigned r)
+    {
+      ZParams<Z> p (z3);
+      p.setTimeout (t);
+      p.setRlimit (r);
+      set (p);
+    }
+
   public:
     typedef ZSolver<Z> this_type;
     typedef ZModel<Z> Model;
 
     ZSolver (Z &z) :
-      z3(z), ctx (z.get_ctx ()), solver (z.get_ctx ()), efac (z.get_efac ()) {}
+      z3(z), ctx (z.get_ctx ()), solver (z.get_ctx ()), efac (z.get_efac ()),
+      timeout (0), rlimit (0) {}
 
     ZSolver (Z &z, const char *logic) :
-      z3(z), ctx (z.get_ctx ()), solver (z.get_ctx (), logic), efac (z.get_efac ()) {}
+      z3(z), ctx (z.get_ctx ()), solver (z.get_ctx (), logic), efac (z.get_efac ()),
+      timeout (0), rlimit (0) {}
 
     Z& getContext () {return z3;}
     void set (const ZParams<Z> &p) { solver.set (p); }
 
+    /**
+     * Limits of every subsequent query (timeout in ms and Z3 resource
+     * limit). 0 means no limit.
+     */
+    void setLimits (unsigned t, unsigned r = 0)
+    {
+      timeout = t;
+      rlimit = r;
+      applyLimits (timeout, rlimit);
+    }
+    unsigned getTimeout () const { return timeout; }
+    unsigned getRlimit () const { return rlimit; }
+
+    /** explanation of the last unknown result */
+    std::string reasonUnknown () const
+    { return Z3_solver_get_reason_unknown (ctx, solver); }
+
     template <typename OutputStream>
     OutputStream &toSmtLib (OutputStream &out)
     {
@@ -597,6 +932,17 @@ namespace ufo
       ctx.check_error ();
     }
 
+    /// number of assertions currently in the solver
+    unsigned assertionCount () const
+    {
+      z3::ast_vector r (ctx, Z3_solver_get_assertions (ctx, solver));
+      ctx.check_error ();
+      return r.size ();
+    }
+
+    static const char *resultName (boost::tribool res)
+    { return boost::indeterminate (res) ? "unknown" : res ? "sat" : "unsat"; }
+
     /// return assertions currently in the solver
     template <typename OutputIterator>
     void assertions (OutputIterator out) const
@@ -610,8 +956,25 @@ namespace ufo
 
     boost::tribool solve ()
     {
+      if (z3.isCancelled ()) return boost::indeterminate;
+
+      AE_TRACE (span, "z3.solve");
+      AE_TRACE_ARG (span, "asserts", assertionCount ());
       boost::tribool res = z3l_to_tribool (Z3_solver_check (ctx, solver));
       ctx.check_error ();
+      AE_TRACE_ARG (span, "result", resultName (res));
+      return res;
+    }
+
+    /**
+     * Solve with limits that apply to this call only. The limits set by
+     * setLimits() are restored afterwards.
+     */
+    boost::tribool solve (unsigned t, unsigned r)
+    {
+      applyLimits (t, r);
+      boost::tribool res = solve ();
+      applyLimits (timeout, rlimit);
       return res;
     }
 
@@ -621,15 +984,21 @@ namespace ufo
       z3::ast_vector av (ctx);
       for (Expr a : lits) av.push_back (z3.toAst (a));
 
+      if (z3.isCancelled ()) return boost::indeterminate;
+
       std::vector<Z3_ast> raw_av (av.size ());
       for (unsigned i = 0; i < av.size (); ++i)
 	raw_av [i] = Z3_ast_vector_get (ctx, av, i);
 
+      AE_TRACE (span, "z3.solve");
+      AE_TRACE_ARG (span, "asserts", assertionCount ());
+      AE_TRACE_ARG (span, "assumptions", raw_av.size ());
       boost::tribool res =
 	z3l_to_tribool (Z3_solver_check_assumptions (ctx, solver,
 						     raw_av.size (),
 						     &raw_av[0]));
       ctx.check_error ();
+      AE_TRACE_ARG (span, "result", resultName (res));
       return res;
     }
 
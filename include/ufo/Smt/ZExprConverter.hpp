@@ -218,7 +218,7 @@ namespace ufo
 	  pinned_args.resize (e->arity ());
 
 	  unsigned pos = 0;
-	  for (ENode::args_iterator it = ++ (e->args_begin ()),
+	  for (ENode::args_iterator it = e->args_begin () + 1,
 		 end = e->args_end (); it != end; ++it)
 	    {
 	      z3::ast a (marshal (*it, ctx, cache, seen));
@@ -260,7 +260,7 @@ namespace ufo
       if (res)
 	{
 	  z3::ast ast (ctx, res);
-	  cache.insert (typename C::value_type (e, ast));
+	  cache.insert (e, ast);
 	  return ast;
 	}
 
@@ -503,6 +503,8 @@ namespace ufo
       assert (res != NULL);
       z3::ast final (ctx, res);
       seen.insert (expr_ast_map::value_type (e, final));
+      // -- keep composite terms too so that re-marshaling is a lookup
+      cache.insert (e, final);
 
       return final;
 
@@ -740,7 +742,7 @@ namespace ufo
 	  Expr res = bind::fapp (unmarshal (z3::func_decl (ctx, fdecl),
 					    efac, cache, seen), args);
 	  // -- XXX maybe use seen instead. not sure what is best.
-	  cache.insert (typename C::value_type (z, res));
+	  cache.insert (z, res);
 	  return res;
 	}
 
@@ -898,6 +900,7 @@ namespace ufo
 	}
 
       seen [z] = e;
+      cache.insert (z, e);
       return e;
     }
 
@@ -0,0 +1,194 @@
+#ifndef UFO_STATS__HPP__
+#define UFO_STATS__HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ufo/Trace.hpp"
+
+/**
+ * Scoped timers and counters of a run. They are recorded in the Stats
+ * that is current in the thread (see StatsScope), and nowhere if there
+ * is none. The macros compile to nothing, without evaluating their
+ * arguments, unless AEVAL_STATS is defined:
+ *
+ *   AE_TIMER ("name")      times the rest of the scope
+ *   AE_COUNT ("name")      adds 1 to a counter
+ *   AE_ADD ("name", n)     adds n to a counter
+ *   AE_VALUE ("name", n)   records a sample, e.g. a size
+ *
+ * Each call site looks its name up once. Sites with the same name
+ * share their entry. Timers are also spans of the trace, if it is
+ * recorded (see ufo/Trace.hpp).
+ */
+namespace ufo
+{
+  class Stats
+  {
+  public:
+    enum Kind { TIMER, COUNTER, VALUE };
+
+    struct Entry
+    {
+      unsigned long count;
+      double sum;           // ms for timers
+      double max;
+
+      Entry () : count(0), sum(0), max(0) {}
+    };
+
+  private:
+    std::vector<Entry> entries;   // by id
+
+    struct Name { std::string name; Kind kind; };
+
+    static std::mutex &namesLock () { static std::mutex m; return m; }
+    static std::vector<Name> &names () { static std::vector<Name> n; return n; }
+
+    Entry &get (unsigned id)
+    {
+      if (id >= entries.size ()) entries.resize (id + 1);
+      return entries [id];
+    }
+
+    template <typename OutputStream>
+    static void printJsonKey (OutputStream &out, const std::string &s)
+    {
+      out << "\"";
+      for (char c : s)
+      {
+        if (c == '"' || c == '\\') out << '\\';
+        out << c;
+      }
+      out << "\": ";
+    }
+
+  public:
+    /** id of name, the same for all its call sites */
+    static unsigned id (const char *name, Kind kind)
+    {
+      std::lock_guard<std::mutex> lock (namesLock ());
+      std::vector<Name> &n = names ();
+      for (unsigned i = 0; i < n.size (); i++)
+        if (n [i].name == name) return i;
+      n.push_back (Name {name, kind});
+      return n.size () - 1;
+    }
+
+    /** the Stats of the thread, if any */
+    static Stats *&current ()
+    {
+      static thread_local Stats *cur = NULL;
+      return cur;
+    }
+
+    static void add (unsigned id, double v)
+    {
+      Stats *st = current ();
+      if (st == NULL) return;
+      Entry &e = st->get (id);
+      e.count++;
+      e.sum += v;
+      if (v > e.max) e.max = v;
+    }
+
+    void clear () { entries.clear (); }
+
+    /**
+     * As JSON members "timers" (count and ms), "counters" and "values"
+     * (count, sum and max), sorted by name
+     */
+    template <typename OutputStream>
+    void printJson (OutputStream &out) const
+    {
+      std::vector<std::pair<std::string, unsigned> > byName;
+      std::vector<Kind> kinds;
+      {
+        std::lock_guard<std::mutex> lock (namesLock ());
+        for (unsigned i = 0; i < entries.size (); i++)
+          if (entries [i].count > 0) byName.push_back (std::make_pair (names () [i].name, i));
+        for (auto &n : names ()) kinds.push_back (n.kind);
+      }
+      std::sort (byName.begin (), byName.end ());
+
+      const char *groups [] = {"timers", "counters", "values"};
+      for (int k = TIMER; k <= VALUE; k++)
+      {
+        if (k != TIMER) out << ", ";
+        out << "\"" << groups [k] << "\": {";
+        bool first = true;
+        for (auto &n : byName)
+        {
+          if (kinds [n.second] != k) continue;
+          const Entry &e = entries [n.second];
+          if (!first) out << ", ";
+          first = false;
+          printJsonKey (out, n.first);
+          if (k == TIMER)
+            out << "{\"count\": " << e.count << ", \"ms\": " << e.sum << "}";
+          else if (k == COUNTER)
+            out << (unsigned long) e.sum;
+          else
+            out << "{\"count\": " << e.count << ", \"sum\": " << e.sum
+                << ", \"max\": " << e.max << "}";
+        }
+        out << "}";
+      }
+    }
+  };
+
+  /** Makes st the Stats of the thread while it is in scope */
+  class StatsScope
+  {
+    Stats *prev;
+
+  public:
+    explicit StatsScope (Stats &st) : prev (Stats::current ()) { Stats::current () = &st; }
+    ~StatsScope () { Stats::current () = prev; }
+  };
+
+  /** Adds the time until its destruction to a timer */
+  class StatsTimer
+  {
+    unsigned id;
+    bool on;
+    std::chrono::steady_clock::time_point start;
+    TraceSpan span;
+
+  public:
+    StatsTimer (unsigned _id, const char *name) :
+      id (_id), on (Stats::current () != NULL), span (name)
+    {
+      if (on) start = std::chrono::steady_clock::now ();
+    }
+
+    ~StatsTimer ()
+    {
+      if (on)
+        Stats::add (id, std::chrono::duration<double, std::milli> (
+                          std::chrono::steady_clock::now () - start).count ());
+    }
+  };
+}
+
+#ifdef AEVAL_STATS
+#define AE_STATS_CAT2(a, b) a##b
+#define AE_STATS_CAT(a, b) AE_STATS_CAT2 (a, b)
+#define AE_STATS_ID(name, kind) \
+  ([] () -> unsigned { static const unsigned id = ufo::Stats::id (name, kind); return id; } ())
+#define AE_TIMER(name) \
+  ufo::StatsTimer AE_STATS_CAT (aeStatsTimer, __LINE__) \
+    (AE_STATS_ID (name, ufo::Stats::TIMER), name)
+#define AE_ADD(name, n) ufo::Stats::add (AE_STATS_ID (name, ufo::Stats::COUNTER), (n))
+#define AE_COUNT(name) AE_ADD (name, 1)
+#define AE_VALUE(name, n) ufo::Stats::add (AE_STATS_ID (name, ufo::Stats::VALUE), (n))
+#else
+#define AE_TIMER(name)
+#define AE_ADD(name, n)
+#define AE_COUNT(name)
+#define AE_VALUE(name, n)
+#endif
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef UFO_TRACE__HPP__
+#define UFO_TRACE__HPP__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A timeline of a process, written in the Chrome trace format (see
+ * chrome://tracing or https://ui.perfetto.dev). Nothing is recorded
+ * until Trace::start (). Each thread appends the spans it completes to
+ * a buffer of its own, without locking; the buffer is registered once,
+ * at the first span of the thread. Trace::write () reads all buffers,
+ * so it is called when no other thread records spans.
+ *
+ * The macros compile to nothing, without evaluating their arguments,
+ * unless AEVAL_STATS is defined:
+ *
+ *   AE_TRACE (span, "name")          records the rest of the scope
+ *   AE_TRACE_ARG (span, "key", v)    adds a payload to it, a number or
+ *                                    a string, evaluated if recording
+ *
+ * AE_TIMER (see ufo/Stats.hpp) records its scope as well.
+ */
+namespace ufo
+{
+  class Trace
+  {
+  public:
+    struct Arg
+    {
+      const char *key;
+      bool isStr;
+      double num;
+      std::string str;
+    };
+
+    struct Event
+    {
+      const char *name;     // a literal
+      double ts;            // us since start ()
+      double dur;           // us
+      std::vector<Arg> args;
+    };
+
+  private:
+    struct Buffer
+    {
+      unsigned tid;
+      std::vector<Event> events;
+    };
+
+    static std::atomic<bool> &enabled () { static std::atomic<bool> e (false); return e; }
+
+    static std::chrono::steady_clock::time_point &epoch ()
+    {
+      static std::chrono::steady_clock::time_point e;
+      return e;
+    }
+
+    static std::mutex &buffersLock () { static std::mutex m; return m; }
+    static std::vector<std::unique_ptr<Buffer> > &buffers ()
+    {
+      static std::vector<std::unique_ptr<Buffer> > b;
+      return b;
+    }
+
+    /** the buffer of the thread; outlives it, so that write () sees it */
+    static Buffer &buffer ()
+    {
+      static thread_local Buffer *buf = NULL;
+      if (buf == NULL)
+      {
+        std::lock_guard<std::mutex> lock (buffersLock ());
+        buffers ().push_back (std::unique_ptr<Buffer> (new Buffer ()));
+        buf = buffers ().back ().get ();
+        buf->tid = buffers ().size ();
+      }
+      return *buf;
+    }
+
+    template <typename OutputStream>
+    static void printJsonStr (OutputStream &out, const std::string &s)
+    {
+      out << "\"";
+      for (char c : s)
+      {
+        if (c == '"' || c == '\\') out << '\\' << c;
+        else if ((unsigned char) c < 0x20) out << ' ';
+        else out << c;
+      }
+      out << "\"";
+    }
+
+  public:
+    static bool on () { return enabled ().load (std::memory_order_relaxed); }
+
+    /** starts recording; timestamps are relative to this call */
+    static void start ()
+    {
+      epoch () = std::chrono::steady_clock::now ();
+      enabled () = true;
+    }
+
+    static void stop () { enabled () = false; }
+
+    static double now ()
+    {
+      return std::chrono::duration<double, std::micro> (
+        std::chrono::steady_clock::now () - epoch ()).count ();
+    }
+
+    static void record (Event &&e) { buffer ().events.push_back (std::move (e)); }
+
+    /** all spans recorded so far, as a JSON object with "traceEvents" */
+    template <typename OutputStream>
+    static void write (OutputStream &out)
+    {
+      std::lock_guard<std::mutex> lock (buffersLock ());
+      out << "{\"traceEvents\": [";
+      bool first = true;
+      for (auto &b : buffers ())
+      {
+        if (!first) out << ",";
+        first = false;
+        out << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+            << b->tid << ", \"args\": {\"name\": \"thread " << b->tid << "\"}}";
+        for (const Event &e : b->events)
+        {
+          out << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"aeval\", \"ph\": \"X\", "
+              << "\"ts\": " << (unsigned long) e.ts << ", \"dur\": " << (unsigned long) e.dur
+              << ", \"pid\": 1, \"tid\": " << b->tid;
+          if (!e.args.empty ())
+          {
+            out << ", \"args\": {";
+            for (unsigned i = 0; i < e.args.size (); i++)
+            {
+              if (i > 0) out << ", ";
+              out << "\"" << e.args [i].key << "\": ";
+              if (e.args [i].isStr) printJsonStr (out, e.args [i].str);
+              else out << e.args [i].num;
+            }
+            out << "}";
+          }
+          out << "}";
+        }
+      }
+      out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+  };
+
+  /** Records a span from its construction to its destruction */
+  class TraceSpan
+  {
+    bool active;
+    Trace::Event e;
+
+  public:
+    explicit TraceSpan (const char *name) : active (Trace::on ())
+    {
+      if (!active) return;
+      e.name = name;
+      e.ts = Trace::now ();
+    }
+
+    ~TraceSpan ()
+    {
+      if (!active) return;
+      e.dur = Trace::now () - e.ts;
+      Trace::record (std::move (e));
+    }
+
+    bool isActive () const { return active; }
+
+    void arg (const char *key, double v) { e.args.push_back (Trace::Arg {key, false, v, ""}); }
+    void arg (const char *key, const std::string &v)
+    { e.args.push_back (Trace::Arg {key, true, 0, v}); }
+    void arg (const char *key, const char *v) { arg (key, std::string (v)); }
+  };
+}
+
+#ifdef AEVAL_STATS
+#define AE_TRACE(span, name) ufo::TraceSpan span (name)
+#define AE_TRACE_ARG(span, key, v) do { if (span.isActive ()) span.arg (key, v); } while (0)
+#else
+#define AE_TRACE(span, name)
+#define AE_TRACE_ARG(span, key, v)
+#endif
+
+#endif
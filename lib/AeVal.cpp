@@ -0,0 +1,338 @@
+#include <chrono>
+#include "ae/AeVal.hpp"
+#include "ae/AeValSolver.hpp"
+
+using namespace ufo;
+
+namespace
+{
+  double msSince (std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration<double, std::milli> (
+      std::chrono::steady_clock::now () - start).count ();
+  }
+
+  /** the context of a run, with the cancel token of its limits */
+  class RunZ3
+  {
+    std::unique_ptr<EZ3> own;
+    EZ3 &z3;
+    ZTransCache::Stats before;   // of the cache, if the context is reused
+
+  public:
+    RunZ3 (ExprFactory &efac, EZ3 *_z3, const AeValLimits &lim) :
+      own (_z3 ? NULL : new EZ3 (efac)), z3 (_z3 ? *_z3 : *own),
+      before (z3.getCacheStats ())
+    {
+      z3.setCancelToken (lim.cancel);
+    }
+
+    ~RunZ3 () { z3.setCancelToken (NULL); }
+
+    EZ3 &get () { return z3; }
+
+    /** the statistics of the cache in this run */
+    ZTransCache::Stats cacheStats () const
+    {
+      ZTransCache::Stats st = z3.getCacheStats ();
+      st.hits -= before.hits;
+      st.misses -= before.misses;
+      st.inserts -= before.inserts;
+      st.evictions -= before.evictions;
+      st.flushes -= before.flushes;
+      return st;
+    }
+  };
+
+  void printQuery (Expr s, Expr t, const ExprSet &v)
+  {
+    if (s != NULL) outs () << "S: " << *s << "\n";
+    outs () << "T: \\exists ";
+    for (auto &a : v) outs () << *a << ", ";
+    outs () << *t << "\n";
+  }
+
+  bool canceled (const AeValOptions &opts)
+  {
+    return opts.lim.cancel != NULL && opts.lim.cancel->isCancelled ();
+  }
+
+  /**
+   * Decides validity with ae, and fills res with what opts asks for;
+   * returns the verdict of ae.solve (), which is true if invalid. A run
+   * canceled before it is done is unknown, whatever it got to.
+   */
+  boost::tribool run (AeValSolver &ae, const AeValOptions &opts, bool skol,
+                      AeValResult &res)
+  {
+    ae.setLimits (opts.lim.timeout, opts.lim.rlimit);
+    ae.setNativeMbp (opts.lim.nativeMbp);
+
+    auto start = std::chrono::steady_clock::now ();
+    double *phase = &res.stats.solveTime;
+    boost::tribool r = boost::indeterminate;
+    try
+    {
+      r = ae.solve ();
+      if (skol && !boost::indeterminate (r) && !r)
+      {
+        *phase += msSince (start);
+        start = std::chrono::steady_clock::now ();
+        phase = &res.stats.skolemTime;
+        res.skolem = ae.getSkolemFunction (opts.compact);
+      }
+    }
+    catch (z3::exception &)
+    {
+      // -- the Z3 calls that are not queries fail once interrupted
+      if (!canceled (opts)) throw;
+    }
+    *phase += msSince (start);
+
+    if (canceled (opts)) r = boost::indeterminate;
+
+    if (boost::indeterminate (r))
+    {
+      res.verdict = AEVAL_UNKNOWN;
+      res.reasonUnknown = canceled (opts) ? "canceled" : ae.getReasonUnknown ();
+      res.skolem = NULL;
+    }
+    else if (r)
+      res.verdict = AEVAL_INVALID;
+    else
+      res.verdict = AEVAL_VALID;
+    return r;
+  }
+
+  void getCounterexample (AeValSolver &ae, AeValResult &res)
+  {
+    ae.getModelNeg (res.model);
+    res.validSubset = ae.getValidSubset ();
+  }
+
+  /**
+   * Sets the nodes created by the run and the statistics of its cache,
+   * and adds the statistics that are not recorded as they go to the
+   * current Stats
+   */
+  void finish (AeValResult &res, ExprFactory &efac, unsigned created, const RunZ3 &rz3)
+  {
+    AeValStats &st = res.stats;
+    st.nodes = efac.getCreatedNodes () - created;
+    st.cache = rz3.cacheStats ();
+    AE_ADD ("expr.created", st.nodes);
+    AE_ADD ("marshal.hits", st.cache.hits);
+    AE_ADD ("marshal.misses", st.cache.misses);
+    AE_ADD ("mbp.native", st.mbpNative);
+    AE_ADD ("mbp.z3", st.mbpFallback);
+  }
+
+  AeValResult solveAllInclusive (Expr s, Expr t, ExprSet &v, const AeValOptions &opts,
+                                 EZ3 &z3)
+  {
+    AeValResult res;
+    Expr t_init = t;
+    ExprVector skolems;
+    while (true)
+    {
+      AE_COUNT ("allinclusive.rounds");
+      AeValSolver ae (s, t, v, opts.debug, true, &z3);
+      boost::tribool r = run (ae, opts, true, res);
+      if (skolems.empty ()) res.partitions = ae.getPartitions ();
+      ae.getStats (res.stats);
+
+      if (boost::indeterminate (r))
+      {
+        res.skolem = NULL;
+        return res;
+      }
+      if (r)
+      {
+        if (!skolems.empty ()) break;
+        getCounterexample (ae, res);
+        return res;
+      }
+      skolems.push_back (res.skolem);
+      t = mk<AND>(t, mk<NEG>(ae.getSkolemConstraints (0)));
+    }
+
+    Expr skol = skolems.back ();
+    if (skolems.size () > 1)
+    {
+      Expr varName = mkTerm <std::string> ("_aeval_tmp_rnd", s->getFactory ());
+      Expr var = bind::intConst (varName);
+      for (int i = skolems.size () - 2; i >= 0; i--)
+      {
+        skol = mk<ITE>(mk<EQ>(var, mkTerm (mpz_class (i), s->getFactory ())),
+                       skolems [i], skol);
+      }
+    }
+    if (opts.debug)
+    {
+      SMTUtils u (s->getFactory (), &z3);
+      outs () << "Sanity check [all-inclusive]: " <<
+        u.implies (mk<AND>(s, skol), t_init) << "\n";
+    }
+    res.verdict = AEVAL_VALID;
+    res.skolem = skol;
+    return res;
+  }
+}
+
+namespace ufo
+{
+  AeValResult aeSolve (Expr s, Expr t, const AeValOptions &opts, EZ3 *z3)
+  {
+    AE_TRACE (span, "aeSolve");
+    AE_TRACE_ARG (span, "s.size", dagSize (s));
+    AE_TRACE_ARG (span, "t.size", dagSize (t));
+    ExprFactory &efac = s->getFactory ();
+    unsigned created = efac.getCreatedNodes ();
+
+    ExprSet s_vars;
+    ExprSet t_vars;
+
+    filterConsts (s, inserter (s_vars, s_vars.begin ()));
+    filterConsts (t, inserter (t_vars, t_vars.begin ()));
+
+    ExprSet t_quantified = minusSets (t_vars, s_vars); // existentially quantified vars
+
+    {
+      AE_TIMER ("simplify");
+      // -- one memo table for both, they share most of their terms
+      Simplifier simpl (efac, SIMPL_INT_TO_REAL);
+      s = simpl (s);
+      t = simpl (t);
+    }
+
+    // -- in the all-inclusive mode, one context for all runs so that
+    // -- the translation of s and t is cached across them
+    RunZ3 rz3 (efac, z3, opts.lim);
+    if (opts.debug) printQuery (s, t, t_quantified);
+
+    AeValResult res;
+    if (opts.allInclusive)
+      res = solveAllInclusive (s, t, t_quantified, opts, rz3.get ());
+    else
+    {
+      AeValSolver ae (s, t, t_quantified, opts.debug, opts.skol, &rz3.get ());
+      if (run (ae, opts, opts.skol, res)) getCounterexample (ae, res);
+      res.partitions = ae.getPartitions ();
+      ae.getStats (res.stats);
+    }
+    finish (res, efac, created, rz3);
+    AE_TRACE_ARG (span, "result", verdictName (res.verdict));
+    return res;
+  }
+
+  AeValResult aeSolve (Expr t, const ExprSet &v, const AeValOptions &opts, EZ3 *z3)
+  {
+    assert (!opts.allInclusive);
+    AE_TRACE (span, "aeSolve");
+    AE_TRACE_ARG (span, "t.size", dagSize (t));
+    ExprFactory &efac = t->getFactory ();
+    unsigned created = efac.getCreatedNodes ();
+    {
+      AE_TIMER ("simplify");
+      t = simplify (t, SIMPL_INT_TO_REAL);
+    }
+
+    RunZ3 rz3 (efac, z3, opts.lim);
+    if (opts.debug) printQuery (NULL, t, v);
+
+    AeValResult res;
+    ExprSet vars = v;
+    AeValSolver ae (t, vars, opts.debug, opts.skol, &rz3.get ());
+    if (opts.debug) outs () << "AeValSolver initialized" << "\n";
+    if (run (ae, opts, opts.skol, res)) getCounterexample (ae, res);
+    res.partitions = ae.getPartitions ();
+    ae.getStats (res.stats);
+    finish (res, efac, created, rz3);
+    AE_TRACE_ARG (span, "result", verdictName (res.verdict));
+    return res;
+  }
+
+  AeValResult aeSolve (ExprFactory &efac, const std::string &s, const std::string &t,
+                       const AeValOptions &opts)
+  {
+    EZ3 z3 (efac);
+    Expr se = z3_from_smtlib (z3, s);
+    Expr te = z3_from_smtlib (z3, t);
+    return aeSolve (se, te, opts, &z3);
+  }
+
+  void printResult (const AeValResult &res, const AeValOptions &opts,
+                    raw_ostream &out, EZ3 *z3)
+  {
+    if (!opts.allInclusive) out << "Iter: " << res.stats.iterations << "; ";
+    out << "Result: " << verdictName (res.verdict) << "\n";
+
+    if (res.verdict == AEVAL_UNKNOWN)
+      out << "reason: " << res.reasonUnknown << "\n";
+    else if (res.verdict == AEVAL_INVALID)
+    {
+      out << "(model\n";
+      for (auto &m : res.model)
+      {
+        Expr var = m->left ();
+        out << "  (define-fun " << *var << " () " <<
+          (bind::isBoolConst (var) ? "Bool" : (bind::isIntConst (var) ? "Int" : "Real"))
+            << "\n    " << *m->right () << ")\n";
+      }
+      out << ")\n";
+      out << "\nvalid subset:\n";
+      SMTUtils (res.validSubset->getFactory (), z3).serialize_formula (res.validSubset, out);
+    }
+    else if (res.skolem != NULL)
+    {
+      out << "\nextracted skolem:\n";
+      SMTUtils (res.skolem->getFactory (), z3).serialize_formula (res.skolem, out);
+    }
+  }
+
+  void aeSolveAndSkolemize (Expr s, Expr t, bool skol, bool debug, bool compact,
+                            const AeValLimits &lim, raw_ostream &out)
+  {
+    AeValOptions opts;
+    opts.skol = skol;
+    opts.debug = debug;
+    opts.compact = compact;
+    opts.lim = lim;
+
+    EZ3 z3 (s->getFactory ());
+    AeValResult res = aeSolve (s, t, opts, &z3);
+    printResult (res, opts, out, &z3);
+    if (debug) res.stats.print (outs ());
+  }
+
+  void aeSolveAndSkolemize (Expr t, ExprSet &var_exist_quantified, bool skol,
+                            bool debug, bool compact,
+                            const AeValLimits &lim, raw_ostream &out)
+  {
+    AeValOptions opts;
+    opts.skol = skol;
+    opts.debug = debug;
+    opts.compact = compact;
+    opts.lim = lim;
+
+    EZ3 z3 (t->getFactory ());
+    AeValResult res = aeSolve (t, var_exist_quantified, opts, &z3);
+    printResult (res, opts, out, &z3);
+    if (debug) res.stats.print (outs ());
+  }
+
+  void getAllInclusiveSkolem (Expr s, Expr t, bool debug, bool compact,
+                              const AeValLimits &lim, raw_ostream &out)
+  {
+    AeValOptions opts;
+    opts.allInclusive = true;
+    opts.debug = debug;
+    opts.compact = compact;
+    opts.lim = lim;
+
+    EZ3 z3 (s->getFactory ());
+    AeValResult res = aeSolve (s, t, opts, &z3);
+    printResult (res, opts, out, &z3);
+    if (debug) res.stats.print (outs ());
+  }
+}
@@ -0,0 +1,54 @@
+#include "ae/ExprSimpl.hpp"
+
+using namespace ufo;
+
+/** Test: the comparisons of SIMPL_INEQ are a fixpoint of all rules
+ *
+ * Usage: simpl-fixpoint
+ *
+ * Simplifies numeric comparisons with Simplifier and SIMPL_ALL, and
+ * fails (and prints the comparison) if the fixpoint was cut off, or if
+ * the result is rewritten again.
+ *
+ */
+
+int main ()
+{
+  ExprFactory efac;
+  Expr x = bind::intConst (mkTerm<std::string> ("x", efac));
+  Expr y = bind::intConst (mkTerm<std::string> ("y", efac));
+  Expr a = bind::realConst (mkTerm<std::string> ("a", efac));
+  Expr b = bind::realConst (mkTerm<std::string> ("b", efac));
+  Expr one = mkTerm (mpz_class (1), efac);
+  Expr two = mkTerm (mpz_class (2), efac);
+  Expr half = mkTerm (mpq_class (1, 2), efac);
+
+  ExprVector cmps = {
+    mk<LEQ>(x, y), mk<GEQ>(x, y), mk<LT>(x, y), mk<GT>(x, y),
+    mk<EQ>(x, y), mk<NEQ>(x, y), mk<NEG>(mk<LEQ>(x, y)),
+    mk<LEQ>(mk<PLUS>(x, one), y), mk<LEQ>(mk<MULT>(two, x), mk<UN_MINUS>(y)),
+    mk<LEQ>(mk<MINUS>(x, y), one), mk<LEQ>(mk<UN_MINUS>(x), y),
+    mk<LEQ>(a, b), mk<LT>(mk<PLUS>(a, half), b), mk<EQ>(mk<MINUS>(a, b), half),
+    mk<LEQ>(mk<UN_MINUS>(a), mk<MULT>(two, b))
+  };
+
+  int failed = 0;
+  for (auto &c : cmps)
+  {
+    Simplifier s (efac, SIMPL_ALL);
+    Expr r = s (c);
+    bool capped = s.getStats ().capped > 0;
+
+    Simplifier again (efac, SIMPL_ALL);
+    bool stable = again (r) == r && again.getStats ().rewrites == 0;
+
+    if (capped || !stable)
+    {
+      errs () << "not a fixpoint: " << *c << " -> " << *r
+              << (capped ? " (cut off)" : "") << "\n";
+      failed++;
+    }
+  }
+  outs () << cmps.size () - failed << " of " << cmps.size () << " at a fixpoint\n";
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,2 @@
+(declare-fun y () Int)
+(assert (and (= y 1) (= y 2)))
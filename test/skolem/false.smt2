@@ -0,0 +1 @@
+(assert false)
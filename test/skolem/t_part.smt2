@@ -0,0 +1,3 @@
+(declare-fun x () Int)
+(declare-fun y () Int)
+(assert (> y x))
@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "ae/AeVal.hpp"
+#include "ae/SkolemCheck.hpp"
+#include "ufo/BenchUtils.hpp"
+
+using namespace ufo;
+
+/** Benchmark harness over the S/T pairs of a directory
+ *
+ * Usage: aebench [options] <tasks dir>
+ *
+ *   --skolems <dir> = expected Skolem functions, <name>_skolem.smt2
+ *                     (default <tasks dir>/../skolems)
+ *   --out <file> = to write the results, one line of JSON per task
+ *   --baseline <file> = results of an earlier run to compare with
+ *   --slower <x> = a task is a regression if its solve takes x times
+ *                  longer (or x times the memory) than in the
+ *                  baseline (default 1.25) ...
+ *   --min-ms <ms> = ... and at least ms longer (default 20) ...
+ *   --min-kb <kb> = ... or at least kb more (default 4096)
+ *   --timeout <ms> = wall-clock limit of the parsing and solve of each
+ *                    task, and then of its checks (default 60000)
+ *   --check-timeout <ms> = time limit of each SMT query of the checks
+ *                          of the Skolem (default 10000)
+ *   --filter <str> = to run only the tasks with str in their name
+ *   --compact, --native-mbp = as for aeval
+ *
+ * Runs each <name>_s_part.smt2 / <name>_t_part.smt2 pair, with --skol,
+ * in a process of its own, one after another, and records
+ *
+ *   verdict     valid, invalid, unknown, timeout or error
+ *   solve_ms    of the solver alone (parsing and checks excluded)
+ *   solve_cpu_ms, solve_rss_kb
+ *               user and system time of the parsing and the solve,
+ *               and the peak resident set size by its end
+ *   wall_ms, cpu_ms, rss_kb
+ *               the same for the whole process, checks included
+ *   iterations  partitions found
+ *   skolem      DAG size of the Skolem function
+ *   check       ok if S /\ Skolem => T and the Skolem has a model at
+ *               each sample of S, else fail (or unknown, or timeout)
+ *   expected    how the Skolem relates to the expected one under S:
+ *               equivalent, stronger, weaker, differs (or unknown,
+ *               none if there is no expected one)
+ *
+ * The checks are the ones of aeval-check (see ufo::SkolemChecker).
+ *
+ * Prints a line per task and a summary; with --baseline, then lists
+ * the tasks whose verdict, check, solve time or solve memory got
+ * worse, and the change of the total solve time. Exits with 1 if there
+ * are any.
+ *
+ * Example:
+ *
+ * ./tools/aebench/aebench ../bench/tasks --out new.jsonl --baseline old.jsonl
+ *
+ */
+
+struct BenchResult
+{
+  std::string name;
+  std::string verdict;
+  double solveMs, solveCpuMs;
+  long solveRssKb;
+  double wallMs, cpuMs;
+  long rssKb;
+  unsigned iterations;
+  size_t skolem;
+  std::string check;
+  std::string expected;
+
+  BenchResult () : verdict ("error"), solveMs (0), solveCpuMs (0), solveRssKb (0),
+                   wallMs (0), cpuMs (0), rssKb (0), iterations (0), skolem (0),
+                   check ("-"), expected ("-") {}
+};
+
+double cpuMs (const rusage &ru)
+{
+  return ru.ru_utime.tv_sec * 1000.0 + ru.ru_utime.tv_usec / 1000.0 +
+         ru.ru_stime.tv_sec * 1000.0 + ru.ru_stime.tv_usec / 1000.0;
+}
+
+/** SIGALRM after ms of wall-clock time; 0 disarms it */
+void setAlarm (unsigned ms)
+{
+  itimerval it;
+  memset (&it, 0, sizeof (it));
+  it.it_value.tv_sec = ms / 1000;
+  it.it_value.tv_usec = (ms % 1000) * 1000;
+  setitimer (ITIMER_REAL, &it, NULL);
+}
+
+void writeLine (int fd, const std::string &line)
+{
+  if (write (fd, line.data (), line.size ()) != (ssize_t) line.size ()) _exit (1);
+}
+
+/** how skol relates to the expected one e under S */
+const char *compareExpected (SkolemChecker &sc, Expr skol, Expr e)
+{
+  ExprMap witness;
+  boost::tribool eq = sc.compare (skol, e, witness);
+  if (eq) return "equivalent";
+  if (boost::indeterminate (eq)) return "unknown";
+  // -- functions that differ at a sample imply neither one another
+  if (!witness.empty ()) return "differs";
+  boost::tribool stronger = sc.implies (skol, e);
+  boost::tribool weaker = sc.implies (e, skol);
+  if (boost::indeterminate (stronger) || boost::indeterminate (weaker)) return "unknown";
+  return stronger ? "stronger" : weaker ? "weaker" : "differs";
+}
+
+/**
+ * Solves a task and checks its Skolem function; runs in the child, and
+ * writes the fields of the solve to fd, and then the ones of the
+ * checks. Each of the two phases has timeout ms.
+ */
+void solveTask (const std::string &s_file, const std::string &t_file,
+                const std::string &skol_file, const AeValOptions &opts,
+                unsigned timeout, unsigned checkTimeout, int fd)
+{
+  setAlarm (timeout);
+  ExprFactory efac;
+  EZ3 z3 (efac);
+  Expr s = z3_from_smtlib_file (z3, s_file.c_str ());
+  Expr t = z3_from_smtlib_file (z3, t_file.c_str ());
+
+  double start = nowMs ();
+  AeValResult res = aeSolve (s, t, opts, &z3);
+  double solveMs = nowMs () - start;
+  setAlarm (0);
+
+  rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  std::ostringstream out;
+  out << verdictName (res.verdict) << " " << solveMs << " " << cpuMs (ru) << " "
+      << ru.ru_maxrss << " " << res.stats.iterations << " "
+      << (res.skolem == NULL ? 0 : dagSize (res.skolem)) << "\n";
+  writeLine (fd, out.str ());
+
+  setAlarm (timeout);
+  std::string check = "-", expected = "-";
+  if (res.verdict == AEVAL_VALID && res.skolem != NULL)
+  {
+    SkolemChecker sc (s, t, z3, checkTimeout);
+    std::vector<boost::tribool> cases;
+    ExprMap witness;
+    sc.sample (20);
+    boost::tribool ok = sc.check (res.skolem, cases);
+    if (ok) ok = sc.defined (res.skolem, witness);
+    check = boost::indeterminate (ok) ? "unknown" : ok ? "ok" : "fail";
+
+    if (!fileExists (skol_file)) expected = "none";
+    else
+    {
+      expected = compareExpected (sc, res.skolem, z3_from_smtlib_file (z3, skol_file.c_str ()));
+    }
+  }
+
+  writeLine (fd, check + " " + expected + "\n");
+}
+
+BenchResult runTask (const std::string &dir, const std::string &skolDir,
+                     const std::string &name, const AeValOptions &opts, unsigned timeout,
+                     unsigned checkTimeout)
+{
+  BenchResult r;
+  r.name = name;
+  int fds [2];
+  if (pipe (fds) != 0) return r;
+
+  double start = nowMs ();
+  pid_t pid = fork ();
+  if (pid == 0)
+  {
+    close (fds [0]);
+    // -- SIGALRM ends the child, which the parent reads as a timeout
+    // -- of the phase it was in
+    try
+    {
+      solveTask (dir + "/" + name + "_s_part.smt2", dir + "/" + name + "_t_part.smt2",
+                 skolDir + "/" + name + "_skolem.smt2", opts, timeout, checkTimeout,
+                 fds [1]);
+    }
+    catch (...) { _exit (1); }
+    _exit (0);
+  }
+  close (fds [1]);
+  if (pid < 0)
+  {
+    close (fds [0]);
+    return r;
+  }
+
+  std::string text;
+  char buf [256];
+  ssize_t n;
+  while ((n = read (fds [0], buf, sizeof (buf))) > 0) text.append (buf, n);
+  close (fds [0]);
+
+  int status;
+  rusage ru;
+  wait4 (pid, &status, 0, &ru);
+  r.wallMs = nowMs () - start;
+  r.cpuMs = cpuMs (ru);
+  r.rssKb = ru.ru_maxrss;
+
+  bool alarm = WIFSIGNALED (status) && WTERMSIG (status) == SIGALRM;
+  bool exited = WIFEXITED (status) && WEXITSTATUS (status) == 0;
+  std::istringstream in (text);
+  std::string solve, checks;
+  std::getline (in, solve);
+  std::getline (in, checks);
+
+  // -- fields of the solve, if it got to its end
+  BenchResult done = r;
+  std::istringstream solveIn (solve);
+  solveIn >> done.verdict >> done.solveMs >> done.solveCpuMs >> done.solveRssKb
+          >> done.iterations >> done.skolem;
+  if (!solveIn)
+  {
+    if (alarm) r.verdict = "timeout";
+    return r;
+  }
+  r = done;
+
+  std::istringstream checksIn (checks);
+  if (exited && checksIn >> r.check >> r.expected) return r;
+  r.check = alarm ? "timeout" : "error";
+  r.expected = "-";
+  return r;
+}
+
+void printJson (std::ostream &out, const BenchResult &r)
+{
+  out << "{\"name\": \"" << r.name << "\", \"verdict\": \"" << r.verdict
+      << "\", \"solve_ms\": " << (long) r.solveMs << ", \"solve_cpu_ms\": "
+      << (long) r.solveCpuMs << ", \"solve_rss_kb\": " << r.solveRssKb
+      << ", \"wall_ms\": " << (long) r.wallMs << ", \"cpu_ms\": " << (long) r.cpuMs
+      << ", \"rss_kb\": " << r.rssKb
+      << ", \"iterations\": " << r.iterations << ", \"skolem\": " << r.skolem
+      << ", \"check\": \"" << r.check << "\", \"expected\": \"" << r.expected << "\"}\n";
+}
+
+/** the fields of a line written by printJson that the baseline needs */
+void parseResult (const std::string &line, BenchResult &r)
+{
+  r.verdict = jsonField (line, "verdict");
+  r.solveMs = atof (jsonField (line, "solve_ms").c_str ());
+  r.solveRssKb = atol (jsonField (line, "solve_rss_kb").c_str ());
+  r.check = jsonField (line, "check");
+}
+
+int main (int argc, char **argv)
+{
+  const char *skolems = NULL, *outFile = NULL, *baseline = NULL, *filter = NULL;
+  const char *dir = NULL;
+  double slower = 1.25, minMs = 20, minKb = 4096;
+  unsigned timeout = 60000, checkTimeout = 10000;
+  AeValOptions opts;
+  opts.skol = true;
+  for (int i = 1; i < argc; i++)
+  {
+    bool more = i + 1 < argc;
+    if (strcmp (argv[i], "--skolems") == 0 && more) skolems = argv[++i];
+    else if (strcmp (argv[i], "--out") == 0 && more) outFile = argv[++i];
+    else if (strcmp (argv[i], "--baseline") == 0 && more) baseline = argv[++i];
+    else if (strcmp (argv[i], "--slower") == 0 && more) slower = atof (argv[++i]);
+    else if (strcmp (argv[i], "--min-ms") == 0 && more) minMs = atof (argv[++i]);
+    else if (strcmp (argv[i], "--min-kb") == 0 && more) minKb = atof (argv[++i]);
+    else if (strcmp (argv[i], "--timeout") == 0 && more) timeout = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--check-timeout") == 0 && more) checkTimeout = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--filter") == 0 && more) filter = argv[++i];
+    else if (strcmp (argv[i], "--compact") == 0) opts.compact = true;
+    else if (strcmp (argv[i], "--native-mbp") == 0) opts.lim.nativeMbp = true;
+    else dir = argv[i];
+  }
+  if (dir == NULL)
+  {
+    std::cerr << "Usage: aebench [options] <tasks dir>" << std::endl;
+    return 1;
+  }
+  std::string skolDir = skolems ? skolems : std::string (dir) + "/../skolems";
+
+  std::map<std::string, BenchResult> base;
+  if (baseline != NULL && !readResults (baseline, base, parseResult))
+  {
+    std::cerr << "Error: cannot read " << baseline << std::endl;
+    return 1;
+  }
+  std::ofstream out;
+  if (outFile != NULL)
+  {
+    out.open (outFile);
+    if (!out)
+    {
+      std::cerr << "Error: cannot write " << outFile << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<BenchResult> results;
+  std::map<std::string, unsigned> verdicts, checks, expected;
+  double solve = 0, wall = 0, cpu = 0;
+  long rss = 0;
+  for (auto &name : getTasks (dir, filter))
+  {
+    BenchResult r = runTask (dir, skolDir, name, opts, timeout, checkTimeout);
+    std::cout << r.name << " " << r.verdict << " " << (long) r.solveMs << " ms "
+              << r.check << " " << r.expected << std::endl;
+    if (out.is_open ()) printJson (out, r);
+    verdicts [r.verdict]++;
+    checks [r.check]++;
+    expected [r.expected]++;
+    solve += r.solveMs;
+    wall += r.wallMs;
+    cpu += r.cpuMs;
+    rss = std::max (rss, r.rssKb);
+    results.push_back (r);
+  }
+
+  auto printCounts = [] (const char *title, std::map<std::string, unsigned> &m) {
+    std::cout << title << ":";
+    for (auto &c : m) if (c.first != "-") std::cout << " " << c.first << " " << c.second;
+    std::cout << "\n";
+  };
+  std::cout << "tasks: " << results.size () << ", solve " << (long) solve << " ms, wall "
+            << (long) wall << " ms, cpu " << (long) cpu << " ms, max rss " << rss << " kB\n";
+  printCounts ("verdicts", verdicts);
+  printCounts ("check", checks);
+  printCounts ("expected", expected);
+  if (baseline == NULL) return 0;
+
+  // -- compared on the tasks of both runs
+  unsigned regressions = 0, common = 0;
+  double baseSolve = 0, newSolve = 0, logRatio = 0;
+  std::cout << "compared to " << baseline << ":\n";
+  for (auto &r : results)
+  {
+    auto it = base.find (r.name);
+    if (it == base.end ()) continue;
+    const BenchResult &b = it->second;
+    common++;
+    baseSolve += b.solveMs;
+    newSolve += r.solveMs;
+    logRatio += std::log (std::max (r.solveMs, 1.0) / std::max (b.solveMs, 1.0));
+
+    std::vector<std::string> why;
+    if (r.verdict != b.verdict) why.push_back ("verdict " + b.verdict + " -> " + r.verdict);
+    if (b.check == "ok" && r.check != "ok") why.push_back ("check ok -> " + r.check);
+    if (r.solveMs > b.solveMs * slower && r.solveMs - b.solveMs > minMs)
+      why.push_back ("solve " + std::to_string ((long) b.solveMs) + " -> " +
+                     std::to_string ((long) r.solveMs) + " ms");
+    if (b.solveRssKb > 0 && r.solveRssKb > b.solveRssKb * slower &&
+        r.solveRssKb - b.solveRssKb > minKb)
+      why.push_back ("rss " + std::to_string (b.solveRssKb) + " -> " +
+                     std::to_string (r.solveRssKb) + " kB");
+    if (why.empty ()) continue;
+    regressions++;
+    std::cout << "  " << r.name << ":";
+    for (unsigned i = 0; i < why.size (); i++) std::cout << (i ? "; " : " ") << why [i];
+    std::cout << "\n";
+  }
+  std::cout << "regressions: " << regressions << " of " << common << " tasks; solve "
+            << (long) baseSolve << " -> " << (long) newSolve << " ms, geometric mean ratio "
+            << (common == 0 ? 1 : std::exp (logRatio / common)) << std::endl;
+  return regressions == 0 ? 0 : 1;
+}
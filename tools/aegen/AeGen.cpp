@@ -0,0 +1,306 @@
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <string.h>
+
+/** Generator of AE-formulas of a given size, for scaling benchmarks
+ *
+ * Usage: aegen --family <f> --out <prefix> [options]
+ *
+ * Writes <prefix>_s_part.smt2 and <prefix>_t_part.smt2, which aeval and
+ * aebench read as \forall x . S(x) => \exists y . T (x, y). The formula
+ * is valid unless --invalid is given. Families:
+ *
+ *   chain    y_i is bounded by y_{i-1} plus a linear term over x, so
+ *            each y depends on all the ones before
+ *   maxmin   y_i is the maximum (even i) or minimum (odd i) of
+ *            <partitions> linear terms over x, as y >= a /\ y >= b /\
+ *            (y = a \/ y = b), so projections split into cases
+ *   cases    x_0 selects one of <partitions> ranges, with bounds on all
+ *            y for each of them in a disjunction
+ *   counter  <vars> bounded counters of a Lustre-like transition
+ *            relation: state $cI$0, inputs $incI$0 and $reset$0, next
+ *            state $cI$2, a sum $total$2 and a property $OK$2
+ *
+ * Options:
+ *
+ *   --vars <n> = number of existentials (default 4)
+ *   --partitions <p> = cases of maxmin and cases (default 2), the
+ *                      bound of the counters (default 10)
+ *   --depth <d> = number of x in each linear term (default 2)
+ *   --arith <int|real|mixed> = sort of the variables; with mixed, the
+ *                              x alternate between Int and Real, with
+ *                              to_real where they meet, the y are Real
+ *                              and the counters alternate (default int)
+ *   --seed <s> = of the coefficients (default 1)
+ *   --invalid = to add a conjunct to T that some x in S violates
+ *
+ * Example:
+ *
+ * ./tools/aegen/aegen --family maxmin --vars 8 --partitions 3 --out /tmp/mm
+ * ./tools/aeval/aeval /tmp/mm_s_part.smt2 /tmp/mm_t_part.smt2 --skol
+ *
+ * See bench/scaling.sh for curves of aeval over these families.
+ */
+
+struct Var
+{
+  std::string name;
+  bool real;
+  bool isBool;
+};
+
+class Gen
+{
+  std::string arith;
+  unsigned depth;
+  std::mt19937 rng;
+
+public:
+  std::vector<Var> xs, ys;
+  std::vector<std::string> s, t;
+  bool real;      // the sort of all terms, with to_real of the Int variables
+
+  Gen (const std::string &a, unsigned d, unsigned seed) :
+    arith (a), depth (d), rng (seed), real (a != "int") {}
+
+  bool isReal (unsigned i) const
+  {
+    return arith == "real" || (arith == "mixed" && i % 2 == 1);
+  }
+
+  Var &x (const std::string &name, bool real, bool isBool = false)
+  {
+    xs.push_back (Var {name, real, isBool});
+    return xs.back ();
+  }
+
+  Var &y (const std::string &name, bool real, bool isBool = false)
+  {
+    ys.push_back (Var {name, real, isBool});
+    return ys.back ();
+  }
+
+  int coef () { return std::uniform_int_distribution<int> (1, 5) (rng); }
+
+  static std::string num (long n, bool real)
+  {
+    std::string k = std::to_string (n < 0 ? -n : n) + (real ? ".0" : "");
+    return n < 0 ? "(- " + k + ")" : k;
+  }
+
+  /** v in a term of sort real (or int) */
+  static std::string ref (const Var &v, bool real)
+  {
+    return real && !v.real ? "(to_real " + v.name + ")" : v.name;
+  }
+
+  /** c_1 * x_{from} + ... + c_d * x_{from + d - 1} (cyclically) + c0 */
+  std::string lin (unsigned from, long c0, bool real)
+  {
+    std::string res = "(+";
+    for (unsigned i = 0; i < depth; i++)
+    {
+      const Var &v = xs [(from + i) % xs.size ()];
+      res += " (* " + num (coef (), real) + " " + ref (v, real) + ")";
+    }
+    return res + " " + num (c0, real) + ")";
+  }
+
+  /** lo <= v <= hi */
+  static std::string bounds (const Var &v, long lo, long hi)
+  {
+    return "(<= " + num (lo, v.real) + " " + v.name + ") (<= " + v.name + " " +
+      num (hi, v.real) + ")";
+  }
+
+  static std::string conj (const std::vector<std::string> &v)
+  {
+    if (v.empty ()) return "true";
+    if (v.size () == 1) return v [0];
+    std::string res = "(and";
+    for (auto &a : v) res += "\n  " + a;
+    return res + ")";
+  }
+
+  static void write (const std::string &fname, const std::vector<Var> &decls,
+                     const std::vector<std::string> &body)
+  {
+    std::ofstream out (fname);
+    for (auto &v : decls)
+      out << "(declare-fun " << v.name << " () "
+          << (v.isBool ? "Bool" : v.real ? "Real" : "Int") << ")\n";
+    out << "(assert " << conj (body) << ")\n";
+  }
+};
+
+/** each y_i in (y_{i-1} + lin, y_{i-1} + lin + 1] */
+void chain (Gen &g, unsigned n)
+{
+  for (unsigned j = 0; j < std::max (n, 2u); j++)
+  {
+    Var &v = g.x ("$x" + std::to_string (j) + "$0", g.isReal (j));
+    g.s.push_back (Gen::bounds (v, 0, 100));
+  }
+  for (unsigned i = 0; i < n; i++)
+  {
+    Var v = g.y ("$y" + std::to_string (i) + "$2", g.real);
+    bool real = g.real;
+    std::string e = g.lin (i, 0, real);
+    if (i > 0) e = "(+ " + Gen::ref (g.ys [i - 1], real) + " " + e + ")";
+    std::string r = Gen::ref (v, real);
+    g.t.push_back ("(< " + e + " " + r + ")");
+    g.t.push_back ("(<= " + r + " (+ " + e + " " + Gen::num (1, real) + "))");
+  }
+}
+
+/** y_i = max or min of p linear terms */
+void maxmin (Gen &g, unsigned n, unsigned p)
+{
+  for (unsigned j = 0; j < std::max (n, 2u); j++)
+  {
+    Var &v = g.x ("$x" + std::to_string (j) + "$0", g.isReal (j));
+    g.s.push_back (Gen::bounds (v, -50, 50));
+  }
+  for (unsigned i = 0; i < n; i++)
+  {
+    Var v = g.y ("$m" + std::to_string (i) + "$2", g.real);
+    bool real = g.real;
+    std::string r = Gen::ref (v, real);
+    std::string sel = "(or";
+    for (unsigned k = 0; k < p; k++)
+    {
+      std::string e = g.lin (i + k, k, real);
+      g.t.push_back ("(" + std::string (i % 2 == 0 ? ">=" : "<=") + " " + r + " " + e + ")");
+      sel += " (= " + r + " " + e + ")";
+    }
+    g.t.push_back (sel + ")");
+  }
+}
+
+/** x_0 in one of p ranges, each with its own bounds on y */
+void cases (Gen &g, unsigned n, unsigned p)
+{
+  Var sel = g.x ("$sel$0", false);
+  g.s.push_back (Gen::bounds (sel, 0, 10 * p - 1));
+  for (unsigned j = 1; j < std::max (n, 2u); j++)
+  {
+    Var &v = g.x ("$x" + std::to_string (j) + "$0", g.isReal (j));
+    g.s.push_back (Gen::bounds (v, 0, 100));
+  }
+  for (unsigned i = 0; i < n; i++) g.y ("$y" + std::to_string (i) + "$2", g.real);
+
+  std::string res = "(or";
+  for (unsigned k = 0; k < p; k++)
+  {
+    std::vector<std::string> c;
+    c.push_back (Gen::bounds (sel, 10 * k, 10 * k + 9));
+    for (unsigned i = 0; i < n; i++)
+    {
+      std::string v = Gen::ref (g.ys [i], g.real);
+      std::string e = g.lin (i + k + 1, k, g.real);
+      c.push_back ("(<= " + e + " " + v + ") (<= " + v + " (+ " + e + " " +
+                   Gen::num (k + 1, g.real) + "))");
+    }
+    std::string cs = "(and";
+    for (auto &a : c) cs += " " + a;
+    res += "\n    " + cs + ")";
+  }
+  g.t.push_back (res + ")");
+}
+
+/** n counters up to b, with increment and reset inputs */
+void counter (Gen &g, unsigned n, unsigned b)
+{
+  bool real = g.real;
+  Var reset = g.x ("$reset$0", false, true);
+  std::string total = "(+";
+  std::vector<std::string> ok;
+  for (unsigned i = 0; i < n; i++)
+  {
+    std::string id = std::to_string (i);
+    // -- each counter has a sort of its own in the mixed mode
+    bool r = g.isReal (i);
+    Var c = g.x ("$c" + id + "$0", r);
+    Var inc = g.x ("$inc" + id + "$0", false, true);
+    g.s.push_back (Gen::bounds (c, 0, b));
+    // -- an assumption on the environment, which also makes the
+    // -- inputs universally quantified
+    g.s.push_back ("(not (and " + reset.name + " " + inc.name + "))");
+
+    Var next = g.y ("$c" + id + "$2", r);
+    Var step = g.y ("$step" + id + "$1", r);
+    g.t.push_back ("(= " + step.name + " (+ " + c.name + " " + Gen::num (1, r) + "))");
+    g.t.push_back ("(= " + next.name + " (ite " + reset.name + " " + Gen::num (0, r) +
+                   " (ite (and " + inc.name + " (<= " + step.name + " " + Gen::num (b, r) + ")) " +
+                   step.name + " " + c.name + ")))");
+    ok.push_back ("(<= " + next.name + " " + Gen::num (b, r) + ")");
+    total += " " + Gen::ref (next, real);
+  }
+  Var tot = g.y ("$total$2", real);
+  g.t.push_back ("(= " + tot.name + " " + (n == 1 ? total.substr (3) : total + ")") + ")");
+  ok.push_back ("(<= " + tot.name + " " + Gen::num ((long) n * b, real) + ")");
+  Var okv = g.y ("$OK$2", false, true);
+  std::string oks = "(and";
+  for (auto &a : ok) oks += " " + a;
+  g.t.push_back ("(= " + okv.name + " " + oks + "))");
+  g.t.push_back (okv.name);
+}
+
+unsigned getUnsigned (const char *opt, unsigned def, int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i++) if (strcmp (argv[i], opt) == 0) return atoi (argv[i + 1]);
+  return def;
+}
+
+const char *getStr (const char *opt, const char *def, int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i++) if (strcmp (argv[i], opt) == 0) return argv[i + 1];
+  return def;
+}
+
+int main (int argc, char **argv)
+{
+  std::string family = getStr ("--family", "", argc, argv);
+  const char *out = getStr ("--out", NULL, argc, argv);
+  unsigned n = std::max (1u, getUnsigned ("--vars", 4, argc, argv));
+  bool invalid = false;
+  for (int i = 1; i < argc; i++) if (strcmp (argv[i], "--invalid") == 0) invalid = true;
+  std::string arith = getStr ("--arith", "int", argc, argv);
+  if (out == NULL || (arith != "int" && arith != "real" && arith != "mixed"))
+  {
+    std::cerr << "Usage: aegen --family <chain|maxmin|cases|counter> --out <prefix> "
+              << "[--vars n] [--partitions p] [--depth d] [--arith int|real|mixed] "
+              << "[--seed s] [--invalid]" << std::endl;
+    return 1;
+  }
+
+  Gen g (arith, std::max (1u, getUnsigned ("--depth", 2, argc, argv)),
+         getUnsigned ("--seed", 1, argc, argv));
+  if (family == "chain") chain (g, n);
+  else if (family == "maxmin") maxmin (g, n, std::max (1u, getUnsigned ("--partitions", 2, argc, argv)));
+  else if (family == "cases") cases (g, n, std::max (1u, getUnsigned ("--partitions", 2, argc, argv)));
+  else if (family == "counter") counter (g, n, std::max (1u, getUnsigned ("--partitions", 10, argc, argv)));
+  else
+  {
+    std::cerr << "Error: unknown family " << family << std::endl;
+    return 1;
+  }
+
+  // -- somewhere in S, the first x violates it
+  if (invalid)
+  {
+    const Var &v = g.xs [0];
+    g.t.push_back (v.isBool ? "(not " + v.name + ")" :
+                   "(< " + v.name + " " + Gen::num (family == "cases" ? 0 : 1, v.real) + ")");
+  }
+
+  std::vector<Var> all (g.xs);
+  all.insert (all.end (), g.ys.begin (), g.ys.end ());
+  Gen::write (std::string (out) + "_s_part.smt2", g.xs, g.s);
+  Gen::write (std::string (out) + "_t_part.smt2", all, g.t);
+  return 0;
+}
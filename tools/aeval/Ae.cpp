@@ -1,5 +1,25 @@
 #include <exception>
-#include "ae/AeValSolver.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <climits>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <algorithm>
+#include "ae/AeVal.hpp"
 #include "ae/MarshallVisitor.hpp"
 #include "ufo/Smt/EZ3.hh"
 #include "SynthLib2ParserIFace.hpp"
@@ -15,6 +35,18 @@ using namespace ufo;
  *   <t_part.smt2> = T-part (over x, y)
  *   --skol = to print skolem function
  *   --debug = to print more info and perform sanity checks
+ *   --timeout <ms> = time limit of each SMT query
+ *   --rlimit <n> = Z3 resource limit of each SMT query
+ *   --budget <ms> = wall-clock limit of the whole run
+ *   --native-mbp = to compute linear projections without Z3
+ *   --stats=json = to print the timers and counters of the run (see
+ *                  ufo/Stats.hpp) at its end, as a line of JSON
+ *   --trace <file> = to write a timeline of the phases, SMT queries and
+ *                    projections of the run (see ufo/Trace.hpp) to file,
+ *                    in the Chrome trace format; also in batch and server
+ *                    mode, with a thread per worker
+ *
+ * If a limit is hit, the result is "unknown".
  *
  * Notably, the tool automatically recognizes x and y based on their appearances in S or T.
  *
@@ -24,6 +56,58 @@ using namespace ufo;
  *   ../test/ae/example1_s_part.smt2
  *   ../test/ae/example1_t_part.smt2
  *
+ * Batch mode: solves many S/T pairs in one process
+ *
+ *   --batch <manifest> = file with one task per line:
+ *                        <s_part.smt2> <t_part.smt2> [options of a single run]
+ *                        (paths are relative to the manifest, # starts a comment)
+ *   --jobs <n> = number of worker threads (default 1, at most 256)
+ *   --out <dir> = to write the output of each task to <dir>/<name>.out
+ *   --compare = to also run each task in a process of its own, and report the gain
+ *               (an error if one of these runs fails)
+ *
+ * Options on the command line apply to all tasks. Each worker keeps an
+ * ExprFactory and a Z3 context for parsing across its tasks, and trims
+ * the factory after each of them. The output of a task is the same as
+ * of a single run; --debug output is not captured. Prints one record
+ * per task, in the order of the manifest:
+ *
+ *   <name> <valid|invalid|unknown|error> <ms>
+ *
+ * and then the throughput.
+ *
+ * ./tools/aeval/aeval --batch tasks.txt --jobs 4 --skol
+ *
+ * Server mode: keeps workers with their ExprFactory and Z3 context
+ * warm between requests
+ *
+ *   --server = to serve requests on stdin/stdout
+ *   --socket <path> = to serve them on a Unix domain socket instead,
+ *                     to any number of clients
+ *   --jobs <n> = number of requests solved at once (default 1, at most 256)
+ *
+ * Options on the command line apply to all requests. A request is a
+ * line. The solve request is followed by the S-part and the T-part in
+ * SMT-LIB, each of them terminated by a line with a single dot:
+ *
+ *   solve <id> [options of a single run]
+ *   <S-part>
+ *   .
+ *   <T-part>
+ *   .
+ *
+ * It is answered, not necessarily in the order of the requests, by
+ *
+ *   result <id> <valid|invalid|unknown|error> <ms>
+ *   <the output of a single run>
+ *   .
+ *
+ * Other requests are "stats" (answered by "stats <served> <queued>"),
+ * "quit" (closes the connection once its requests are answered) and
+ * "shutdown" (also stops the server). --debug is only served on the
+ * socket, as its output goes to stdout; on stdin/stdout, a request
+ * with it is answered with an error.
+ *
  */
 
 
@@ -36,6 +120,31 @@ bool getBoolValue(const char *opt, bool defValue, int argc, char **argv)
     return defValue;
 }
 
+/** the value of opt, a number >= 0; throws std::invalid_argument if it is not one */
+unsigned getIntValue(const char *opt, unsigned defValue, int argc, char **argv)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], opt) != 0) continue;
+        const char *val = argv[i + 1];
+        char *end;
+        errno = 0;
+        unsigned long res = strtoul(val, &end, 10);
+        if (!isdigit(val[0]) || *end != '\0' || errno == ERANGE || res > UINT_MAX)
+            throw std::invalid_argument(std::string(opt) + " needs a number, not " + val);
+        return res;
+    }
+    return defValue;
+}
+
+/** worker threads of batch and server mode */
+const unsigned MAX_JOBS = 256;
+
+unsigned getJobs(int argc, char **argv)
+{
+    return std::min(MAX_JOBS, std::max(1u, getIntValue("--jobs", 1, argc, argv)));
+}
+
 char *getSmtFileName(int num, int argc, char **argv)
 {
     int num1 = 1;
@@ -51,6 +160,15 @@ char *getSmtFileName(int num, int argc, char **argv)
     return NULL;
 }
 
+const char *getStrValue(const char *opt, const char *defValue, int argc, char **argv)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], opt) == 0) return argv[i + 1];
+    }
+    return defValue;
+}
+
 char *getSlFileName(int num, int argc, char **argv)
 {
     int num1 = 1;
@@ -66,24 +184,663 @@ char *getSlFileName(int num, int argc, char **argv)
     return NULL;
 }
 
+/**
+ * Cancels the run through lim once budget ms have passed, unless it
+ * is destroyed before. Nothing happens if budget is 0.
+ */
+class Watchdog
+{
+    ZCancelToken cancel;
+    std::mutex m;
+    std::condition_variable cv;
+    bool done;
+    std::thread thread;
+
+public:
+    Watchdog(unsigned budget, AeValLimits &lim) : done(false)
+    {
+        if (budget == 0) return;
+        lim.cancel = &cancel;
+        thread = std::thread([this, budget]() {
+            std::unique_lock<std::mutex> lock(m);
+            if (!cv.wait_for(lock, std::chrono::milliseconds(budget),
+                             [this]() { return done; }))
+                cancel.cancel();
+        });
+    }
+
+    ~Watchdog()
+    {
+        if (!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            done = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    bool fired() const { return cancel.isCancelled(); }
+};
+
+/** the options of a run in argv (as on the command line) */
+AeValOptions getOptions(int argc, char **argv)
+{
+    AeValOptions opts;
+    opts.skol = getBoolValue("--skol", false, argc, argv);
+    opts.allInclusive = getBoolValue("--all-inclusive", false, argc, argv);
+    opts.compact = getBoolValue("--compact", false, argc, argv);
+    opts.debug = getBoolValue("--debug", false, argc, argv);
+    opts.lim.timeout = getIntValue("--timeout", 0, argc, argv);
+    opts.lim.rlimit = getIntValue("--rlimit", 0, argc, argv);
+    opts.lim.nativeMbp = getBoolValue("--native-mbp", false, argc, argv);
+    return opts;
+}
+
+/**
+ * Solves the S/T pair with the options of argv in z3 (the context they
+ * were parsed in, so that their translation is cached), with the
+ * results written to out. If the run is canceled, z3 is replaced by a
+ * fresh context: Z3 may keep one that was interrupted in a call
+ * canceled, and fail the next parse in it.
+ */
+AeValVerdict solvePair(std::unique_ptr<EZ3> &z3, Expr s, Expr t, int argc, char **argv,
+                       raw_ostream &out)
+{
+    AeValOptions opts = getOptions(argc, argv);
+    AeValResult res;
+    bool canceled;
+    {
+        Watchdog watchdog(getIntValue("--budget", 0, argc, argv), opts.lim);
+        res = aeSolve(s, t, opts, z3.get());
+        canceled = watchdog.fired();
+    }
+    printResult(res, opts, out, z3.get());
+    if (opts.debug) res.stats.print(outs());
+    if (canceled) z3.reset(new EZ3(s->getFactory()));
+    return res.verdict;
+}
+
+/** the stats of a run as a line of JSON, if asked for by --stats=json */
+void printStats(AeValVerdict res, const Stats &st, int argc, char **argv,
+                raw_ostream &out)
+{
+    if (!getBoolValue("--stats=json", false, argc, argv)) return;
+    out << "{\"result\": \"" << verdictName(res) << "\", ";
+    st.printJson(out);
+    out << "}\n";
+    out.flush();
+}
+
+/** Solves the S/T pair of the files given by argv */
+AeValVerdict solveTask(std::unique_ptr<EZ3> &z3, int argc, char **argv, raw_ostream &out)
+{
+    Stats st;
+    StatsScope scope(st);
+    AE_TRACE(span, "task");
+    const char *sFile = getSmtFileName(1, argc, argv);
+    AE_TRACE_ARG(span, "file", sFile ? sFile : "");
+    Expr s, t;
+    {
+        AE_TIMER("parse");
+        s = z3_from_smtlib_file (*z3, sFile);
+    }
+    out << "----------\n";
+    out.flush();
+    {
+        AE_TIMER("parse");
+        t = z3_from_smtlib_file (*z3, getSmtFileName(2, argc, argv));
+    }
+    AeValVerdict res = solvePair(z3, s, t, argc, argv, out);
+    printStats(res, st, argc, argv, out);
+    return res;
+}
+
+/** options of the command line that are not about batch or server mode */
+std::vector<std::string> commonOptions(int argc, char **argv)
+{
+    std::vector<std::string> res;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--jobs") == 0 ||
+            strcmp(argv[i], "--out") == 0 || strcmp(argv[i], "--socket") == 0 ||
+            strcmp(argv[i], "--trace") == 0) { i++; continue; }
+        if (strcmp(argv[i], "--compare") == 0 || strcmp(argv[i], "--server") == 0) continue;
+        res.push_back(argv[i]);
+    }
+    return res;
+}
+
+std::vector<char*> toArgv(std::vector<std::string> &args, char *argv0)
+{
+    std::vector<char*> res;
+    res.push_back(argv0);
+    for (auto &a : args) res.push_back(const_cast<char*>(a.c_str()));
+    res.push_back(NULL);
+    return res;
+}
+
+struct BatchTask
+{
+    std::string name;
+    std::vector<std::string> args;  // argv of a single run, without argv[0]
+    std::string out;
+    std::string result;
+    double ms;
+    bool done;
+
+    BatchTask() : ms(0), done(false) {}
+};
+
+double nowMs()
+{
+    return std::chrono::duration<double, std::milli> (
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** tasks of the manifest, with the options of the command line appended */
+bool readManifest(const char *fname, int argc, char **argv, std::vector<BatchTask> &tasks)
+{
+    std::ifstream in(fname);
+    if (!in) return false;
+
+    std::string dir = fname;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "" : dir.substr(0, slash + 1);
+
+    std::vector<std::string> common = commonOptions(argc, argv);
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.resize(hash);
+        std::istringstream ws(line);
+        BatchTask task;
+        std::string w;
+        while (ws >> w)
+        {
+            bool isFile = w.size() >= 5 && w.compare(w.size() - 5, 5, ".smt2") == 0;
+            task.args.push_back(isFile && w[0] != '/' ? dir + w : w);
+        }
+        if (task.args.empty()) continue;
+        task.args.insert(task.args.end(), common.begin(), common.end());
+
+        std::string name = task.args[0];
+        name = name.substr(name.rfind('/') == std::string::npos ? 0 : name.rfind('/') + 1);
+        for (const char *suf : {"_s_part.smt2", ".smt2"})
+            if (name.size() > strlen(suf) &&
+                name.compare(name.size() - strlen(suf), strlen(suf), suf) == 0)
+            {
+                name.resize(name.size() - strlen(suf));
+                break;
+            }
+        task.name = name;
+        tasks.push_back(task);
+    }
+    return true;
+}
+
+/**
+ * Wall time of running each task in a process of its own, one after
+ * another, with the binary of argv0 (a path, or a name on the PATH);
+ * failed counts the processes that did not exit with 0
+ */
+double runPerProcess(std::vector<BatchTask> &tasks, char *argv0, unsigned &failed)
+{
+    failed = 0;
+    double start = nowMs();
+    for (auto &task : tasks)
+    {
+        std::vector<char*> args = toArgv(task.args, argv0);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            dup2(null, 2);
+            execvp(argv0, args.data());
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    return nowMs() - start;
+}
+
+int runBatch(const char *manifest, int argc, char **argv)
+{
+    std::vector<BatchTask> tasks;
+    if (!readManifest(manifest, argc, argv, tasks))
+    {
+        std::cerr << "Error: cannot read " << manifest << std::endl;
+        return 1;
+    }
+    unsigned jobs = getJobs(argc, argv);
+    const char *outDir = getStrValue("--out", NULL, argc, argv);
+
+    std::atomic<size_t> next(0);
+    std::mutex m;
+    size_t printed = 0;
+
+    double start = nowMs();
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < std::min<size_t>(jobs, tasks.size()); w++)
+        workers.push_back(std::thread([&]() {
+            ExprFactory efac;
+            std::unique_ptr<EZ3> z3(new EZ3(efac));
+            for (size_t i; (i = next++) < tasks.size();)
+            {
+                BatchTask &task = tasks[i];
+                std::vector<char*> args = toArgv(task.args, argv[0]);
+                double st = nowMs();
+                task.result = "error";
+                {
+                    raw_string_ostream out(task.out);
+                    try
+                    {
+                        // -- a clearer message than the one of the parser
+                        for (int f = 1; f <= 2; f++)
+                        {
+                            char *fname = getSmtFileName(f, args.size() - 1, args.data());
+                            if (fname == NULL || !std::ifstream(fname))
+                                throw std::runtime_error(std::string("cannot read ") +
+                                                         (fname ? fname : "the S/T part"));
+                        }
+                        task.result = verdictName(solveTask(z3, args.size() - 1,
+                                                            args.data(), out));
+                    }
+                    catch (z3::exception &e)
+                    {
+                        out << "Error: " << e.msg() << "\n";
+                    }
+                    catch (const std::exception &e)
+                    {
+                        out << "Error: " << e.what() << "\n";
+                    }
+                }
+                task.ms = nowMs() - st;
+                efac.trim();
+
+                if (outDir != NULL)
+                    std::ofstream(std::string(outDir) + "/" + task.name + ".out") << task.out;
+
+                // -- records go out in the order of the manifest
+                std::lock_guard<std::mutex> lock(m);
+                task.done = true;
+                for (; printed < tasks.size() && tasks[printed].done; printed++)
+                    std::cout << tasks[printed].name << " " << tasks[printed].result << " "
+                              << (unsigned)tasks[printed].ms << std::endl;
+            }
+        }));
+    for (auto &w : workers) w.join();
+    double time = nowMs() - start;
+
+    std::cout << "batch: " << tasks.size() << " tasks, " << jobs << " jobs, "
+              << (unsigned)time << " ms, "
+              << tasks.size() * 1000.0 / std::max(time, 1.0) << " tasks/s" << std::endl;
+
+    if (getBoolValue("--compare", false, argc, argv))
+    {
+        unsigned failed;
+        double sep = runPerProcess(tasks, argv[0], failed);
+        // -- the time of runs that failed (e.g. to start) says nothing
+        if (failed > 0)
+        {
+            std::cerr << "Error: " << failed << " of " << tasks.size()
+                      << " per-process runs failed" << std::endl;
+            return 1;
+        }
+        std::cout << "per-process: " << tasks.size() << " tasks, " << (unsigned)sep << " ms, "
+                  << tasks.size() * 1000.0 / std::max(sep, 1.0) << " tasks/s, gain "
+                  << sep / std::max(time, 1.0) << std::endl;
+    }
+    return 0;
+}
+
+/** A connection to the server: stdin/stdout, or a socket */
+struct Client
+{
+    FILE *in;
+    int out;
+    bool own;           // close on destruction
+    std::mutex lock;    // of out
+
+    Client(int inFd, int outFd, bool o) : out(outFd), own(o)
+    { in = inFd == 0 ? stdin : fdopen(inFd, "r"); }
+
+    ~Client()
+    {
+        if (!own) return;
+        fclose(in);
+        close(out);
+    }
+
+    void send(const std::string &msg)
+    {
+        std::lock_guard<std::mutex> l(lock);
+        for (size_t done = 0; done < msg.size();)
+        {
+            ssize_t n = write(out, msg.data() + done, msg.size() - done);
+            if (n <= 0) return;     // -- the client is gone
+            done += n;
+        }
+    }
+
+    /** the next line without the newline, false at the end */
+    bool readLine(std::string &line)
+    {
+        char *buf = NULL;
+        size_t cap = 0;
+        ssize_t n = getline(&buf, &cap, in);
+        if (n >= 0) line.assign(buf, n > 0 && buf[n - 1] == '\n' ? n - 1 : n);
+        free(buf);
+        return n >= 0;
+    }
+};
+
+struct Request
+{
+    std::shared_ptr<Client> client;
+    std::string id;
+    std::vector<std::string> args;
+    std::string s;
+    std::string t;
+};
+
+class Server
+{
+    std::deque<Request> queue;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping;
+    size_t served;
+
+    std::vector<std::string> common;
+    char *argv0;
+    int listenFd;
+    /** clients of the socket, to hang up on them on shutdown */
+    std::vector<std::weak_ptr<Client> > clients;
+
+    /** the thread that reads the requests of a client of the socket */
+    struct Reader
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool> > done;
+    };
+
+    /** text up to a line with a single dot */
+    static bool readPart(Client &c, std::string &res)
+    {
+        std::string line;
+        while (c.readLine(line))
+        {
+            if (line == ".") return true;
+            res += line;
+            res += '\n';
+        }
+        return false;
+    }
+
+    void work()
+    {
+        ExprFactory efac;
+        std::unique_ptr<EZ3> z3(new EZ3(efac));
+        while (true)
+        {
+            Request r;
+            {
+                std::unique_lock<std::mutex> l(m);
+                cv.wait(l, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                r = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            std::vector<char*> args = toArgv(r.args, argv0);
+            std::string text;
+            const char *result = "error";
+            double st = nowMs();
+            {
+                raw_string_ostream out(text);
+                try
+                {
+                    Stats st;
+                    StatsScope scope(st);
+                    AE_TRACE(span, "request");
+                    AE_TRACE_ARG(span, "id", r.id);
+                    Expr s, t;
+                    {
+                        AE_TIMER("parse");
+                        s = z3_from_smtlib(*z3, r.s);
+                        t = z3_from_smtlib(*z3, r.t);
+                    }
+                    AeValVerdict res = solvePair(z3, s, t, args.size() - 1, args.data(), out);
+                    printStats(res, st, args.size() - 1, args.data(), out);
+                    result = verdictName(res);
+                }
+                catch (z3::exception &e)
+                {
+                    out << "Error: " << e.msg() << "\n";
+                }
+                catch (const std::exception &e)
+                {
+                    out << "Error: " << e.what() << "\n";
+                }
+            }
+            double ms = nowMs() - st;
+            efac.trim();
+
+            if (!text.empty() && text.back() != '\n') text += '\n';
+            r.client->send("result " + r.id + " " + result + " " +
+                           std::to_string((unsigned)ms) + "\n" + text + ".\n");
+            std::lock_guard<std::mutex> l(m);
+            served++;
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> l(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (listenFd < 0) return;
+        ::shutdown(listenFd, SHUT_RDWR);
+        // -- pending results are still sent
+        std::lock_guard<std::mutex> l(m);
+        for (auto &w : clients)
+            if (std::shared_ptr<Client> c = w.lock()) ::shutdown(c->out, SHUT_RD);
+    }
+
+    /** reads the requests of c until it quits; returns false on shutdown */
+    bool serve(std::shared_ptr<Client> c)
+    {
+        std::string line;
+        while (c->readLine(line))
+        {
+            std::istringstream ws(line);
+            std::string cmd;
+            if (!(ws >> cmd)) continue;
+            if (cmd == "quit") return true;
+            if (cmd == "shutdown") return false;
+            if (cmd == "stats")
+            {
+                std::lock_guard<std::mutex> l(m);
+                c->send("stats " + std::to_string(served) + " " +
+                        std::to_string(queue.size()) + "\n");
+                continue;
+            }
+            if (cmd != "solve")
+            {
+                c->send("error unknown request: " + cmd + "\n");
+                continue;
+            }
+
+            Request r;
+            r.client = c;
+            if (!(ws >> r.id)) r.id = "?";
+            std::string w;
+            while (ws >> w) r.args.push_back(w);
+            r.args.insert(r.args.end(), common.begin(), common.end());
+            if (!readPart(*c, r.s) || !readPart(*c, r.t)) return true;
+            // -- --debug writes to stdout, which is where the results of
+            // -- this client go
+            if (c->out == 1 && std::find(r.args.begin(), r.args.end(), "--debug") != r.args.end())
+            {
+                c->send("result " + r.id + " error 0\nError: --debug is not served on stdout\n.\n");
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> l(m);
+                queue.push_back(std::move(r));
+            }
+            cv.notify_one();
+        }
+        return true;
+    }
+
+public:
+    Server(int argc, char **argv) :
+        stopping(false), served(0), common(commonOptions(argc, argv)),
+        argv0(argv[0]), listenFd(-1) {}
+
+    int run(const char *socketPath, unsigned jobs)
+    {
+        // -- clients that go away must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < jobs; i++)
+            workers.push_back(std::thread([this]() { work(); }));
+
+        if (socketPath == NULL)
+            serve(std::make_shared<Client>(0, 1, false));
+        else
+        {
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+            unlink(socketPath);
+            listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd < 0 || ::bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+                listen(listenFd, 16) != 0)
+            {
+                std::cerr << "Error: cannot listen on " << socketPath << std::endl;
+                stop();
+                for (auto &w : workers) w.join();
+                return 1;
+            }
+
+            std::list<Reader> readers;
+            int fd;
+            while ((fd = accept(listenFd, NULL, NULL)) >= 0)
+            {
+                // -- the ones of the clients that are gone
+                for (auto it = readers.begin(); it != readers.end();)
+                {
+                    if (!*it->done) { ++it; continue; }
+                    it->thread.join();
+                    it = readers.erase(it);
+                }
+
+                std::shared_ptr<Client> c = std::make_shared<Client>(fd, dup(fd), true);
+                {
+                    std::lock_guard<std::mutex> l(m);
+                    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                                 [](const std::weak_ptr<Client> &w)
+                                                 { return w.expired(); }),
+                                  clients.end());
+                    clients.push_back(c);
+                    // -- accepted after stop () hung up on the others
+                    if (stopping) ::shutdown(c->out, SHUT_RD);
+                }
+                std::shared_ptr<std::atomic<bool> > done =
+                    std::make_shared<std::atomic<bool> >(false);
+                readers.push_back(Reader{std::thread([this, c, done]() {
+                    if (!serve(c)) stop();
+                    *done = true;
+                }), done});
+            }
+            // -- readers of the remaining clients stop when they hang up
+            for (auto &r : readers) r.thread.join();
+            close(listenFd);
+            unlink(socketPath);
+        }
+
+        stop();
+        for (auto &w : workers) w.join();
+        return 0;
+    }
+};
+
+/** Records the trace while in scope, and writes it to file at its end */
+class TraceFile
+{
+    const char *fname;
+
+public:
+    TraceFile(const char *f) : fname(f) { if (fname != NULL) Trace::start(); }
+
+    ~TraceFile()
+    {
+        if (fname == NULL) return;
+        Trace::stop();
+        std::ofstream out(fname);
+        Trace::write(out);
+        if (!out) std::cerr << "Error: cannot write " << fname << std::endl;
+    }
+};
+
 int main (int argc, char **argv)
 {
 
     ExprFactory efac;
+    TraceFile trace(getStrValue("--trace", NULL, argc, argv));
 
+    // -- the numbers of the command line (the ones of the tasks and the
+    // -- requests are errors of these only)
+    try
+    {
+        getOptions(argc, argv);
+        getIntValue("--budget", 0, argc, argv);
+        getJobs(argc, argv);
+    }
+    catch (const std::invalid_argument &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
-    bool skol = getBoolValue("--skol", false, argc, argv);
-    bool allincl = getBoolValue("--all-inclusive", false, argc, argv);
-    bool compact = getBoolValue("--compact", false, argc, argv);
-    bool debug = getBoolValue("--debug", false, argc, argv);
     bool sl = getBoolValue("--sl", false, argc, argv);
+    const char *manifest = getStrValue("--batch", NULL, argc, argv);
+
+    if (manifest != NULL) return runBatch(manifest, argc, argv);
+    const char *socketPath = getStrValue("--socket", NULL, argc, argv);
+    if (socketPath == NULL && getBoolValue("--server", false, argc, argv) &&
+        getBoolValue("--debug", false, argc, argv))
+    {
+        std::cerr << "Error: --debug is not served on stdout (use --socket)" << std::endl;
+        return 1;
+    }
+    if (socketPath != NULL || getBoolValue("--server", false, argc, argv))
+        return Server(argc, argv).run(socketPath, getJobs(argc, argv));
+
     if(sl) // for synth-lib format
     {
         char *fname = getSlFileName(1, argc, argv);
         cout << "read file " << fname << endl;
+        AeValOptions opts = getOptions(argc, argv);
+        opts.skol = true;
+        opts.allInclusive = false;
         try
         {
-            ae::MarshallVisitor::Solve(fname, efac, skol, allincl);
+            AeValResult res = ae::MarshallVisitor::Solve(fname, efac, opts);
+            printResult(res, opts);
+            if (opts.debug) res.stats.print(outs());
         }
         catch (const std::exception &Ex)
         {
@@ -95,16 +852,8 @@ int main (int argc, char **argv)
 
     }
 
-    EZ3 z3(efac);
-    Expr s = z3_from_smtlib_file (z3, getSmtFileName(1, argc, argv));
-    std::cout << "----------" << std::endl;
-    Expr t = z3_from_smtlib_file (z3, getSmtFileName(2, argc, argv));
-
-    if (allincl)
-        getAllInclusiveSkolem(s, t, debug, compact);
-    else
-        aeSolveAndSkolemize(s, t, skol, debug, compact);
+    std::unique_ptr<EZ3> z3(new EZ3(efac));
+    solveTask(z3, argc, argv, outs());
 
     return 0;
 }
-
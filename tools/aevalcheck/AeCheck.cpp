@@ -0,0 +1,103 @@
+#include <chrono>
+#include "ae/SkolemCheck.hpp"
+
+using namespace ufo;
+
+/** Semantic checker of Skolem functions
+ *
+ * Usage: aeval-check <s_part.smt2> <t_part.smt2> <skolem.smt2> [<skolem2.smt2>]
+ *   --timeout <ms> = time limit of each SMT query (default 10000)
+ *   --samples <n> = number of models of S to evaluate the Skolems at
+ *                   (default 20)
+ *
+ * Checks S /\ skolem => T case by case and that the Skolem has a model
+ * at each sample, also if it cannot be evaluated there (see
+ * ufo::SkolemChecker), and prints the verdicts and the size, number of
+ * cases and average evaluation time of the Skolem. If skolem2 is given,
+ * prints the same for it and compares the two on S, first at the
+ * samples and then by SMT; if they differ at a sample, prints it.
+ *
+ * Exits with 0 if the check holds (and the Skolems are equivalent), 1
+ * if it does not (or they differ), and 2 if it is unknown.
+ *
+ * Example:
+ *
+ * ./tools/aevalcheck/aeval-check
+ *   ../bench/tasks/fast_1_e8_747_extend_s_part.smt2
+ *   ../bench/tasks/fast_1_e8_747_extend_t_part.smt2
+ *   out.smt2 ../bench/skolems/fast_1_e8_747_extend_skolem.smt2
+ *
+ */
+
+const char *verdict (boost::tribool r, const char *yes, const char *no)
+{
+  return boost::indeterminate (r) ? "unknown" : r ? yes : no;
+}
+
+double now ()
+{
+  return std::chrono::duration<double, std::milli> (
+    std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void printInfo (const char *name, const SkolemInfo &info)
+{
+  outs () << name << ": " << info.size << " nodes, " << info.cases << " cases, ";
+  if (info.defs == 0) outs () << "not evaluated\n";
+  else outs () << info.defs << " definitions, eval " << (long) (1000 * info.evalUs) << " ns\n";
+}
+
+int main (int argc, char **argv)
+{
+  unsigned timeout = 10000, samples = 20;
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--timeout") == 0 && i + 1 < argc) timeout = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--samples") == 0 && i + 1 < argc) samples = atoi (argv[++i]);
+    else files.push_back (argv[i]);
+  }
+  if (files.size () < 3 || files.size () > 4)
+  {
+    std::cerr << "Usage: aeval-check <s_part.smt2> <t_part.smt2> <skolem.smt2> "
+              << "[<skolem2.smt2>]" << std::endl;
+    return 2;
+  }
+
+  ExprFactory efac;
+  EZ3 z3 (efac);
+  ExprVector forms;
+  for (auto f : files) forms.push_back (z3_from_smtlib_file (z3, f));
+
+  SkolemChecker sc (forms [0], forms [1], z3, timeout);
+  outs () << "samples: " << sc.sample (samples) << "\n";
+  printInfo ("skolem", sc.getInfo (forms [2]));
+
+  std::vector<boost::tribool> cases;
+  ExprMap witness;
+  double start = now ();
+  boost::tribool res = sc.check (forms [2], cases);
+  for (unsigned i = 0; i < cases.size (); i++)
+    outs () << "case " << i + 1 << ": " << verdict (cases [i], "valid", "invalid") << "\n";
+  boost::tribool def = sc.defined (forms [2], witness);
+  outs () << "defined: " << verdict (def, "yes", "no") << "\n";
+  for (auto &w : witness) outs () << "  " << *w.first << " = " << *w.second << "\n";
+  if (!def) res = false;
+  else if (boost::indeterminate (def) && res) res = boost::indeterminate;
+  outs () << "check: " << verdict (res, "valid", "invalid") << " ("
+          << (long) (now () - start) << " ms)\n";
+
+  if (forms.size () == 4)
+  {
+    printInfo ("skolem2", sc.getInfo (forms [3]));
+    start = now ();
+    boost::tribool eq = sc.compare (forms [2], forms [3], witness);
+    outs () << "compare: " << verdict (eq, "equivalent", "differs") << " ("
+            << (long) (now () - start) << " ms)\n";
+    for (auto &w : witness) outs () << "  " << *w.first << " = " << *w.second << "\n";
+    if (!eq) res = false;
+    else if (boost::indeterminate (eq) && res) res = boost::indeterminate;
+  }
+  outs ().flush ();
+  return boost::indeterminate (res) ? 2 : res ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include <thread>
+#include "ufo/Smt/EZ3.hh"
+#include "ufo/BenchUtils.hpp"
+
+using namespace ufo;
+
+/** Microbenchmark of hash-consing in ExprFactory
+ *
+ * Usage: exprbench [--rounds <n>] [--threads <t>] <file.smt2> ...
+ *
+ * All formulas are rebuilt bottom-up (one mk per DAG node) in a fresh
+ * ExprFactory, so that all lookups in the unique table miss, and then
+ * <n> more times in the same factory, so that all of them hit.
+ * Then makes small numerals in a loop. Prints the time per mk and
+ * the size of the unique table.
+ *
+ * Then prints the memory of the factory (see ExprMemStats), and how
+ * much of it trim () returns once the formulas are dropped. Also
+ * rebuilds all formulas in an ExprRegion of another factory, and
+ * prints its memory inside the region and after it.
+ *
+ * With --threads, also runs <t> threads on a shared concurrent
+ * ExprFactory. Each of them rebuilds all formulas <n> times and drops
+ * them, so that nodes are created and collected by different threads
+ * at once. Prints the throughput against a single thread, and checks
+ * that all threads got the same nodes.
+ *
+ * Example:
+ *
+ * ./tools/exprbench/exprbench ../bench/tasks/<name>.smt2 ...
+ * ./tools/exprbench/exprbench --threads 8 ../bench/tasks/<name>.smt2 ...
+ *
+ */
+
+void printMem (const char *name, ExprFactory &efac)
+{
+  ExprMemStats st = efac.getMemStats ();
+  std::cout << name << ": " << st.nodes << " nodes (peak " << st.peakNodes
+            << ", " << st.freeNodes << " free), used " << st.totalUsed ()
+            << " bytes (tiny " << st.used [EFA_TINY] << ", small " << st.used [EFA_SMALL]
+            << ", nodes " << st.used [EFA_NODES] << ", heap " << st.used [EFA_HEAP]
+            << ", peak " << st.peakUsed << "), reserved " << st.totalReserved ()
+            << ", regions " << st.regions << " (" << st.retired << " retired)\n";
+}
+
+/** wall time of t threads doing rounds rebuilds each on a concurrent factory */
+double runThreads (unsigned t, unsigned rounds, std::vector<ENode*> &nodes,
+                   std::vector<std::vector<unsigned> > &args, bool &shared)
+{
+  ExprFactory efac (true);
+  std::vector<ExprVector> res (t);
+  std::vector<std::thread> workers;
+
+  double start = nowNs ();
+  for (unsigned i = 0; i < t; i++)
+    workers.push_back (std::thread ([&, i] ()
+    {
+      for (unsigned r = 0; r < rounds; r++)
+      {
+        // -- interleave threads that drop everything with ones that do not
+        ExprVector tmp;
+        rebuild (nodes, args, efac, (i + r) % 2 ? tmp : res [i]);
+      }
+    }));
+  for (auto &w : workers) w.join ();
+  double time = nowNs () - start;
+
+  for (unsigned i = 1; i < t; i++)
+    if (!res [i].empty () && !res [0].empty () && res [i] != res [0]) shared = false;
+  res.clear ();
+  if (efac.getUniqueSize () != 0) shared = false;
+  return time;
+}
+
+int main (int argc, char **argv)
+{
+  unsigned rounds = 10;
+  unsigned threads = 0;
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--rounds") == 0 && i + 1 < argc) rounds = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi (argv[++i]);
+    else files.push_back (argv[i]);
+  }
+
+  ExprFactory src;
+  EZ3 z3 (src);
+  ExprVector forms;
+  for (auto f : files) forms.push_back (z3_from_smtlib_file (z3, f));
+
+  std::vector<ENode*> nodes;
+  std::vector<std::vector<unsigned> > args;
+  std::unordered_map<ENode*, unsigned> pos;
+  for (auto &f : forms) flatten (f, nodes, args, pos);
+  size_t mks = nodes.size ();
+
+  ExprFactory efac;
+  ExprVector copies;
+
+  double start = nowNs ();
+  rebuild (nodes, args, efac, copies);
+  double miss = nowNs () - start;
+
+  start = nowNs ();
+  for (unsigned r = 0; r < rounds; r++)
+  {
+    ExprVector tmp;
+    rebuild (nodes, args, efac, tmp);
+  }
+  double hit = nowNs () - start;
+
+  // -- small numerals, as built by the simplifiers
+  const unsigned nums = 1000000;
+  start = nowNs ();
+  for (unsigned i = 0; i < nums; i++) mkTerm (mpz_class ((int)(i % 256) - 128), efac);
+  double mpz = nowNs () - start;
+  start = nowNs ();
+  for (unsigned i = 0; i < nums; i++) mkTerm (mpq_class ((int)(i % 256) - 128, 3), efac);
+  double mpq = nowNs () - start;
+
+  std::cout << "formulas: " << forms.size () << ", nodes: " << mks << "\n";
+  std::cout << "mk (new): " << miss / mks << " ns\n";
+  std::cout << "mk (existing): " << hit / (mks * std::max (rounds, 1u)) << " ns\n";
+  std::cout << "mk numeral (mpz): " << mpz / nums << " ns\n";
+  std::cout << "mk numeral (mpq): " << mpq / nums << " ns\n";
+  std::cout << "unique table: " << efac.getUniqueSize () << " nodes, "
+            << efac.getUniqueBytes () << " bytes\n";
+
+  printMem ("memory", efac);
+  copies.clear ();
+  printMem ("memory (formulas dropped)", efac);
+  size_t released = efac.trim ();
+  std::cout << "trim: " << released << " bytes released\n";
+  printMem ("memory (trimmed)", efac);
+
+  ExprFactory scoped;
+  {
+    ExprRegion region (scoped);
+    ExprVector tmp;
+    rebuild (nodes, args, scoped, tmp);
+    printMem ("region", scoped);
+  }
+  printMem ("region (closed)", scoped);
+
+  if (threads > 0)
+  {
+    bool shared = true;
+    double one = runThreads (1, rounds, nodes, args, shared);
+    double many = runThreads (threads, rounds, nodes, args, shared);
+    double ops = (double)mks * std::max (rounds, 1u);
+    std::cout << "concurrent mk, 1 thread: " << one / ops << " ns\n";
+    std::cout << "concurrent mk, " << threads << " threads: "
+              << ops * threads / many * 1000 << " mk/us, speedup "
+              << one * threads / many << "\n";
+    std::cout << "shared nodes: " << (shared ? "ok" : "FAILED") << "\n";
+    if (!shared) return 1;
+  }
+  return 0;
+}
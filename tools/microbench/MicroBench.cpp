@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include "ae/SMTUtils.hpp"
+#include "ufo/BenchUtils.hpp"
+
+using namespace ufo;
+
+/** Microbenchmarks of the Expr and Z3-bridge hot paths
+ *
+ * Usage: microbench [options] <tasks dir>
+ *
+ *   --reps <n> = timed repetitions of each benchmark (default 5)
+ *   --min-ms <ms> = least time of a repetition, which calls the
+ *                   benchmark as many times as it takes (default 50)
+ *   --timeout <ms> = of the queries that get models and of implies
+ *                    (default 1000)
+ *   --filter <str> = to read only the tasks with str in their name
+ *   --out <file> = to write the results, one line of JSON per benchmark
+ *   --baseline <file> = results of an earlier run to compare with
+ *
+ * Reads the S and T formulas of all <name>_s_part.smt2 /
+ * <name>_t_part.smt2 pairs of the directory, and runs
+ *
+ *   mk (new)            -- mkNary of each DAG node, bottom-up, in a fresh
+ *                          ExprFactory: canonize () misses (op: node)
+ *   mk (existing)       -- the same in a factory that has them (op: node)
+ *   mkTerm (mpz, mpq)   -- small numerals (op: numeral)
+ *   replaceAll          -- all constants by fresh ones (op: formula)
+ *   filter (IsConst)    -- filterConsts (op: formula)
+ *   simplifyArithm, simplifyBool, convertIntsToReals, simplify
+ *                       -- the ExprSimpl rewriters (op: formula)
+ *   marshal, unmarshal  -- ZContext translation of each formula, with
+ *                          the translation cache cleared before
+ *                          (cold) or filled (cached) (op: formula)
+ *   ZModel::eval        -- T at a model of S /\ T (op: formula)
+ *   SMTUtils::implies   -- S => T, from the Exprs to the answer (op: query)
+ *
+ * Each benchmark runs once to warm up and then --reps times, each of
+ * them at least --min-ms long. Prints, for each benchmark, the number of
+ * ops, the median time per op and the allocations (calls to malloc, or
+ * to operator new if malloc cannot be counted) per op of the repetition
+ * with the fewest. The inputs are
+ * read in the order of their names, so that runs over the same tasks
+ * do the same work.
+ *
+ * With --baseline, then prints the ratio of both for each benchmark
+ * found in both runs, and the geometric mean of the time ratios.
+ *
+ * Example:
+ *
+ * ./tools/microbench/microbench ../bench/tasks --out new.jsonl --baseline old.jsonl
+ *
+ */
+
+static unsigned long allocs = 0;
+
+#ifdef __GLIBC__
+extern "C"
+{
+  void *__libc_malloc (size_t);
+  void *__libc_calloc (size_t, size_t);
+  void *__libc_realloc (void *, size_t);
+
+  void *malloc (size_t n) { allocs++; return __libc_malloc (n); }
+  void *calloc (size_t n, size_t s) { allocs++; return __libc_calloc (n, s); }
+  void *realloc (void *p, size_t n) { allocs++; return __libc_realloc (p, n); }
+}
+#else
+void *operator new (size_t n)
+{
+  allocs++;
+  if (void *p = std::malloc (n)) return p;
+  throw std::bad_alloc ();
+}
+void operator delete (void *p) noexcept { std::free (p); }
+#endif
+
+/** gives access to the translation of ZContext */
+class BenchZ3 : public EZ3
+{
+public:
+  BenchZ3 (ExprFactory &efac) : EZ3 (efac) {}
+  using EZ3::toAst;
+  using EZ3::toExpr;
+};
+
+struct MicroResult
+{
+  std::string name;
+  size_t ops;
+  double ns;
+  double allocs;
+
+  MicroResult () : ops (0), ns (0), allocs (0) {}
+};
+
+class MicroBench
+{
+  unsigned reps;
+  double minNs;
+  std::ofstream *out;
+
+public:
+  std::vector<MicroResult> results;
+
+  MicroBench (unsigned r, double minMs, std::ofstream *o) :
+    reps (std::max (r, 1u)), minNs (minMs * 1e6), out (o) {}
+
+  /** body does ops operations; setup is not timed */
+  void run (const char *name, size_t ops, std::function<void ()> body,
+            std::function<void ()> setup = [] () {})
+  {
+    if (ops == 0) return;
+
+    // -- the first call warms up, and tells how many calls make a repetition
+    setup ();
+    double start = nowNs ();
+    body ();
+    unsigned calls = std::max (1.0, std::ceil (minNs / std::max (nowNs () - start, 1.0)));
+
+    std::vector<double> times;
+    unsigned long fewest = ~0ul;
+    for (unsigned r = 0; r < reps; r++)
+    {
+      double time = 0;
+      unsigned long a = 0;
+      for (unsigned c = 0; c < calls; c++)
+      {
+        setup ();
+        unsigned long before = allocs;
+        start = nowNs ();
+        body ();
+        time += nowNs () - start;
+        a += allocs - before;
+      }
+      times.push_back (time / calls);
+      fewest = std::min (fewest, a / calls);
+    }
+    std::sort (times.begin (), times.end ());
+
+    MicroResult m;
+    m.name = name;
+    m.ops = ops;
+    m.ns = times [times.size () / 2] / ops;
+    m.allocs = (double) fewest / ops;
+    results.push_back (m);
+
+    std::cout << std::left << std::setw (24) << name << std::right << std::setw (9) << ops
+              << " ops " << std::fixed << std::setprecision (1) << std::setw (12) << m.ns
+              << " ns/op " << std::setprecision (2) << std::setw (10) << m.allocs
+              << " allocs/op" << std::endl;
+    if (out != NULL)
+      *out << std::fixed << "{\"name\": \"" << name << "\", \"ops\": " << ops << ", \"ns_op\": "
+           << std::setprecision (1) << m.ns << ", \"allocs_op\": " << std::setprecision (2)
+           << m.allocs << "}\n";
+  }
+};
+
+/** the fields of a line written by MicroBench::run */
+void parseResult (const std::string &line, MicroResult &m)
+{
+  m.ns = atof (jsonField (line, "ns_op").c_str ());
+  m.allocs = atof (jsonField (line, "allocs_op").c_str ());
+}
+
+int main (int argc, char **argv)
+{
+  const char *outFile = NULL, *baseline = NULL, *filter = NULL, *dir = NULL;
+  unsigned reps = 5, timeout = 1000;
+  double minMs = 50;
+  for (int i = 1; i < argc; i++)
+  {
+    bool more = i + 1 < argc;
+    if (strcmp (argv[i], "--reps") == 0 && more) reps = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--min-ms") == 0 && more) minMs = atof (argv[++i]);
+    else if (strcmp (argv[i], "--timeout") == 0 && more) timeout = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--filter") == 0 && more) filter = argv[++i];
+    else if (strcmp (argv[i], "--out") == 0 && more) outFile = argv[++i];
+    else if (strcmp (argv[i], "--baseline") == 0 && more) baseline = argv[++i];
+    else dir = argv[i];
+  }
+  if (dir == NULL)
+  {
+    std::cerr << "Usage: microbench [options] <tasks dir>" << std::endl;
+    return 1;
+  }
+
+  std::map<std::string, MicroResult> base;
+  if (baseline != NULL && !readResults (baseline, base, parseResult))
+  {
+    std::cerr << "Error: cannot read " << baseline << std::endl;
+    return 1;
+  }
+  std::ofstream out;
+  if (outFile != NULL)
+  {
+    out.open (outFile);
+    if (!out)
+    {
+      std::cerr << "Error: cannot write " << outFile << std::endl;
+      return 1;
+    }
+  }
+
+  ExprFactory efac;
+  BenchZ3 z3 (efac);
+  EZ3 &ez3 = z3;
+  ExprVector forms, ss, ts;
+  for (auto &name : getTasks (dir, filter))
+  {
+    ss.push_back (z3_from_smtlib_file (ez3, (std::string (dir) + "/" + name + "_s_part.smt2").c_str ()));
+    ts.push_back (z3_from_smtlib_file (ez3, (std::string (dir) + "/" + name + "_t_part.smt2").c_str ()));
+    forms.push_back (ss.back ());
+    forms.push_back (ts.back ());
+  }
+
+  std::vector<ENode*> nodes;
+  std::vector<std::vector<unsigned> > args;
+  std::unordered_map<ENode*, unsigned> pos;
+  for (auto &f : forms) flatten (f, nodes, args, pos);
+  std::cout << "tasks: " << ss.size () << ", formulas: " << forms.size ()
+            << ", nodes: " << nodes.size () << std::endl;
+
+  MicroBench mb (reps, minMs, outFile == NULL ? NULL : &out);
+  ExprVector res;
+
+  // -- Expr construction
+  {
+    std::unique_ptr<ExprFactory> fresh;
+    ExprVector copies;
+    mb.run ("mk (new)", nodes.size (), [&] () { rebuild (nodes, args, *fresh, copies); },
+            [&] () { copies.clear (); fresh.reset (new ExprFactory ()); });
+    copies.clear ();
+    fresh.reset ();
+
+    ExprFactory same;
+    rebuild (nodes, args, same, copies);
+    mb.run ("mk (existing)", nodes.size (), [&] () { rebuild (nodes, args, same, res); });
+    res.clear ();
+    copies.clear ();
+
+    const unsigned nums = 100000;
+    mb.run ("mkTerm (mpz)", nums, [&] () {
+        for (unsigned i = 0; i < nums; i++) mkTerm (mpz_class ((int)(i % 256) - 128), efac); });
+    mb.run ("mkTerm (mpq)", nums, [&] () {
+        for (unsigned i = 0; i < nums; i++) mkTerm (mpq_class ((int)(i % 256) - 128, 3), efac); });
+  }
+
+  // -- DAG traversals and rewriting
+  std::vector<ExprVector> srcs (forms.size ()), dsts (forms.size ());
+  for (unsigned i = 0; i < forms.size (); i++)
+  {
+    filterConsts (forms [i], std::back_inserter (srcs [i]));
+    for (auto &c : srcs [i])
+      dsts [i].push_back (bind::mkConst (
+        mkTerm<std::string> (lexical_cast<std::string> (c) + "'", efac),
+        bind::typeOf (c)));
+  }
+  res.resize (forms.size ());
+  auto pass = [&] (const char *name, std::function<Expr (unsigned)> f) {
+    mb.run (name, forms.size (), [&] () {
+        for (unsigned i = 0; i < forms.size (); i++) res [i] = f (i); });
+  };
+  pass ("replaceAll", [&] (unsigned i) { return replaceAll (forms [i], srcs [i], dsts [i]); });
+  std::vector<ExprVector> consts (forms.size ());
+  mb.run ("filter (IsConst)", forms.size (), [&] () {
+      for (unsigned i = 0; i < forms.size (); i++)
+      {
+        consts [i].clear ();
+        filterConsts (forms [i], std::back_inserter (consts [i]));
+      } });
+  pass ("simplifyArithm", [&] (unsigned i) { return simplifyArithm (forms [i]); });
+  pass ("simplifyBool", [&] (unsigned i) { return simplifyBool (forms [i]); });
+  pass ("convertIntsToReals", [&] (unsigned i) { return convertIntsToReals<PLUS> (forms [i]); });
+  const unsigned rules = SIMPL_ARITH | SIMPL_BOOL | SIMPL_INT_TO_REAL;
+  pass ("simplify", [&] (unsigned i) { return simplify (forms [i], rules); });
+  res.clear ();
+
+  // -- Z3 bridge
+  {
+    std::vector<z3::ast> asts;
+    for (auto &f : forms) asts.push_back (z3.toAst (f));
+    auto marshal = [&] () {
+      for (unsigned i = 0; i < forms.size (); i++) asts [i] = z3.toAst (forms [i]); };
+    mb.run ("marshal (cold)", forms.size (), marshal, [&] () { z3.clearCache (); });
+    mb.run ("marshal (cached)", forms.size (), marshal);
+
+    res.resize (forms.size ());
+    auto unmarshal = [&] () {
+      for (unsigned i = 0; i < forms.size (); i++) res [i] = z3.toExpr (asts [i]); };
+    mb.run ("unmarshal (cold)", forms.size (), unmarshal, [&] () { z3.clearCache (); });
+    mb.run ("unmarshal (cached)", forms.size (), unmarshal);
+    res.clear ();
+  }
+
+  {
+    ZSolver<EZ3> smt (z3);
+    smt.setLimits (timeout);
+    std::vector<ZSolver<EZ3>::Model> models;
+    ExprVector evalTs;
+    for (unsigned i = 0; i < ss.size (); i++)
+    {
+      smt.reset ();
+      smt.assertExpr (ss [i]);
+      smt.assertExpr (ts [i]);
+      if (!smt.solve ()) continue;
+      models.push_back (smt.getModel ());
+      evalTs.push_back (ts [i]);
+    }
+    res.resize (models.size ());
+    mb.run ("ZModel::eval", models.size (), [&] () {
+        for (unsigned i = 0; i < models.size (); i++) res [i] = models [i].eval (evalTs [i], true); });
+    res.clear ();
+  }
+
+  {
+    SMTUtils u (efac, &z3);
+    u.setLimits (timeout);
+    mb.run ("SMTUtils::implies", ss.size (), [&] () {
+        for (unsigned i = 0; i < ss.size (); i++) u.implies (ss [i], ts [i]); });
+  }
+
+  if (baseline == NULL) return 0;
+
+  unsigned common = 0;
+  double logRatio = 0;
+  std::cout << "compared to " << baseline << ":\n";
+  for (auto &m : mb.results)
+  {
+    auto it = base.find (m.name);
+    if (it == base.end ()) continue;
+    const MicroResult &b = it->second;
+    double ratio = m.ns / std::max (b.ns, 0.1);
+    common++;
+    logRatio += std::log (ratio);
+    std::cout << "  " << std::left << std::setw (24) << m.name << std::right
+              << std::setprecision (1) << std::setw (12) << b.ns << " -> " << std::setw (12)
+              << m.ns << " ns/op (" << std::setprecision (2) << ratio << "x), "
+              << b.allocs << " -> " << m.allocs << " allocs/op\n";
+  }
+  std::cout << "geometric mean ratio of " << common << " benchmarks: " << std::setprecision (3)
+            << (common == 0 ? 1 : std::exp (logRatio / common)) << std::endl;
+  return 0;
+}
@@ -0,0 +1,162 @@
+#include "ae/ExprSimpl.hpp"
+#include "ufo/BenchUtils.hpp"
+
+using namespace ufo;
+
+/** Microbenchmark of DAG rewriting
+ *
+ * Usage: rwbench [--rounds <n>] <file.smt2> ...
+ *
+ * Runs each rewriter <n> times over all formulas and prints the time
+ * per DAG node of the input, and the DAG size of the results. The
+ * rewriters are
+ *
+ *   replaceAll     -- all constants by fresh ones, in one pass
+ *   replaceAll 1   -- a single constant per formula by a fresh one
+ *   simplifyArithm, simplifyBool, convertIntsToReals -- from ExprSimpl
+ *   passes         -- simplifyArithm, simplifyBool, convertIntsToReals<DIV>
+ *                     one after another
+ *   simplify       -- the same rules fused into one Simplifier pass
+ *   identity       -- a dagVisit that does not change anything
+ *
+ * Then prints the counters of the fused pass.
+ *
+ * Finally, takes all numeric comparisons of the formulas and moves each
+ * of their constants to the left hand side, <n> times, per pair
+ *
+ *   mover (tree)   -- by rewriting the Expr trees (rewriteHelperM)
+ *   mover (linear) -- through LinForm, as ineqMover does now
+ *
+ * and prints how many of the comparisons are distinct up to linear
+ * arithmetic.
+ *
+ * Example:
+ *
+ * ./tools/rwbench/rwbench ../bench/tasks/<name>.smt2 ...
+ *
+ */
+
+/** ineqMover as it was before LinForm */
+Expr treeMover (Expr e, Expr var)
+{
+  if (isOpX<LEQ>(e)) e = rewriteHelperM<LEQ>(e, var);
+  else if (isOpX<GEQ>(e)) e = rewriteHelperM<GEQ>(e, var);
+  else if (isOpX<LT>(e)) e = rewriteHelperM<LT>(e, var);
+  else if (isOpX<GT>(e)) e = rewriteHelperM<GT>(e, var);
+  else if (isOpX<EQ>(e)) e = rewriteHelperM<EQ>(e, var);
+  else if (isOpX<NEQ>(e)) e = rewriteHelperM<NEQ>(e, var);
+  return ineqReverter (e);
+}
+
+struct IdentityVisitor
+{
+  VisitAction operator() (Expr e) { return VisitAction::doKids (); }
+};
+
+template <typename F>
+void run (const char *name, ExprVector &forms, size_t nodes, unsigned rounds, F f)
+{
+  ExprVector res (forms.size ());
+  double start = nowNs ();
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < forms.size (); i++) res [i] = f (i, forms [i]);
+  double time = nowNs () - start;
+  size_t out = 0;
+  for (auto &e : res) if (e) out += dagSize (e);
+  std::cout << name << ": " << time / (nodes * std::max (rounds, 1u)) << " ns, "
+            << out << " nodes\n";
+}
+
+int main (int argc, char **argv)
+{
+  unsigned rounds = 10;
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--rounds") == 0 && i + 1 < argc) rounds = atoi (argv[++i]);
+    else files.push_back (argv[i]);
+  }
+
+  ExprFactory efac;
+  EZ3 z3 (efac);
+  ExprVector forms;
+  for (auto f : files) forms.push_back (z3_from_smtlib_file (z3, f));
+
+  size_t nodes = 0;
+  std::vector<ExprVector> srcs (forms.size ()), dsts (forms.size ());
+  for (unsigned i = 0; i < forms.size (); i++)
+  {
+    nodes += dagSize (forms [i]);
+    filterConsts (forms [i], std::back_inserter (srcs [i]));
+    for (auto &c : srcs [i])
+      dsts [i].push_back (bind::mkConst (
+        mkTerm<std::string> (lexical_cast<std::string> (c) + "'", efac),
+        bind::typeOf (c)));
+  }
+  std::cout << "formulas: " << forms.size () << ", nodes: " << nodes << "\n";
+
+  run ("replaceAll", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return replaceAll (e, srcs [i], dsts [i]); });
+  run ("replaceAll 1", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return srcs [i].empty () ? e : replaceAll (e, srcs [i][0], dsts [i][0]); });
+  run ("simplifyArithm", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return simplifyArithm (e); });
+  run ("simplifyBool", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return simplifyBool (e); });
+  run ("convertIntsToReals", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return convertIntsToReals<PLUS> (e); });
+  run ("identity", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { IdentityVisitor v; return dagVisit (v, e); });
+
+  const unsigned rules = SIMPL_ARITH | SIMPL_BOOL | SIMPL_INT_TO_REAL;
+  run ("passes", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return convertIntsToReals<DIV> (simplifyBool (simplifyArithm (e))); });
+  run ("simplify", forms, nodes, rounds, [&] (unsigned i, Expr e)
+       { return simplify (e, rules); });
+
+  SimplStats stats;
+  for (auto &e : forms)
+  {
+    Simplifier s (efac, rules);
+    s (e);
+    stats.visited += s.getStats ().visited;
+    stats.rewrites += s.getStats ().rewrites;
+    stats.capped += s.getStats ().capped;
+  }
+  std::cout << "simplify: " << stats.visited << " nodes visited, "
+            << stats.rewrites << " rewrites, " << stats.capped << " cut off\n";
+
+  ExprSet cmps;
+  for (auto &e : forms)
+    filter (e, [] (Expr a) { return isOp<ComparissonOp>(a) && a->arity () == 2 &&
+                               isNumeric (a->left ()) && isNumeric (a->right ()); },
+            std::inserter (cmps, cmps.begin ()));
+  std::vector<std::pair<Expr, Expr> > moves;
+  std::set<std::pair<std::string, LinForm> > distinct;
+  for (auto &c : cmps)
+  {
+    ExprVector vars;
+    filterConsts (c, std::back_inserter (vars));
+    for (auto &v : vars)
+      if (bind::isIntConst (v) || bind::isRealConst (v)) moves.push_back (std::make_pair (c, v));
+    distinct.insert (std::make_pair (typeid (c->op ()).name (), cmpDiff (c)));
+  }
+
+  ExprVector res (moves.size ());
+  double start = nowNs ();
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < moves.size (); i++)
+      res [i] = treeMover (moves [i].first, moves [i].second);
+  double tree = nowNs () - start;
+  start = nowNs ();
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < moves.size (); i++)
+      res [i] = ineqMover (moves [i].first, moves [i].second);
+  double lin = nowNs () - start;
+  double ops = (double)moves.size () * std::max (rounds, 1u);
+  std::cout << "comparisons: " << cmps.size () << ", distinct up to arithmetic: "
+            << distinct.size () << ", moves: " << moves.size () << "\n";
+  std::cout << "mover (tree): " << tree / ops << " ns\n";
+  std::cout << "mover (linear): " << lin / ops << " ns\n";
+  return 0;
+}